@@ -9,7 +9,10 @@ pkgs.stdenv.mkDerivation {
   src = ../.;
 
   buildPhase = ''
-    $CC src/main.c src/ppm.c src/sequential.c -lm -o pp-ep2
+    $CC src/main.c src/arena.c src/batch.c src/numa.c src/ppm.c src/shard.c \
+      src/summed_area.c src/simd.c src/stream.c src/sweep.c src/temporal.c \
+      src/tiling.c src/thread_pool.c src/trace.c src/tune.c src/sequential.c \
+      -lm -o pp-ep2
   '';
 
   installPhase = ''
@@ -0,0 +1,226 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#define _GNU_SOURCE
+#include "arena.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size the mapped blocks are rounded to when huge pages are asked for
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef enum arena_pages {
+  ARENA_PAGES_REGULAR,
+  ARENA_PAGES_THP,
+  ARENA_PAGES_HUGETLB,
+} ArenaPages;
+
+// Header right before every block, which keeps the block aligned
+typedef struct arena_block {
+  _Alignas(ARENA_ALIGNMENT) struct arena_block *next;
+  // Whole mapping, header included; 0 for blocks left to `malloc`
+  size_t mapping_size;
+  // Bytes asked for by the current owner
+  size_t size;
+  int is_free;
+  // Mapped by `alloc_shared_arena`, outside of the kept blocks
+  int is_shared;
+} ArenaBlock;
+
+typedef struct arena {
+  pthread_mutex_t mutex;
+  // Every mapped block, in use or not
+  ArenaBlock *blocks;
+  ArenaPages pages;
+  ArenaStats stats;
+} Arena;
+
+static Arena arena = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                      .blocks = NULL,
+                      .pages = ARENA_PAGES_REGULAR};
+
+static inline size_t round_arena_size(size_t size, size_t multiple) {
+  return (size + multiple - 1) / multiple * multiple;
+}
+
+// Must hold the mutex
+static void count_arena_allocation(size_t size) {
+  arena.stats.live_bytes += size;
+  if (arena.stats.live_bytes > arena.stats.peak_bytes)
+    arena.stats.peak_bytes = arena.stats.live_bytes;
+}
+
+static ArenaBlock *map_arena_block(size_t size) {
+  size_t page_size = (arena.pages == ARENA_PAGES_REGULAR)
+                         ? (size_t)sysconf(_SC_PAGESIZE)
+                         : ARENA_HUGE_PAGE_SIZE;
+  size_t mapping_size =
+      round_arena_size(sizeof(ArenaBlock) + size, page_size);
+  void *mapping = MAP_FAILED;
+  if (arena.pages == ARENA_PAGES_HUGETLB)
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mapping == MAP_FAILED) {
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+      return NULL;
+    // Only advice: the kernel may still back it with regular pages
+    if (arena.pages != ARENA_PAGES_REGULAR)
+      madvise(mapping, mapping_size, MADV_HUGEPAGE);
+  }
+  ArenaBlock *block = mapping;
+  block->mapping_size = mapping_size;
+  return block;
+}
+
+// Must hold the mutex. Kept blocks too small for `size` are unmapped, as
+// images only tend to grow from there.
+static ArenaBlock *reuse_arena_block(size_t size) {
+  ArenaBlock *best = NULL;
+  for (ArenaBlock *block = arena.blocks; block != NULL; block = block->next)
+    if (block->is_free && block->mapping_size - sizeof(ArenaBlock) >= size &&
+        (best == NULL || block->mapping_size < best->mapping_size))
+      best = block;
+  if (best != NULL)
+    return best;
+  for (ArenaBlock **link = &arena.blocks; *link != NULL;) {
+    ArenaBlock *block = *link;
+    if (!block->is_free) {
+      link = &block->next;
+      continue;
+    }
+    *link = block->next;
+    arena.stats.mapped_bytes -= block->mapping_size;
+    munmap(block, block->mapping_size);
+  }
+  return NULL;
+}
+
+void *alloc_arena(size_t size) {
+  ArenaBlock *block;
+  if (size < ARENA_MAP_THRESHOLD) {
+    block = aligned_alloc(ARENA_ALIGNMENT,
+                          sizeof(ArenaBlock) +
+                              round_arena_size(size, ARENA_ALIGNMENT));
+    if (block == NULL)
+      return NULL;
+    block->mapping_size = 0;
+    block->size = size;
+    block->is_shared = 0;
+    pthread_mutex_lock(&arena.mutex);
+    count_arena_allocation(size);
+    pthread_mutex_unlock(&arena.mutex);
+    return block + 1;
+  }
+  pthread_mutex_lock(&arena.mutex);
+  block = reuse_arena_block(size);
+  if (block != NULL) {
+    arena.stats.reuse_count++;
+  } else {
+    block = map_arena_block(size);
+    if (block == NULL) {
+      pthread_mutex_unlock(&arena.mutex);
+      return NULL;
+    }
+    block->next = arena.blocks;
+    arena.blocks = block;
+    arena.stats.mapped_bytes += block->mapping_size;
+    arena.stats.map_count++;
+  }
+  block->is_free = 0;
+  block->is_shared = 0;
+  block->size = size;
+  count_arena_allocation(size);
+  pthread_mutex_unlock(&arena.mutex);
+  return block + 1;
+}
+
+void *alloc_shared_arena(size_t size) {
+  size_t mapping_size = round_arena_size(sizeof(ArenaBlock) + size,
+                                         (size_t)sysconf(_SC_PAGESIZE));
+  int fd = memfd_create("pp-ep2-arena", MFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, (off_t)mapping_size) == 0)
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+  // The mapping keeps the memory alive on its own
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+  ArenaBlock *block = mapping;
+  *block = (ArenaBlock){.next = NULL,
+                        .mapping_size = mapping_size,
+                        .size = size,
+                        .is_free = 0,
+                        .is_shared = 1};
+  pthread_mutex_lock(&arena.mutex);
+  arena.stats.map_count++;
+  count_arena_allocation(size);
+  pthread_mutex_unlock(&arena.mutex);
+  return block + 1;
+}
+
+void free_arena(void *void_ptr) {
+  if (void_ptr == NULL)
+    return;
+  ArenaBlock *block = (ArenaBlock *)void_ptr - 1;
+  pthread_mutex_lock(&arena.mutex);
+  arena.stats.live_bytes -= block->size;
+  // Mapped blocks stay mapped (and faulted in) for the next image
+  if (block->mapping_size > 0 && !block->is_shared)
+    block->is_free = 1;
+  pthread_mutex_unlock(&arena.mutex);
+  if (block->is_shared)
+    munmap(block, block->mapping_size);
+  else if (block->mapping_size == 0)
+    free(block);
+}
+
+void read_arena_stats(ArenaStats *stats) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&arena.mutex);
+  *stats = arena.stats;
+  stats->resident_bytes = 0;
+  for (ArenaBlock *block = arena.blocks; block != NULL; block = block->next) {
+    size_t page_count = block->mapping_size / page_size;
+    unsigned char *pages = malloc(page_count);
+    if (pages == NULL)
+      continue;
+    if (mincore(block, block->mapping_size, pages) == 0)
+      for (size_t page = 0; page < page_count; page++)
+        stats->resident_bytes += (pages[page] & 1) ? page_size : 0;
+    free(pages);
+  }
+  pthread_mutex_unlock(&arena.mutex);
+}
+
+static void report_arena(void) {
+  ArenaStats stats;
+  read_arena_stats(&stats);
+  fprintf(stderr,
+          "Arena: %lu bytes at peak, %lu still live, %lu mapped (%lu "
+          "resident), %lu maps, %lu reuses\n",
+          stats.peak_bytes, stats.live_bytes, stats.mapped_bytes,
+          stats.resident_bytes, stats.map_count, stats.reuse_count);
+}
+
+// Runs before `main`, so the page mode is settled before any allocation
+__attribute__((constructor)) static void init_arena(void) {
+  const char *pages = getenv(ARENA_HUGE_PAGES_VARIABLE);
+  if (pages != NULL && strcmp(pages, "thp") == 0)
+    arena.pages = ARENA_PAGES_THP;
+  else if (pages != NULL && strcmp(pages, "hugetlb") == 0)
+    arena.pages = ARENA_PAGES_HUGETLB;
+  if (getenv(ARENA_STATS_VARIABLE) != NULL)
+    atexit(report_arena);
+}
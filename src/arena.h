@@ -0,0 +1,43 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include <stddef.h>
+
+// `thp` advises transparent huge pages for the mapped blocks, `hugetlb`
+// maps them from the reserved huge pages (falling back to `thp` when there
+// are none left); anything else keeps the regular pages
+#define ARENA_HUGE_PAGES_VARIABLE "PP_EP2_HUGE_PAGES"
+// Set to print the arena stats to stderr at exit
+#define ARENA_STATS_VARIABLE "PP_EP2_ARENA_STATS"
+// Every block starts on a cache line, which is also the widest SIMD load
+#define ARENA_ALIGNMENT 64
+// Smaller blocks are left to `malloc`; larger ones are mapped and, once
+// freed, kept for the next allocations instead of being unmapped
+#define ARENA_MAP_THRESHOLD (256 * 1024)
+
+typedef struct arena_stats {
+  // Bytes handed out and not freed yet, and the most there ever were
+  size_t live_bytes, peak_bytes;
+  // Bytes of the mapped blocks, in use or kept for reuse, and how many of
+  // them are backed by memory right now
+  size_t mapped_bytes, resident_bytes;
+  // Blocks that had to be mapped, and allocations served by a kept one
+  size_t map_count, reuse_count;
+} ArenaStats;
+
+// ARENA_ALIGNMENT-aligned block of `size` bytes, with unspecified contents;
+// NULL on failure
+void *alloc_arena(size_t size);
+// Same as `alloc_arena`, but the block is always mapped from its own `memfd`
+// as shared memory, so processes forked afterwards write to the same pages.
+// It is unmapped as soon as it is freed.
+void *alloc_shared_arena(size_t size);
+// Accepts NULL, like `free`
+void free_arena(void *block);
+void read_arena_stats(ArenaStats *stats);
+
+#endif // ARENA_HEADER
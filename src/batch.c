@@ -0,0 +1,420 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "batch.h"
+#include "filter.h"
+#include "ppm.h"
+#include "temporal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+// An image travelling through the pipeline; its buffers are kept between
+// inputs and only grow when a larger image comes along
+typedef struct batch_slot {
+  size_t input;
+  PpmImage *image;
+  int is_ok;
+} BatchSlot;
+
+// FIFO between two stages. There are only BATCH_DEPTH slots in total, so
+// pushing never has to wait; the pipeline is bounded by the free slots.
+typedef struct batch_queue {
+  BatchSlot *slots[BATCH_DEPTH];
+  size_t head, count;
+  int is_closed;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+} BatchQueue;
+
+// Either a list of files (`inputs`) or a stream of frames (`source_file`)
+typedef struct batch {
+  char **inputs;
+  size_t input_count;
+  const char *output_directory;
+  FILE *source_file, *output_file;
+  BatchSettings *settings;
+  BatchSlot slots[BATCH_DEPTH];
+  BatchQueue free_slots, parsed, filtered;
+  size_t failure_count;
+  // Previous image of the filter stage, when incremental
+  TemporalCache temporal;
+} Batch;
+
+static void init_batch_queue(BatchQueue *queue) {
+  queue->head = 0;
+  queue->count = 0;
+  queue->is_closed = 0;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+}
+
+static void destroy_batch_queue(BatchQueue *queue) {
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->changed);
+}
+
+static void push_batch_queue(BatchQueue *queue, BatchSlot *slot) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->slots[(queue->head + queue->count) % BATCH_DEPTH] = slot;
+  queue->count++;
+  pthread_cond_signal(&queue->changed);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+static void close_batch_queue(BatchQueue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->is_closed = 1;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+// Returns NULL once the queue is closed and drained
+static BatchSlot *pop_batch_queue(BatchQueue *queue) {
+  BatchSlot *slot = NULL;
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == 0 && !queue->is_closed)
+    pthread_cond_wait(&queue->changed, &queue->mutex);
+  if (queue->count > 0) {
+    slot = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % BATCH_DEPTH;
+    queue->count--;
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return slot;
+}
+
+static int append_batch_input(char ***inputs, size_t *input_count,
+                              size_t *input_capacity, const char *directory,
+                              const char *name) {
+  if (*input_count == *input_capacity) {
+    size_t capacity = (*input_capacity > 0) ? *input_capacity * 2 : 64;
+    char **grown = realloc(*inputs, capacity * sizeof(char *));
+    if (grown == NULL)
+      return 0;
+    *inputs = grown;
+    *input_capacity = capacity;
+  }
+  size_t size = strlen(name) + 1;
+  if (directory != NULL)
+    size += strlen(directory) + 1;
+  char *path = malloc(size);
+  if (path == NULL)
+    return 0;
+  if (directory != NULL)
+    snprintf(path, size, "%s/%s", directory, name);
+  else
+    snprintf(path, size, "%s", name);
+  (*inputs)[(*input_count)++] = path;
+  return 1;
+}
+
+static int compare_batch_inputs(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Lists the `.ppm` and `.qoi` files of a directory, or the lines of a manifest
+// (blank lines and lines starting with `#` are skipped)
+static int list_batch_inputs(const char *source, char ***inputs,
+                             size_t *input_count) {
+  int result = 0;
+  size_t input_capacity = 0;
+  DIR *directory = NULL;
+  FILE *manifest = NULL;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  struct stat source_stat;
+  ASSERT(stat(source, &source_stat) == 0,
+         "Error opening the batch directory or manifest", list_exit);
+  if (S_ISDIR(source_stat.st_mode)) {
+    directory = opendir(source);
+    ASSERT(directory != NULL, "Error opening the batch directory", list_exit);
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+      size_t length = strlen(entry->d_name);
+      if (length <= 4 || (strcmp(&entry->d_name[length - 4], ".ppm") != 0 &&
+                          strcmp(&entry->d_name[length - 4], ".qoi") != 0))
+        continue;
+      ASSERT(append_batch_input(inputs, input_count, &input_capacity, source,
+                                entry->d_name),
+             "Could not allocate the batch inputs", list_exit);
+    }
+    qsort(*inputs, *input_count, sizeof(char *), compare_batch_inputs);
+  } else {
+    manifest = fopen(source, "r");
+    ASSERT(manifest != NULL, "Error opening the batch manifest", list_exit);
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, manifest)) != -1) {
+      while (length > 0 && strchr("\r\n ", line[length - 1]) != NULL)
+        line[--length] = '\0';
+      if (length == 0 || line[0] == '#')
+        continue;
+      ASSERT(append_batch_input(inputs, input_count, &input_capacity, NULL,
+                                line),
+             "Could not allocate the batch inputs", list_exit);
+    }
+  }
+  result = 1;
+list_exit:
+  if (directory != NULL)
+    closedir(directory);
+  if (manifest != NULL)
+    fclose(manifest);
+  free(line);
+  return result;
+}
+
+static void print_batch_error(Batch *batch, const char *message,
+                              size_t input) {
+  if (batch->inputs != NULL)
+    printf("%s `%s`\n", message, batch->inputs[input]);
+  else
+    printf("%s frame %lu\n", message, input);
+}
+
+static void *read_batch_thread(void *void_ptr) {
+  Batch *batch = void_ptr;
+  BatchSettings *settings = batch->settings;
+  for (size_t input = 0; input < batch->input_count; input++) {
+    // Waits for the writer to hand back an image to recycle
+    BatchSlot *slot = pop_batch_queue(&batch->free_slots);
+    slot->input = input;
+    slot->is_ok = 0;
+    FILE *source_file = fopen(batch->inputs[input], "r");
+    if (source_file != NULL) {
+      slot->image = reread_ppm_image(source_file, settings->thread_count,
+                                     settings->storage, slot->image);
+      slot->is_ok = fclose(source_file) == 0 && slot->image != NULL;
+    }
+    if (!slot->is_ok)
+      print_batch_error(batch, "Error reading the PPM image", input);
+    push_batch_queue(&batch->parsed, slot);
+  }
+  close_batch_queue(&batch->parsed);
+  return NULL;
+}
+
+// Unlike the files of a batch, a broken frame leaves the stream at an unknown
+// position, so reading stops at the first failure
+static void *read_frames_thread(void *void_ptr) {
+  Batch *batch = void_ptr;
+  BatchSettings *settings = batch->settings;
+  int is_ok = 1;
+  while (is_ok && has_ppm_frame(batch->source_file)) {
+    BatchSlot *slot = pop_batch_queue(&batch->free_slots);
+    slot->input = batch->input_count++;
+    slot->image = read_ppm_frame(batch->source_file, settings->thread_count,
+                                 settings->storage, slot->image);
+    slot->is_ok = is_ok = slot->image != NULL;
+    if (!is_ok)
+      print_batch_error(batch, "Error reading the PPM image", slot->input);
+    push_batch_queue(&batch->parsed, slot);
+  }
+  close_batch_queue(&batch->parsed);
+  return NULL;
+}
+
+static int save_batch_image(Batch *batch, BatchSlot *slot) {
+  const char *input = batch->inputs[slot->input];
+  const char *name = strrchr(input, '/');
+  name = (name != NULL) ? name + 1 : input;
+  // The input's extension is swapped for the one of the output format
+  const char *dot = strrchr(name, '.');
+  int name_length = (int)((dot != NULL && dot != name) ? (size_t)(dot - name)
+                                                        : strlen(name));
+  const char *extension =
+      extension_ppm_format(batch->settings->output_format);
+  size_t size = strlen(batch->output_directory) + (size_t)name_length +
+                strlen(extension) + 3;
+  char *path = malloc(size);
+  if (path == NULL)
+    return 0;
+  snprintf(path, size, "%s/%.*s.%s", batch->output_directory, name_length,
+           name, extension);
+  // Read-write, so binary outputs can be memory-mapped
+  FILE *output_file = fopen(path, "w+");
+  free(path);
+  if (output_file == NULL)
+    return 0;
+  int saved = save_formatted_ppm_image(slot->image, output_file,
+                                       batch->settings->output_format,
+                                       batch->settings->thread_count);
+  return fclose(output_file) == 0 && saved;
+}
+
+static void *write_batch_thread(void *void_ptr) {
+  Batch *batch = void_ptr;
+  BatchSlot *slot;
+  while ((slot = pop_batch_queue(&batch->filtered)) != NULL) {
+    if (slot->is_ok && !save_batch_image(batch, slot)) {
+      print_batch_error(batch, "Error saving the PPM image", slot->input);
+      slot->is_ok = 0;
+    }
+    if (!slot->is_ok)
+      batch->failure_count++;
+    push_batch_queue(&batch->free_slots, slot);
+  }
+  return NULL;
+}
+
+// Frames are flushed one by one, so a consumer on a pipe sees each of them as
+// soon as it is saved
+static void *write_frames_thread(void *void_ptr) {
+  Batch *batch = void_ptr;
+  BatchSettings *settings = batch->settings;
+  BatchSlot *slot;
+  while ((slot = pop_batch_queue(&batch->filtered)) != NULL) {
+    if (slot->is_ok) {
+      int saved = save_formatted_ppm_image(slot->image, batch->output_file,
+                                           settings->output_format,
+                                           settings->thread_count);
+      if (!saved || fflush(batch->output_file) != 0) {
+        print_batch_error(batch, "Error saving the PPM image", slot->input);
+        slot->is_ok = 0;
+      }
+    }
+    if (!slot->is_ok)
+      batch->failure_count++;
+    push_batch_queue(&batch->free_slots, slot);
+  }
+  return NULL;
+}
+
+// Runs `read_thread` and `write_thread` around the filter stage, on the
+// caller, until the reader closes the pipeline. Returns 0 if any input failed.
+static int run_batch_pipeline(Batch *batch, void *(*read_thread)(void *),
+                              void *(*write_thread)(void *),
+                              const char *kind, const char *unit) {
+  int result = 0;
+  int is_reading = 0, is_writing = 0;
+  pthread_t reader, writer;
+  BatchSlot *slot;
+  BatchSettings *settings = batch->settings;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  is_reading = pthread_create(&reader, NULL, read_thread, batch) == 0;
+  ASSERT(is_reading, "Error creating the batch reader thread",
+         run_batch_pipeline_exit);
+  is_writing = pthread_create(&writer, NULL, write_thread, batch) == 0;
+  ASSERT(is_writing, "Error creating the batch writer thread",
+         run_batch_pipeline_exit);
+  // The caller is the filter stage
+  while ((slot = pop_batch_queue(&batch->parsed)) != NULL) {
+    int is_filtered =
+        !slot->is_ok ||
+        (settings->is_incremental
+             ? filter_temporal_ppm_image(&batch->temporal, slot->image,
+                                         settings)
+             : filter_ppm_image(slot->image, settings->threshold,
+                                settings->sharpen_factor, settings->m,
+                                settings->thread_count, settings->blur_engine,
+                                settings->tile_size));
+    if (!is_filtered) {
+      print_batch_error(batch, "Error applying the filter to", slot->input);
+      slot->is_ok = 0;
+    }
+    push_batch_queue(&batch->filtered, slot);
+  }
+  result = 1;
+run_batch_pipeline_exit:
+  // Drains the pipeline even on error, so no thread is left waiting
+  if (is_reading && !is_writing)
+    while ((slot = pop_batch_queue(&batch->parsed)) != NULL)
+      push_batch_queue(&batch->free_slots, slot);
+  close_batch_queue(&batch->filtered);
+  if (is_reading)
+    pthread_join(reader, NULL);
+  if (is_writing)
+    pthread_join(writer, NULL);
+  if (result) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - begin.tv_sec) +
+                     (double)(end.tv_nsec - begin.tv_nsec) * 1e-9;
+    fprintf(stderr, "%s of %lu %s (%lu failed) in %.3f s (%.1f/s)\n", kind,
+            batch->input_count, unit, batch->failure_count, seconds,
+            (seconds > 0.0) ? (double)batch->input_count / seconds : 0.0);
+    if (settings->is_incremental) {
+      size_t tile_count = batch->temporal.tile_count;
+      size_t reused_count = batch->temporal.reused_tile_count;
+      fprintf(stderr, "Reused %lu of %lu tiles (%.1f%%)\n", reused_count,
+              tile_count,
+              (tile_count > 0) ? 100.0 * (double)reused_count /
+                                     (double)tile_count
+                               : 0.0);
+    }
+    result = batch->failure_count == 0;
+  }
+  return result;
+}
+
+static void init_batch(Batch *batch, BatchSettings *settings) {
+  *batch = (Batch){.inputs = NULL,
+                   .input_count = 0,
+                   .output_directory = NULL,
+                   .source_file = NULL,
+                   .output_file = NULL,
+                   .settings = settings,
+                   .failure_count = 0};
+  init_batch_queue(&batch->free_slots);
+  init_batch_queue(&batch->parsed);
+  init_batch_queue(&batch->filtered);
+  for (size_t idx = 0; idx < BATCH_DEPTH; idx++) {
+    batch->slots[idx] = (BatchSlot){.input = 0, .image = NULL, .is_ok = 0};
+    push_batch_queue(&batch->free_slots, &batch->slots[idx]);
+  }
+}
+
+static void destroy_batch(Batch *batch) {
+  free_temporal_cache(&batch->temporal);
+  for (size_t idx = 0; idx < BATCH_DEPTH; idx++)
+    free_ppm_image(&batch->slots[idx].image);
+  if (batch->inputs != NULL)
+    for (size_t idx = 0; idx < batch->input_count; idx++)
+      free(batch->inputs[idx]);
+  free(batch->inputs);
+  destroy_batch_queue(&batch->free_slots);
+  destroy_batch_queue(&batch->parsed);
+  destroy_batch_queue(&batch->filtered);
+}
+
+int run_batch(const char *source, const char *output_directory,
+              BatchSettings *settings) {
+  int result = 0;
+  Batch batch;
+  init_batch(&batch, settings);
+  batch.output_directory = output_directory;
+  ASSERT(list_batch_inputs(source, &batch.inputs, &batch.input_count),
+         "Error listing the batch inputs", run_batch_exit);
+  ASSERT(mkdir(output_directory, 0777) == 0 || errno == EEXIST,
+         "Error creating the output directory", run_batch_exit);
+  result = run_batch_pipeline(&batch, read_batch_thread, write_batch_thread,
+                              "Batch", "images");
+run_batch_exit:
+  destroy_batch(&batch);
+  return result;
+}
+
+int run_frames(FILE *source_file, FILE *output_file,
+               BatchSettings *settings) {
+  Batch batch;
+  init_batch(&batch, settings);
+  batch.source_file = source_file;
+  batch.output_file = output_file;
+  int result = run_batch_pipeline(&batch, read_frames_thread,
+                                  write_frames_thread, "Sequence", "frames");
+  destroy_batch(&batch);
+  return result;
+}
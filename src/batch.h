@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef BATCH_HEADER
+#define BATCH_HEADER
+
+#include "filter.h"
+#include "ppm.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Images in flight: one being parsed, one filtered and one saved
+#define BATCH_DEPTH 3
+
+// Settings shared by every image of a batch
+typedef struct batch_settings {
+  float threshold, sharpen_factor;
+  size_t m, tile_size;
+  int thread_count;
+  BlurEngine blur_engine;
+  PpmFormat output_format;
+  PpmStorage storage;
+  // Sharpens only what changed since the previous image, see `temporal.h`
+  uint8_t is_incremental;
+} BatchSettings;
+
+// Filters every image listed by `source`, either a directory (its `.ppm`
+// files, in name order) or a manifest with one path per line, into
+// `output_directory` under the same file names. Parsing, filtering and saving
+// run as a pipeline on three threads that recycle BATCH_DEPTH images.
+// Returns 0 if any image failed, after trying all of them.
+int run_batch(const char *source, const char *output_directory,
+              BatchSettings *settings);
+// Filters the concatenated images of `source_file` (e.g. the frames of a
+// video on a pipe) into `output_file`, in order, on the same pipeline as
+// `run_batch`. Reading stops at the end of input or at the first broken
+// frame. Returns 0 if any frame failed.
+int run_frames(FILE *source_file, FILE *output_file, BatchSettings *settings);
+
+#endif // BATCH_HEADER
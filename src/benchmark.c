@@ -0,0 +1,308 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "batch.h"
+#include "filter.h"
+#include "ppm.h"
+#include "tiling.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    fprintf(stderr, "%s\n", msg);                                              \
+    goto exit_label;                                                           \
+  }
+
+// Set by the build scripts to the variant the kernels were linked from
+#ifndef FILTER_VARIANT
+#define FILTER_VARIANT "unknown"
+#endif
+
+#define MAX_THREAD_COUNTS 64
+
+// The grayscale blend is fused into the sharpen pass, so both are timed as
+// one stage; `flush` publishes the sharpened buffer
+typedef enum benchmark_stage {
+  BENCHMARK_STAGE_PARSE,
+  BENCHMARK_STAGE_SHARPEN,
+  BENCHMARK_STAGE_FLUSH,
+  BENCHMARK_STAGE_SAVE,
+  BENCHMARK_STAGE_TOTAL,
+  BENCHMARK_STAGE_COUNT,
+} BenchmarkStage;
+
+static const char *stage_names[BENCHMARK_STAGE_COUNT] = {
+    "parse", "sharpen", "flush", "save", "total"};
+
+typedef enum benchmark_format {
+  BENCHMARK_FORMAT_CSV,
+  BENCHMARK_FORMAT_JSON,
+} BenchmarkFormat;
+
+typedef struct benchmark_summary {
+  double median, p95, mean, stddev, min, max;
+} BenchmarkSummary;
+
+static inline double elapsed_seconds(struct timespec *begin,
+                                     struct timespec *end) {
+  return (double)(end->tv_sec - begin->tv_sec) +
+         (double)(end->tv_nsec - begin->tv_nsec) * 1e-9;
+}
+
+// Parses, filters and saves `path` once, like the variants' `main` does,
+// storing the seconds spent on every stage
+static int run_benchmark(const char *path, BatchSettings *settings,
+                         double seconds[BENCHMARK_STAGE_COUNT],
+                         size_t *width, size_t *height) {
+  int result = 0;
+  PpmImage *image = NULL;
+  FILE *source_file = NULL, *output_file = NULL;
+  struct timespec marks[BENCHMARK_STAGE_TOTAL + 1];
+  clock_gettime(CLOCK_MONOTONIC, &marks[BENCHMARK_STAGE_PARSE]);
+  source_file = fopen(path, "r");
+  ASSERT(source_file != NULL, "Error opening the source file",
+         run_benchmark_exit);
+  image = read_ppm_image(source_file, settings->thread_count,
+                         settings->storage);
+  ASSERT(image != NULL, "Error reading the PPM image", run_benchmark_exit);
+  clock_gettime(CLOCK_MONOTONIC, &marks[BENCHMARK_STAGE_SHARPEN]);
+  ASSERT(filter_rows_ppm_image(image, settings->threshold,
+                               settings->sharpen_factor, settings->m,
+                               settings->thread_count, settings->blur_engine,
+                               settings->tile_size, 0, image->height, NULL),
+         "Error applying the filter to the PPM image", run_benchmark_exit);
+  clock_gettime(CLOCK_MONOTONIC, &marks[BENCHMARK_STAGE_FLUSH]);
+  ASSERT(flush_ppm_image(image), "Error flushing the PPM image",
+         run_benchmark_exit);
+  clock_gettime(CLOCK_MONOTONIC, &marks[BENCHMARK_STAGE_SAVE]);
+  // Same sink as `tools/run.sh`, so only formatting and syscalls are timed
+  output_file = fopen("/dev/null", "w");
+  ASSERT(output_file != NULL, "Error opening /dev/null", run_benchmark_exit);
+  int saved = save_formatted_ppm_image(image, output_file,
+                                       settings->output_format,
+                                       settings->thread_count);
+  ASSERT(saved, "Error saving the PPM image", run_benchmark_exit);
+  ASSERT(fclose(output_file) == 0, "Error closing /dev/null",
+         run_benchmark_exit);
+  output_file = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &marks[BENCHMARK_STAGE_TOTAL]);
+  for (size_t stage = 0; stage < BENCHMARK_STAGE_TOTAL; stage++)
+    seconds[stage] = elapsed_seconds(&marks[stage], &marks[stage + 1]);
+  seconds[BENCHMARK_STAGE_TOTAL] =
+      elapsed_seconds(&marks[0], &marks[BENCHMARK_STAGE_TOTAL]);
+  *width = image->width;
+  *height = image->height;
+  result = 1;
+run_benchmark_exit:
+  if (source_file != NULL)
+    fclose(source_file);
+  if (output_file != NULL)
+    fclose(output_file);
+  free_ppm_image(&image);
+  return result;
+}
+
+static int compare_seconds(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts `samples` in place; percentiles use the nearest rank
+static BenchmarkSummary summarize_samples(double *samples, size_t count) {
+  qsort(samples, count, sizeof(double), compare_seconds);
+  BenchmarkSummary summary = {.min = samples[0], .max = samples[count - 1]};
+  summary.median = (count % 2 == 1)
+                       ? samples[count / 2]
+                       : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+  size_t p95_rank = (95 * count + 99) / 100;
+  summary.p95 = samples[(p95_rank > 0) ? p95_rank - 1 : 0];
+  double sum = 0.0;
+  for (size_t idx = 0; idx < count; idx++)
+    sum += samples[idx];
+  summary.mean = sum / (double)count;
+  double squares = 0.0;
+  for (size_t idx = 0; idx < count; idx++)
+    squares += (samples[idx] - summary.mean) * (samples[idx] - summary.mean);
+  summary.stddev = (count > 1) ? sqrt(squares / (double)(count - 1)) : 0.0;
+  return summary;
+}
+
+static void print_summary(BenchmarkFormat format, int is_first,
+                          const char *path, size_t width, size_t height,
+                          int thread_count, size_t run_count,
+                          const char *stage, BenchmarkSummary *summary) {
+  if (format == BENCHMARK_FORMAT_CSV) {
+    printf("%s,\"%s\",%lu,%lu,%d,%s,%lu,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f\n",
+           FILTER_VARIANT, path, width, height, thread_count, stage,
+           run_count, summary->median, summary->p95, summary->mean,
+           summary->stddev, summary->min, summary->max);
+    return;
+  }
+  printf("%s\n  {\"variant\": \"%s\", \"image\": \"%s\", \"width\": %lu, "
+         "\"height\": %lu, \"threads\": %d, \"stage\": \"%s\", "
+         "\"runs\": %lu, \"median\": %.9f, \"p95\": %.9f, \"mean\": %.9f, "
+         "\"stddev\": %.9f, \"min\": %.9f, \"max\": %.9f}",
+         is_first ? "" : ",", FILTER_VARIANT, path, width, height,
+         thread_count, stage, run_count, summary->median, summary->p95,
+         summary->mean, summary->stddev, summary->min, summary->max);
+}
+
+int main(int argc, char **argv) {
+  int exit_code = EXIT_FAILURE;
+  double *samples = NULL;
+  // Reads the runtime options
+  BatchSettings settings = {.blur_engine = BLUR_ENGINE_WINDOW,
+                            .output_format = PPM_FORMAT_ASCII,
+                            .tile_size = 0,
+                            .storage = PPM_STORAGE_TRIPLETS};
+  BenchmarkFormat format = BENCHMARK_FORMAT_CSV;
+  size_t warmup_count = 3, run_count = 30;
+  int option;
+  while ((option = getopt(argc, argv, "b:f:n:o:s:T:w:")) != -1) {
+    switch (option) {
+    case 'b':
+      if (strcmp(optarg, "window") == 0)
+        settings.blur_engine = BLUR_ENGINE_WINDOW;
+      else if (strcmp(optarg, "summed-area") == 0)
+        settings.blur_engine = BLUR_ENGINE_SUMMED_AREA;
+      else
+        ASSERT(0, "Unknown blur engine (expected `window` or `summed-area`)",
+               exit);
+      break;
+    case 'f':
+      if (strcmp(optarg, "p3") == 0)
+        settings.output_format = PPM_FORMAT_ASCII;
+      else if (strcmp(optarg, "p6") == 0)
+        settings.output_format = PPM_FORMAT_BINARY;
+      else if (strcmp(optarg, "qoi") == 0)
+        settings.output_format = PPM_FORMAT_QOI;
+      else if (strcmp(optarg, "p2") == 0)
+        settings.output_format = PPM_FORMAT_PGM_ASCII;
+      else if (strcmp(optarg, "p5") == 0)
+        settings.output_format = PPM_FORMAT_PGM_BINARY;
+      else
+        ASSERT(0,
+               "Unknown output format (expected `p3`, `p6`, `qoi`, `p2` or "
+               "`p5`)",
+               exit);
+      break;
+    case 'n':
+      ASSERT(sscanf(optarg, "%lu", &run_count) && run_count > 0,
+             "Error reading the positive `runs` integer", exit);
+      break;
+    case 'o':
+      if (strcmp(optarg, "csv") == 0)
+        format = BENCHMARK_FORMAT_CSV;
+      else if (strcmp(optarg, "json") == 0)
+        format = BENCHMARK_FORMAT_JSON;
+      else
+        ASSERT(0, "Unknown report format (expected `csv` or `json`)", exit);
+      break;
+    case 's':
+      if (strcmp(optarg, "triplets") == 0)
+        settings.storage = PPM_STORAGE_TRIPLETS;
+      else if (strcmp(optarg, "planar") == 0)
+        settings.storage = PPM_STORAGE_PLANAR;
+      else
+        ASSERT(0, "Unknown pixel storage (expected `triplets` or `planar`)",
+               exit);
+      break;
+    case 'T':
+      if (strcmp(optarg, "auto") == 0)
+        settings.tile_size = SIZE_MAX;
+      else
+        ASSERT(sscanf(optarg, "%lu", &settings.tile_size),
+               "Error reading `tile_size` integer", exit);
+      break;
+    case 'w':
+      ASSERT(sscanf(optarg, "%lu", &warmup_count),
+             "Error reading `warmups` integer", exit);
+      break;
+    default:
+      goto exit;
+    }
+  }
+  // Shifts the positional arguments back to `argv[1]` onwards
+  argc -= optind - 1;
+  argv += optind - 1;
+  ASSERT(argc >= 6, "Missing arguments (min.: 5)", exit);
+  // Reads the runtime parameters
+  size_t raw_threshold;
+  ASSERT(sscanf(argv[1], "%lu", &settings.m),
+         "Error reading variable radius' `m` integer", exit);
+  ASSERT(sscanf(argv[2], "%lu", &raw_threshold),
+         "Error reading sharpen's `threshold` integer", exit);
+  settings.threshold = ((float)raw_threshold) / 255.0f;
+  ASSERT(settings.threshold >= 0.0f && settings.threshold <= 1.0f,
+         "Sharpen's `threshold` integer isn't inside 0..255 interval", exit);
+  ASSERT(sscanf(argv[3], "%f", &settings.sharpen_factor),
+         "Error reading sharpen's `sharpen_factor` float", exit);
+  ASSERT(settings.sharpen_factor >= 0.0f && settings.sharpen_factor <= 2.0f,
+         "Sharpen's `sharpen_factor` float isn't inside 0..2 interval", exit);
+  // Thread counts are a comma-separated list, e.g. `1,2,4`
+  int thread_counts[MAX_THREAD_COUNTS];
+  size_t thread_count_count = 0;
+  for (char *token = strtok(argv[4], ","); token != NULL;
+       token = strtok(NULL, ",")) {
+    ASSERT(thread_count_count < MAX_THREAD_COUNTS, "Too many thread counts",
+           exit);
+    ASSERT(sscanf(token, "%d", &thread_counts[thread_count_count]) &&
+               thread_counts[thread_count_count] > 0,
+           "Error reading the positive `thread_count` integers", exit);
+    thread_count_count++;
+  }
+  ASSERT(thread_count_count > 0, "Missing `thread_count` integers", exit);
+  if (settings.tile_size == SIZE_MAX)
+    settings.tile_size = default_tile_size(settings.m);
+  samples = malloc(BENCHMARK_STAGE_COUNT * run_count * sizeof(double));
+  ASSERT(samples != NULL, "Could not allocate the benchmark samples", exit);
+  if (format == BENCHMARK_FORMAT_CSV)
+    printf("variant,image,width,height,threads,stage,runs,median_s,p95_s,"
+           "mean_s,stddev_s,min_s,max_s\n");
+  else
+    printf("[");
+  int is_first = 1;
+  for (int image_arg = 5; image_arg < argc; image_arg++) {
+    for (size_t idx = 0; idx < thread_count_count; idx++) {
+      settings.thread_count = thread_counts[idx];
+      size_t width = 0, height = 0;
+      double seconds[BENCHMARK_STAGE_COUNT];
+      // Warm-ups fill the page cache, fault in the buffers and start the
+      // thread pool, and are left out of the statistics
+      for (size_t run = 0; run < warmup_count; run++)
+        ASSERT(run_benchmark(argv[image_arg], &settings, seconds, &width,
+                             &height),
+               "Error running a warm-up", exit);
+      for (size_t run = 0; run < run_count; run++) {
+        ASSERT(run_benchmark(argv[image_arg], &settings, seconds, &width,
+                             &height),
+               "Error running the benchmark", exit);
+        for (size_t stage = 0; stage < BENCHMARK_STAGE_COUNT; stage++)
+          samples[stage * run_count + run] = seconds[stage];
+      }
+      for (size_t stage = 0; stage < BENCHMARK_STAGE_COUNT; stage++) {
+        BenchmarkSummary summary =
+            summarize_samples(&samples[stage * run_count], run_count);
+        print_summary(format, is_first, argv[image_arg], width, height,
+                      settings.thread_count, run_count, stage_names[stage],
+                      &summary);
+        is_first = 0;
+      }
+      fflush(stdout);
+    }
+  }
+  if (format == BENCHMARK_FORMAT_JSON)
+    printf("\n]\n");
+  exit_code = EXIT_SUCCESS;
+exit:
+  free(samples);
+  return exit_code;
+}
@@ -3,9 +3,14 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "ppm.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define ASSERT(expr, msg, exit_label)                                          \
   if (!(expr)) {                                                               \
@@ -14,74 +19,285 @@
   }
 
 #define LIMIT 0.01f
-#define SQUARED_LIMIT (LIMIT * LIMIT)
+// Side of the heatmap tiles, which is also the height of the bands read from
+// every image at a time
+#define CHECK_TILE_SIZE 64
+// Offending pixels listed per image, at most one per tile
+#define CHECK_SAMPLE_LIMIT 16
+
+// Errors of the pixels of one tile
+typedef struct check_tile {
+  float max_abs;
+  double sum_squares;
+  size_t over_limit;
+  // First pixel over the limit, in row-major order within the tile
+  size_t first_x, first_y;
+  RgbTriplet first_rgb, first_baseline_rgb;
+} CheckTile;
+
+typedef struct check_candidate {
+  const char *path;
+  FILE *source_file;
+  PpmStream stream;
+  PpmImage *window;
+  // Open, header and read errors and size mismatches stop the comparison of
+  // this image only
+  int is_ok;
+  CheckTile *tiles;
+} CheckCandidate;
+
+typedef struct checker {
+  FILE *baseline_file;
+  PpmStream baseline_stream;
+  PpmImage *baseline_window;
+  CheckCandidate *candidates;
+  size_t candidate_count;
+  size_t width, height, tile_columns, tile_rows;
+  // Current band
+  size_t band, band_rows;
+  size_t step;
+  atomic_int has_failed;
+} Checker;
+
+// Rank 0 reads the baseline and rank `i` the i-th candidate
+static void read_band_stage(void *void_ptr, size_t rank) {
+  Checker *checker = void_ptr;
+  PpmStream *stream = &checker->baseline_stream;
+  PpmImage *window = checker->baseline_window;
+  CheckCandidate *candidate = NULL;
+  if (rank > 0) {
+    candidate = &checker->candidates[rank - 1];
+    if (!candidate->is_ok)
+      return;
+    stream = &candidate->stream;
+    window = candidate->window;
+  }
+  if (slide_ppm_window(stream, window, window->height, checker->band_rows))
+    return;
+  if (candidate == NULL) {
+    atomic_store(&checker->has_failed, 1);
+    return;
+  }
+  printf("Error reading the PPM image `%s`\n", candidate->path);
+  candidate->is_ok = 0;
+}
+
+// Compares the rows [0, band_rows) of the band, columns [x_begin, x_end)
+static void compare_tile(Checker *checker, CheckCandidate *candidate,
+                         CheckTile *tile, size_t x_begin, size_t x_end) {
+  const SimdKernels *kernels = simd_kernels();
+  size_t width = checker->width;
+  for (size_t y = 0; y < checker->band_rows; y++) {
+    const RgbTriplet *baseline =
+        &checker->baseline_window->color_values_read[y * width];
+    const RgbTriplet *another =
+        &candidate->window->color_values_read[y * width];
+    SampleDiff diff;
+    kernels->compare_samples((const float *)&another[x_begin],
+                             (const float *)&baseline[x_begin],
+                             (x_end - x_begin) * 3, LIMIT, &diff);
+    if (diff.max_abs > tile->max_abs)
+      tile->max_abs = diff.max_abs;
+    tile->sum_squares += (double)diff.sum_squares;
+    if (diff.over_limit == 0)
+      continue;
+    // Rare in a passing build, so offending samples are grouped into pixels
+    // by a scalar pass over the row
+    for (size_t x = x_begin; x < x_end; x++) {
+      RgbTriplet a = another[x], b = baseline[x];
+      if (fabsf(a.r - b.r) <= LIMIT && fabsf(a.g - b.g) <= LIMIT &&
+          fabsf(a.b - b.b) <= LIMIT)
+        continue;
+      if (tile->over_limit++ == 0) {
+        tile->first_x = x;
+        tile->first_y = checker->band * CHECK_TILE_SIZE + y;
+        tile->first_rgb = a;
+        tile->first_baseline_rgb = b;
+      }
+    }
+  }
+}
+
+// Each rank owns a contiguous range of tile columns, so no tile is shared
+static void compare_band_stage(void *void_ptr, size_t rank) {
+  Checker *checker = void_ptr;
+  size_t column_begin = checker->tile_columns * rank / checker->step;
+  size_t column_end = checker->tile_columns * (rank + 1) / checker->step;
+  for (size_t idx = 0; idx < checker->candidate_count; idx++) {
+    CheckCandidate *candidate = &checker->candidates[idx];
+    if (!candidate->is_ok)
+      continue;
+    for (size_t column = column_begin; column < column_end; column++) {
+      size_t x_begin = column * CHECK_TILE_SIZE;
+      size_t x_end = x_begin + CHECK_TILE_SIZE;
+      if (x_end > checker->width)
+        x_end = checker->width;
+      compare_tile(
+          checker, candidate,
+          &candidate->tiles[checker->band * checker->tile_columns + column],
+          x_begin, x_end);
+    }
+  }
+}
+
+// Each heatmap cell is the share of the tile's pixels over the limit, in
+// tenths rounded up (9 also standing for all of them); `.` means none
+static void print_heatmap(Checker *checker, CheckCandidate *candidate) {
+  printf("Error heatmap (%dx%d tiles, tenths of their pixels over the "
+         "limit):\n",
+         CHECK_TILE_SIZE, CHECK_TILE_SIZE);
+  for (size_t row = 0; row < checker->tile_rows; row++) {
+    size_t tile_height = checker->height - row * CHECK_TILE_SIZE;
+    if (tile_height > CHECK_TILE_SIZE)
+      tile_height = CHECK_TILE_SIZE;
+    for (size_t column = 0; column < checker->tile_columns; column++) {
+      CheckTile *tile = &candidate->tiles[row * checker->tile_columns + column];
+      size_t tile_width = checker->width - column * CHECK_TILE_SIZE;
+      if (tile_width > CHECK_TILE_SIZE)
+        tile_width = CHECK_TILE_SIZE;
+      size_t pixel_count = tile_width * tile_height;
+      size_t tenths = (tile->over_limit * 10 + pixel_count - 1) / pixel_count;
+      if (tenths > 9)
+        tenths = 9;
+      putchar((tile->over_limit == 0) ? '.' : (int)('0' + tenths));
+    }
+    putchar('\n');
+  }
+}
+
+// Returns the number of pixels over the limit
+static size_t report_candidate(Checker *checker, CheckCandidate *candidate,
+                               const char *baseline_path) {
+  printf("\"%s\" versus \"%s\"\n", candidate->path, baseline_path);
+  float max_abs = 0.0f;
+  double sum_squares = 0.0;
+  size_t over_limit = 0, sample_count = 0;
+  size_t tile_count = checker->tile_columns * checker->tile_rows;
+  for (size_t idx = 0; idx < tile_count; idx++) {
+    CheckTile *tile = &candidate->tiles[idx];
+    if (tile->max_abs > max_abs)
+      max_abs = tile->max_abs;
+    sum_squares += tile->sum_squares;
+    over_limit += tile->over_limit;
+    if (tile->over_limit == 0 || sample_count++ >= CHECK_SAMPLE_LIMIT)
+      continue;
+    printf("Surpassed the limit (i.e. %f) at XY(%lu, %lu): "
+           "RGB(%f, %f, %f) versus RGB(%f, %f, %f)\n",
+           (double)LIMIT, tile->first_x, tile->first_y,
+           (double)tile->first_rgb.r, (double)tile->first_rgb.g,
+           (double)tile->first_rgb.b, (double)tile->first_baseline_rgb.r,
+           (double)tile->first_baseline_rgb.g,
+           (double)tile->first_baseline_rgb.b);
+  }
+  if (sample_count > CHECK_SAMPLE_LIMIT)
+    printf("... and %lu more tiles with pixels over the limit\n",
+           sample_count - CHECK_SAMPLE_LIMIT);
+  size_t pixel_count = checker->width * checker->height;
+  double mse = (pixel_count > 0) ? sum_squares / (double)(pixel_count * 3)
+                                 : 0.0;
+  // Samples are normalised, so the peak signal is 1
+  printf("Max abs error: %f, pixels over the limit: %lu of %lu, MSE: %e, "
+         "PSNR: ",
+         (double)max_abs, over_limit, pixel_count, mse);
+  if (mse > 0.0)
+    printf("%.2f dB\n", -10.0 * log10(mse));
+  else
+    printf("inf\n");
+  if (over_limit == 0) {
+    puts("No significant difference between the images was found");
+    return 0;
+  }
+  print_heatmap(checker, candidate);
+  return over_limit;
+}
 
 int main(int argc, char **argv) {
   int exit_code = EXIT_FAILURE;
-  size_t another_image_count = (size_t)(argc - 2);
-  PpmImage *baseline_image = NULL;
-  PpmImage **another_images = NULL;
+  int thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  Checker checker = {.baseline_file = NULL,
+                     .baseline_window = NULL,
+                     .candidates = NULL,
+                     .candidate_count = 0,
+                     .step = (thread_count > 0) ? (size_t)thread_count : 1};
+  atomic_init(&checker.has_failed, 0);
   ASSERT(argc > 2, "Need at least two file paths to be checked", exit);
-  FILE *baseline_file = fopen(argv[argc - 1], "r");
-  ASSERT(baseline_file != NULL, "Error opening the baseline file", exit);
-  baseline_image = read_ppm_image(baseline_file);
-  ASSERT(fclose(baseline_file) == 0, "Error closing the baseline file", exit);
-  baseline_file = NULL;
-  ASSERT(baseline_image != NULL, "Error reading the baseline PPM image", exit);
-  another_images = malloc(another_image_count * sizeof(PpmImage *));
-  ASSERT(another_images != NULL, "Could not allocate another images", exit);
-  for (size_t idx = 0; idx < another_image_count; idx++)
-    another_images[idx] = NULL;
-  for (size_t idx = 0; idx < another_image_count; idx++) {
-    FILE *another_file = fopen(argv[idx + 1], "r");
-    ASSERT(another_file != NULL, "Error opening another file", exit);
-    another_images[idx] = read_ppm_image(another_file);
-    ASSERT(fclose(another_file) == 0, "Error closing another file", exit);
-    another_file = NULL;
-    ASSERT(another_images[idx] != NULL, "Error reading another PPM image",
-           exit);
-  }
-  size_t surpassed_count = 0;
-  for (size_t image_idx = 0; image_idx < another_image_count; image_idx++) {
-    printf("\"%s\" versus \"%s\"\n", argv[image_idx + 1], argv[argc - 1]);
-    PpmImage *another_image = another_images[image_idx];
-    size_t image_size = another_image->width * another_image->height;
-    size_t old_surpassed_count = surpassed_count;
-    for (size_t triplet_idx = 0; triplet_idx < image_size; triplet_idx++) {
-      RgbTriplet baseline_rgb, another_rgb, squared_diff;
-      ASSERT(read_at_idx_ppm_image(baseline_image, triplet_idx, &baseline_rgb),
-             "Error reading PPM baseline image at index", exit);
-      ASSERT(read_at_idx_ppm_image(another_image, triplet_idx, &another_rgb),
-             "Error reading PPM image at index", exit);
-      squared_diff.r = baseline_rgb.r - another_rgb.r;
-      squared_diff.r = squared_diff.r * squared_diff.r;
-      squared_diff.g = baseline_rgb.g - another_rgb.g;
-      squared_diff.g = squared_diff.g * squared_diff.g;
-      squared_diff.b = baseline_rgb.b - another_rgb.b;
-      squared_diff.b = squared_diff.b * squared_diff.b;
-      int has_surpassed = squared_diff.r > SQUARED_LIMIT ||
-                          squared_diff.g > SQUARED_LIMIT ||
-                          squared_diff.b > SQUARED_LIMIT;
-      if (has_surpassed) {
-        size_t x = triplet_idx % another_image->width;
-        size_t y = triplet_idx / another_image->width;
-        printf("Surpassed the limit (i.e. %f) at XY(%lu, %lu): "
-               "RGB(%f, %f, %f) versus RGB(%f, %f, %f)",
-               (double)LIMIT, x, y, (double)another_rgb.r,
-               (double)another_rgb.g, (double)another_rgb.b,
-               (double)baseline_rgb.r, (double)baseline_rgb.g,
-               (double)baseline_rgb.b);
-        surpassed_count++;
-      }
+  checker.baseline_file = fopen(argv[argc - 1], "r");
+  ASSERT(checker.baseline_file != NULL, "Error opening the baseline file",
+         exit);
+  ASSERT(open_ppm_stream(&checker.baseline_stream, checker.baseline_file),
+         "Error reading the baseline PPM image", exit);
+  checker.width = checker.baseline_stream.width;
+  checker.height = checker.baseline_stream.height;
+  checker.tile_columns =
+      (checker.width + CHECK_TILE_SIZE - 1) / CHECK_TILE_SIZE;
+  checker.tile_rows = (checker.height + CHECK_TILE_SIZE - 1) / CHECK_TILE_SIZE;
+  // Floats, so the vector kernels compare the samples where they lie
+  checker.baseline_window = alloc_ppm_window(
+      &checker.baseline_stream, CHECK_TILE_SIZE, PPM_STORAGE_TRIPLETS);
+  ASSERT(checker.baseline_window != NULL,
+         "Could not allocate the baseline PPM window", exit);
+  checker.candidate_count = (size_t)(argc - 2);
+  checker.candidates = calloc(checker.candidate_count, sizeof(CheckCandidate));
+  ASSERT(checker.candidates != NULL, "Could not allocate another images",
+         exit);
+  for (size_t idx = 0; idx < checker.candidate_count; idx++) {
+    CheckCandidate *candidate = &checker.candidates[idx];
+    candidate->path = argv[idx + 1];
+    candidate->source_file = fopen(candidate->path, "r");
+    if (candidate->source_file == NULL) {
+      printf("Error opening the file `%s`\n", candidate->path);
+      continue;
+    }
+    if (!open_ppm_stream(&candidate->stream, candidate->source_file)) {
+      printf("Error reading the PPM image `%s`\n", candidate->path);
+      continue;
+    }
+    candidate->is_ok = candidate->stream.width == checker.width &&
+                       candidate->stream.height == checker.height;
+    if (!candidate->is_ok) {
+      printf("\"%s\" is %lux%lu, but the baseline is %lux%lu\n",
+             candidate->path, candidate->stream.width,
+             candidate->stream.height, checker.width, checker.height);
+      continue;
     }
-    if (old_surpassed_count == surpassed_count)
-      puts("No significant difference between the images was found");
+    candidate->window = alloc_ppm_window(&candidate->stream, CHECK_TILE_SIZE,
+                                         PPM_STORAGE_TRIPLETS);
+    candidate->tiles =
+        calloc(checker.tile_columns * checker.tile_rows, sizeof(CheckTile));
+    ASSERT(candidate->window != NULL && candidate->tiles != NULL,
+           "Could not allocate another PPM window", exit);
   }
-  exit_code = (surpassed_count == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  for (checker.band = 0; checker.band < checker.tile_rows; checker.band++) {
+    checker.band_rows = checker.height - checker.band * CHECK_TILE_SIZE;
+    if (checker.band_rows > CHECK_TILE_SIZE)
+      checker.band_rows = CHECK_TILE_SIZE;
+    run_thread_pool(checker.candidate_count + 1, read_band_stage, &checker);
+    ASSERT(!atomic_load(&checker.has_failed),
+           "Error reading the baseline PPM image", exit);
+    run_thread_pool(checker.step, compare_band_stage, &checker);
+  }
+  size_t surpassed_count = 0, failed_count = 0;
+  for (size_t idx = 0; idx < checker.candidate_count; idx++) {
+    CheckCandidate *candidate = &checker.candidates[idx];
+    if (candidate->is_ok)
+      surpassed_count += report_candidate(&checker, candidate, argv[argc - 1]);
+    else
+      failed_count++;
+  }
+  exit_code = (surpassed_count == 0 && failed_count == 0) ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE;
 exit:
-  free_ppm_image(&baseline_image);
-  if (another_images != NULL)
-    for (size_t idx = 0; idx < another_image_count; idx++)
-      free_ppm_image(&another_images[idx]);
+  if (checker.baseline_file != NULL)
+    fclose(checker.baseline_file);
+  free_ppm_image(&checker.baseline_window);
+  if (checker.candidates != NULL)
+    for (size_t idx = 0; idx < checker.candidate_count; idx++) {
+      CheckCandidate *candidate = &checker.candidates[idx];
+      if (candidate->source_file != NULL)
+        fclose(candidate->source_file);
+      free_ppm_image(&candidate->window);
+      free(candidate->tiles);
+    }
+  free(checker.candidates);
   return exit_code;
 }
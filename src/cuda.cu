@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // PPM SECTION
 
@@ -19,11 +20,20 @@
   }
 #define MAX_LINE 4096
 
-PpmImage *read_ppm_image(FILE *source_file) {
+PpmImage *read_ppm_image(FILE *source_file, int thread_count,
+                         PpmStorage storage) {
+  // The host parser is serial and the kernels only read triplets
+  (void)thread_count;
+  (void)storage;
   PpmImage *image = NULL;
   size_t image_size = 0;
   ASSERT(source_file != NULL, "Source file is NULL", read_ppm_image_error);
   image = (PpmImage*)malloc(sizeof(PpmImage));
+  ASSERT(image != NULL, "Could not allocate the PPM image",
+         read_ppm_image_error);
+  // Every field the shared accessors read starts out empty
+  memset(image, 0, sizeof(PpmImage));
+  image->storage = PPM_STORAGE_TRIPLETS;
   char header[2];
   ASSERT(fscanf(source_file, "%c%c", &header[0], &header[1]),
          "Error reading the file header", read_ppm_image_error);
@@ -120,7 +130,9 @@ read_at_xy_ppm_image_error:
   return 0;
 }
 
-int save_ppm_image(PpmImage *image, FILE *output_file) {
+int save_ppm_image(PpmImage *image, FILE *output_file, int thread_count) {
+  // The host writer is serial
+  (void)thread_count;
   size_t image_size = 0;
   ASSERT(image != NULL, "PPM image is NULL", save_ppm_image_error);
   ASSERT(output_file != NULL, "Output file is NULL", save_ppm_image_error);
@@ -241,7 +253,11 @@ __global__ void grayscale_kernel(PpmImage image, size_t image_size) {
 #define THREADS_PER_BLOCK 256
 
 int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
-                     size_t m, int thread_count) {
+                     size_t m, int thread_count, BlurEngine blur_engine,
+                     size_t tile_size) {
+  // The device kernels always walk the whole window, one thread per pixel
+  (void)blur_engine;
+  (void)tile_size;
   int exit_code = 0;
   size_t image_size = image->width * image->height;
   PpmImage device_image = (PpmImage){
@@ -305,17 +321,18 @@ int main(int argc, char **argv) {
   // Opens the source file and reads the PPM image
   source_file = fopen(argv[1], "r");
   ASSERT(source_file != NULL, "Error opening the source file", exit);
-  image = read_ppm_image(source_file);
+  image = read_ppm_image(source_file, 1, PPM_STORAGE_TRIPLETS);
   ASSERT(fclose(source_file) == 0, "Error closing the source file", exit);
   source_file = NULL;
   ASSERT(image != NULL, "Error reading the PPM image", exit);
   // Apply the PPM image filter
-  ASSERT(filter_ppm_image(image, threshold, sharpen_factor, m, 0),
+  ASSERT(filter_ppm_image(image, threshold, sharpen_factor, m, 0,
+                          BLUR_ENGINE_WINDOW, 0),
          "Error applying the filter to the PPM image", exit);
   // Saves the PPM image to the output file
   output_file = fopen(argv[2], "w");
   ASSERT(output_file != NULL, "Error opening the output file", exit);
-  ASSERT(save_ppm_image(image, output_file), "Error saving the PPM image",
+  ASSERT(save_ppm_image(image, output_file, 1), "Error saving the PPM image",
          exit);
   ASSERT(fclose(output_file) == 0, "Error closing the output file", exit);
   output_file = NULL;
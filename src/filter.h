@@ -6,8 +6,50 @@
 #define FILTER_HEADER
 
 #include "ppm.h"
+#include "summed_area.h"
 
+typedef enum blur_engine {
+  // Walks the whole (2r+1)² window of every pixel
+  BLUR_ENGINE_WINDOW,
+  // Builds an integral image once, then blurs every pixel in O(1)
+  BLUR_ENGINE_SUMMED_AREA,
+} BlurEngine;
+
+// Working memory kept between filter calls, so images no larger than the
+// ones already filtered allocate nothing. Must start zeroed.
+typedef struct filter_scratch {
+  SummedAreaTable *table;
+  // Variant-specific (the work deques of `pthreads`)
+  void *work;
+  size_t work_capacity;
+  // Set by the caller once `table` holds the sums of the rows being filtered
+  // and of the `m` rows around them (e.g. of the whole image), so filtering
+  // them again with other parameters skips them; never set by the filter
+  uint8_t is_table_summed;
+  // Set by the caller to sharpen only these tiles of the `tile_size` grid,
+  // leaving the other pixels of the write buffer untouched; NULL sharpens all
+  // of them. Ignored when sharpening whole rows.
+  const size_t *tiles;
+  size_t tile_count;
+} FilterScratch;
+
+// A `tile_size` of 0 sharpens whole rows; anything else sharpens square tiles
+// of that side in row-major order
 int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
-                     size_t m, int thread_count);
+                     size_t m, int thread_count, BlurEngine blur_engine,
+                     size_t tile_size);
+// Same as `filter_ppm_image`, but only the rows [row_begin, row_end) are
+// sharpened and they are left in the write buffer, unflushed; the rows of the
+// read buffer up to `m` away from them are still used as blur context, and
+// the summed-area table only covers those. A NULL `scratch` is allocated and
+// freed by the call itself.
+int filter_rows_ppm_image(PpmImage *image, float threshold,
+                          float sharpen_factor, size_t m, int thread_count,
+                          BlurEngine blur_engine, size_t tile_size,
+                          size_t row_begin, size_t row_end,
+                          FilterScratch *scratch);
+void free_filter_scratch(FilterScratch *scratch);
+// Whether `thread_count` has any effect on this variant
+int filter_is_threaded(void);
 
 #endif // FILTER_HEADER
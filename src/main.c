@@ -2,10 +2,19 @@
 //
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#include "batch.h"
 #include "filter.h"
 #include "ppm.h"
+#include "shard.h"
+#include "stream.h"
+#include "sweep.h"
+#include "tiling.h"
+#include "tune.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define ASSERT(expr, msg, exit_label)                                          \
   if (!(expr)) {                                                               \
@@ -13,11 +22,166 @@
     goto exit_label;                                                           \
   }
 
+// Printed once the settings are final, i.e. after the tune profile
+static void report_filter_settings(size_t tile_size, BlurEngine blur_engine) {
+  const char *engine_name =
+      (blur_engine == BLUR_ENGINE_SUMMED_AREA) ? "summed-area" : "window";
+  if (tile_size > 0)
+    fprintf(stderr, "Sharpening in %lux%lu tiles (%s blur)\n", tile_size,
+            tile_size, engine_name);
+  else
+    fprintf(stderr, "Sharpening whole rows (%s blur)\n", engine_name);
+}
+
 int main(int argc, char **argv) {
   int exit_code = EXIT_FAILURE;
   PpmImage *image = NULL;
   FILE *source_file = NULL, *output_file = NULL;
+  // Reads the runtime options
+  BlurEngine blur_engine = BLUR_ENGINE_WINDOW;
+  PpmFormat output_format = PPM_FORMAT_ASCII;
+  // 0 keeps the untiled traversal, `SIZE_MAX` asks for the L2-sized default
+  size_t tile_size = 0;
+  PpmStorage storage = PPM_STORAGE_TRIPLETS;
+  // Input becomes a directory or manifest, and output a directory
+  int is_batch = 0;
+  // Filters the image band by band instead of loading it whole
+  int is_streaming = 0;
+  // Parameters become comma-separated lists, and output a directory
+  int is_sweeping = 0;
+  // Input and output hold concatenated frames, `-` meaning stdin/stdout
+  int is_framing = 0;
+  // Sharpens only the tiles that changed since the previous image
+  int is_incremental = 0;
+  // Worker processes filtering shards of the image, 0 filtering in-process
+  size_t process_count = 0;
+  // Calibrates the filter settings for the image and saves them to the
+  // profile; without it, the profile fills in the settings not given
+  int is_tuning = 0;
+  int is_engine_set = 0, is_tile_set = 0;
+  // Profile entries are kept apart for each variant binary
+  const char *variant = strrchr(argv[0], '/');
+  variant = (variant != NULL) ? variant + 1 : argv[0];
+  int option;
+  while ((option = getopt(argc, argv, "ABb:Ff:GIP:Ss:T:")) != -1) {
+    switch (option) {
+    case 'A':
+      is_tuning = 1;
+      break;
+    case 'B':
+      is_batch = 1;
+      break;
+    case 'F':
+      is_framing = 1;
+      break;
+    case 'G':
+      is_sweeping = 1;
+      break;
+    case 'I':
+      is_incremental = 1;
+      break;
+    case 'P':
+      ASSERT(sscanf(optarg, "%lu", &process_count) && process_count > 0,
+             "Error reading `process_count` integer", exit);
+      break;
+    case 'S':
+      is_streaming = 1;
+      break;
+    case 'b':
+      if (strcmp(optarg, "window") == 0)
+        blur_engine = BLUR_ENGINE_WINDOW;
+      else if (strcmp(optarg, "summed-area") == 0)
+        blur_engine = BLUR_ENGINE_SUMMED_AREA;
+      else
+        ASSERT(0, "Unknown blur engine (expected `window` or `summed-area`)",
+               exit);
+      is_engine_set = 1;
+      break;
+    case 'f':
+      if (strcmp(optarg, "p3") == 0)
+        output_format = PPM_FORMAT_ASCII;
+      else if (strcmp(optarg, "p6") == 0)
+        output_format = PPM_FORMAT_BINARY;
+      else if (strcmp(optarg, "qoi") == 0)
+        output_format = PPM_FORMAT_QOI;
+      else if (strcmp(optarg, "p2") == 0)
+        output_format = PPM_FORMAT_PGM_ASCII;
+      else if (strcmp(optarg, "p5") == 0)
+        output_format = PPM_FORMAT_PGM_BINARY;
+      else
+        ASSERT(0,
+               "Unknown output format (expected `p3`, `p6`, `qoi`, `p2` or "
+               "`p5`)",
+               exit);
+      break;
+    case 's':
+      if (strcmp(optarg, "triplets") == 0)
+        storage = PPM_STORAGE_TRIPLETS;
+      else if (strcmp(optarg, "planar") == 0)
+        storage = PPM_STORAGE_PLANAR;
+      else
+        ASSERT(0, "Unknown pixel storage (expected `triplets` or `planar`)",
+               exit);
+      break;
+    case 'T':
+      if (strcmp(optarg, "auto") == 0)
+        tile_size = SIZE_MAX;
+      else
+        ASSERT(sscanf(optarg, "%lu", &tile_size),
+               "Error reading `tile_size` integer", exit);
+      is_tile_set = 1;
+      break;
+    default:
+      goto exit;
+    }
+  }
+  // Shifts the positional arguments back to `argv[1]` onwards
+  argc -= optind - 1;
+  argv += optind - 1;
   ASSERT(argc >= 6, "Missing arguments (min.: 5)", exit);
+  ASSERT(is_batch + is_streaming + is_sweeping + is_framing <= 1,
+         "Batch (`-B`), streaming (`-S`), sweep (`-G`) and frames (`-F`) modes "
+         "are exclusive",
+         exit);
+  ASSERT(process_count == 0 ||
+             is_batch + is_streaming + is_sweeping + is_framing == 0,
+         "Sharded mode (`-P`) only filters a single image", exit);
+  ASSERT(!is_tuning || is_batch + is_streaming + is_sweeping + is_framing == 0,
+         "Autotune mode (`-A`) only filters a single image", exit);
+  ASSERT(!is_incremental || is_batch || is_framing,
+         "Incremental mode (`-I`) needs the batch (`-B`) or frames (`-F`) mode",
+         exit);
+  long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count = (online_cpus > 0) ? (int)online_cpus : 1;
+  int is_thread_count_set = argc >= 7;
+  if (is_thread_count_set)
+    ASSERT(sscanf(argv[6], "%d", &thread_count),
+           "Error reading `thread_count` integer", exit);
+  if (is_sweeping) {
+    SweepGrid grid;
+    ASSERT(parse_sweep_grid(&grid, argv[3], argv[4], argv[5]),
+           "Error reading the sweep grid", exit);
+    // The tile size is left for the sweep to pick for each `m`
+    BatchSettings settings = {.threshold = 0.0f,
+                              .sharpen_factor = 0.0f,
+                              .m = 0,
+                              .tile_size = tile_size,
+                              .thread_count = thread_count,
+                              .blur_engine = blur_engine,
+                              .output_format = output_format,
+                              .storage = storage,
+                              .is_incremental = 0};
+    source_file = fopen(argv[1], "r");
+    int is_swept = source_file != NULL &&
+                   sweep_ppm_image(source_file, argv[2], &grid, &settings);
+    free_sweep_grid(&grid);
+    ASSERT(source_file != NULL, "Error opening the source file", exit);
+    ASSERT(fclose(source_file) == 0, "Error closing the source file", exit);
+    source_file = NULL;
+    ASSERT(is_swept, "Error sweeping the parameter grid", exit);
+    exit_code = EXIT_SUCCESS;
+    goto exit;
+  }
   // Reads the runtime parameters
   size_t m, raw_threshold;
   float sharpen_factor, threshold;
@@ -32,10 +196,67 @@ int main(int argc, char **argv) {
          "Error reading sharpen's `sharpen_factor` float", exit);
   ASSERT(sharpen_factor >= 0.0f && sharpen_factor <= 2.0f,
          "Sharpen's `sharpen_factor` float isn't inside 0..2 interval", exit);
-  int thread_count = 6;
-  if (argc >= 7)
-    ASSERT(sscanf(argv[6], "%d", &thread_count),
-           "Error reading `thread_count` integer", exit);
+  if (tile_size == SIZE_MAX)
+    tile_size = default_tile_size(m);
+  BatchSettings settings = {.threshold = threshold,
+                            .sharpen_factor = sharpen_factor,
+                            .m = m,
+                            .tile_size = tile_size,
+                            .thread_count = thread_count,
+                            .blur_engine = blur_engine,
+                            .output_format = output_format,
+                            .storage = storage,
+                            .is_incremental = (uint8_t)is_incremental};
+  if (is_batch || is_framing || is_streaming)
+    report_filter_settings(tile_size, blur_engine);
+  if (is_batch) {
+    ASSERT(run_batch(argv[1], argv[2], &settings),
+           "Error processing the batch", exit);
+    exit_code = EXIT_SUCCESS;
+    goto exit;
+  }
+  if (is_framing) {
+    if (strcmp(argv[2], "-") == 0) {
+      // Frames get their own descriptor, and messages printed to stdout go
+      // to stderr instead of corrupting them
+      int output_fd = dup(STDOUT_FILENO);
+      output_file = (output_fd >= 0) ? fdopen(output_fd, "w") : NULL;
+      ASSERT(output_file != NULL, "Error opening the output file", exit);
+      fflush(stdout);
+      ASSERT(dup2(STDERR_FILENO, STDOUT_FILENO) >= 0,
+             "Error redirecting messages to stderr", exit);
+      setvbuf(stdout, NULL, _IOLBF, 0);
+    } else {
+      // Read-write, so the first binary frame can be memory-mapped
+      output_file = fopen(argv[2], "w+");
+      ASSERT(output_file != NULL, "Error opening the output file", exit);
+    }
+    source_file = (strcmp(argv[1], "-") == 0) ? stdin : fopen(argv[1], "r");
+    ASSERT(source_file != NULL, "Error opening the source file", exit);
+    ASSERT(run_frames(source_file, output_file, &settings),
+           "Error filtering the frames", exit);
+    if (source_file != stdin)
+      ASSERT(fclose(source_file) == 0, "Error closing the source file", exit);
+    source_file = NULL;
+    ASSERT(fclose(output_file) == 0, "Error closing the output file", exit);
+    output_file = NULL;
+    exit_code = EXIT_SUCCESS;
+    goto exit;
+  }
+  if (is_streaming) {
+    source_file = fopen(argv[1], "r");
+    ASSERT(source_file != NULL, "Error opening the source file", exit);
+    output_file = fopen(argv[2], "w");
+    ASSERT(output_file != NULL, "Error opening the output file", exit);
+    ASSERT(stream_ppm_image(source_file, output_file, &settings),
+           "Error streaming the PPM image", exit);
+    ASSERT(fclose(source_file) == 0, "Error closing the source file", exit);
+    source_file = NULL;
+    ASSERT(fclose(output_file) == 0, "Error closing the output file", exit);
+    output_file = NULL;
+    exit_code = EXIT_SUCCESS;
+    goto exit;
+  }
   // Tries to open/close the output file in append-mode just to test if it's possible
   output_file = fopen(argv[2], "a");
   ASSERT(output_file != NULL, "Error opening the output file", exit);
@@ -44,18 +265,50 @@ int main(int argc, char **argv) {
   // Opens the source file and reads the PPM image
   source_file = fopen(argv[1], "r");
   ASSERT(source_file != NULL, "Error opening the source file", exit);
-  image = read_ppm_image(source_file);
+  // Shard workers write straight into the buffers, which must be shared
+  image = (process_count > 0)
+              ? read_shared_ppm_image(source_file, thread_count, storage)
+              : read_ppm_image(source_file, thread_count, storage);
   ASSERT(fclose(source_file) == 0, "Error closing the source file", exit);
   source_file = NULL;
   ASSERT(image != NULL, "Error reading the PPM image", exit);
+  if (is_tuning || !is_engine_set || !is_tile_set || !is_thread_count_set) {
+    TuneChoice choice;
+    int is_chosen;
+    ASSERT(choose_tune_settings(image, variant, is_tuning, threshold,
+                                sharpen_factor, m, &choice, &is_chosen),
+           "Error tuning the filter", exit);
+    // Explicit options win over the profile
+    if (is_chosen && !is_engine_set)
+      settings.blur_engine = blur_engine = choice.blur_engine;
+    if (is_chosen && !is_tile_set)
+      settings.tile_size = tile_size = choice.tile_size;
+    if (is_chosen && !is_thread_count_set)
+      settings.thread_count = thread_count = choice.thread_count;
+  }
+  report_filter_settings(tile_size, blur_engine);
+  // Grayscale outputs only need the luma, stored in place of the write
+  // buffer, except by the shard workers that can only share the buffers
+  if ((output_format == PPM_FORMAT_PGM_ASCII ||
+       output_format == PPM_FORMAT_PGM_BINARY) &&
+      process_count == 0)
+    ASSERT(attach_luma_ppm_image(image, thread_count),
+           "Error allocating the PPM luma plane", exit);
   // Apply the PPM image filter
-  ASSERT(filter_ppm_image(image, threshold, sharpen_factor, m, thread_count),
-         "Error applying the filter to the PPM image", exit);
+  int is_filtered =
+      (process_count > 0)
+          ? filter_sharded_ppm_image(image, process_count, &settings)
+          : filter_ppm_image(image, threshold, sharpen_factor, m,
+                             thread_count, blur_engine, tile_size);
+  ASSERT(is_filtered, "Error applying the filter to the PPM image", exit);
+  report_numa_ppm_image(image, thread_count);
   // Saves the PPM image to the output file
-  output_file = fopen(argv[2], "w");
+  // Read-write, so binary outputs can be memory-mapped
+  output_file = fopen(argv[2], "w+");
   ASSERT(output_file != NULL, "Error opening the output file", exit);
-  ASSERT(save_ppm_image(image, output_file), "Error saving the PPM image",
-         exit);
+  int saved = save_formatted_ppm_image(image, output_file, output_format,
+                                       thread_count);
+  ASSERT(saved, "Error saving the PPM image", exit);
   ASSERT(fclose(output_file) == 0, "Error closing the output file", exit);
   output_file = NULL;
   exit_code = EXIT_SUCCESS;
@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#define _GNU_SOURCE
+#include "numa.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Pages whose node is asked for in a single `move_pages` call
+#define NUMA_QUERY_PAGES 1024
+
+static int numa_is_enabled = 0;
+static int cpu_nodes[CPU_SETSIZE];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// Bands of a buffer being first-touched or reported, one per rank
+typedef struct numa_layout {
+  uint8_t *buffer;
+  size_t segment_size, segment_count, rank_count;
+} NumaLayout;
+
+// Pages waiting for `move_pages` to tell their node
+typedef struct numa_query {
+  void *pages[NUMA_QUERY_PAGES];
+  int expected_nodes[NUMA_QUERY_PAGES];
+  size_t count;
+  size_t page_count, remote_count, absent_count;
+} NumaQuery;
+
+// Marks the CPUs of a sysfs `cpulist` (e.g. `0-3,8-11`) as being on `node`
+static void read_numa_cpulist(FILE *file, int node) {
+  for (;;) {
+    unsigned first, last;
+    if (fscanf(file, "%u", &first) != 1)
+      return;
+    last = first;
+    int separator = fgetc(file);
+    if (separator == '-') {
+      if (fscanf(file, "%u", &last) != 1)
+        return;
+      separator = fgetc(file);
+    }
+    for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      cpu_nodes[cpu] = node;
+    if (separator != ',')
+      return;
+  }
+}
+
+static void init_numa(void) {
+  const char *numa = getenv(NUMA_VARIABLE);
+  numa_is_enabled = numa != NULL && strcmp(numa, "0") != 0;
+  DIR *directory = opendir("/sys/devices/system/node");
+  if (directory == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    int node;
+    if (sscanf(entry->d_name, "node%d", &node) != 1)
+      continue;
+    char path[320];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+             entry->d_name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+      continue;
+    read_numa_cpulist(file, node);
+    fclose(file);
+  }
+  closedir(directory);
+}
+
+int is_numa_enabled(void) {
+  pthread_once(&numa_once, init_numa);
+  return numa_is_enabled;
+}
+
+int numa_node_of_cpu(int cpu) {
+  pthread_once(&numa_once, init_numa);
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return 0;
+  return cpu_nodes[cpu];
+}
+
+static inline void numa_band(NumaLayout *layout, size_t rank, size_t *begin,
+                             size_t *end) {
+  *begin = layout->segment_size * rank / layout->rank_count;
+  *end = layout->segment_size * (rank + 1) / layout->rank_count;
+}
+
+static void touch_numa_band(void *void_ptr, size_t rank) {
+  NumaLayout *layout = void_ptr;
+  size_t begin, end;
+  numa_band(layout, rank, &begin, &end);
+  for (size_t segment = 0; segment < layout->segment_count; segment++)
+    memset(&layout->buffer[segment * layout->segment_size + begin], 0,
+           end - begin);
+}
+
+void place_numa_buffer(void *buffer, size_t size, size_t segment_count,
+                       size_t rank_count) {
+  if (!is_numa_enabled() || buffer == NULL || rank_count <= 1 ||
+      segment_count == 0)
+    return;
+  uint64_t span = begin_trace_span();
+  NumaLayout layout = {.buffer = buffer,
+                       .segment_size = size / segment_count,
+                       .segment_count = segment_count,
+                       .rank_count = rank_count};
+  run_thread_pool(rank_count, touch_numa_band, &layout);
+  end_trace_span("first touch", span, TRACE_NO_ARG);
+}
+
+// Pages that were never touched have no node yet and are counted apart
+static int run_numa_query(NumaQuery *query) {
+  int status[NUMA_QUERY_PAGES];
+  if (syscall(SYS_move_pages, 0, query->count, query->pages, NULL, status,
+              0) != 0)
+    return 0;
+  for (size_t idx = 0; idx < query->count; idx++) {
+    if (status[idx] < 0)
+      query->absent_count++;
+    else if (status[idx] != query->expected_nodes[idx])
+      query->remote_count++;
+  }
+  query->page_count += query->count;
+  query->count = 0;
+  return 1;
+}
+
+void report_numa_buffer(const char *name, void *buffer, size_t size,
+                        size_t segment_count, size_t rank_count) {
+  if (!is_numa_enabled() || buffer == NULL || rank_count == 0 ||
+      segment_count == 0 || size < segment_count)
+    return;
+  if (cpu_of_thread_pool_rank(0) < 0) {
+    fprintf(stderr, "NUMA: threads aren't pinned, so the %s has no "
+                    "expected nodes\n",
+            name);
+    return;
+  }
+  NumaLayout layout = {.buffer = buffer,
+                       .segment_size = size / segment_count,
+                       .segment_count = segment_count,
+                       .rank_count = rank_count};
+  uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t)buffer, last = first + size;
+  NumaQuery query = {.count = 0,
+                     .page_count = 0,
+                     .remote_count = 0,
+                     .absent_count = 0};
+  for (uintptr_t page = first & ~(page_size - 1); page < last;
+       page += page_size) {
+    // Attributed to the rank filtering its first byte in the buffer
+    size_t offset = (page < first) ? 0 : (size_t)(page - first);
+    size_t rank = (offset % layout.segment_size) * rank_count /
+                  layout.segment_size;
+    query.pages[query.count] = (void *)page;
+    query.expected_nodes[query.count] =
+        numa_node_of_cpu(cpu_of_thread_pool_rank(rank));
+    if (++query.count == NUMA_QUERY_PAGES && !run_numa_query(&query))
+      goto report_numa_buffer_error;
+  }
+  if (query.count > 0 && !run_numa_query(&query))
+    goto report_numa_buffer_error;
+  size_t resident_count = query.page_count - query.absent_count;
+  fprintf(stderr,
+          "NUMA: %lu of %lu resident pages of the %s are remote to the "
+          "rank filtering them (%.1f%%)\n",
+          query.remote_count, resident_count, name,
+          (resident_count > 0)
+              ? 100.0 * (double)query.remote_count / (double)resident_count
+              : 0.0);
+  return;
+report_numa_buffer_error:
+  fprintf(stderr, "NUMA: the pages of the %s could not be queried\n", name);
+}
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef NUMA_HEADER
+#define NUMA_HEADER
+
+#include <stddef.h>
+
+// Set to `1` to place the pixel buffers, and order the pinned workers, by
+// NUMA node
+#define NUMA_VARIABLE "PP_EP2_NUMA"
+
+int is_numa_enabled(void);
+// Node of `cpu` according to sysfs, 0 when unknown
+int numa_node_of_cpu(int cpu);
+// First-touches `buffer`, made of `segment_count` equal row-major segments
+// (e.g. the planes), from `rank_count` pool ranks: each one zeroes the same
+// band of rows of every segment it is going to filter, so the pages of the
+// band land on the node of its CPU. Does nothing outside the NUMA mode.
+void place_numa_buffer(void *buffer, size_t size, size_t segment_count,
+                       size_t rank_count);
+// Prints to stderr how many pages of `buffer`, laid out as in
+// `place_numa_buffer`, are on another node than the rank that filters them
+void report_numa_buffer(const char *name, void *buffer, size_t size,
+                        size_t segment_count, size_t rank_count);
+
+#endif // NUMA_HEADER
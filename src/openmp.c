@@ -3,8 +3,15 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "filter.h"
+#include "arena.h"
 #include "ppm.h"
+#include "sharpen.h"
+#include "simd.h"
+#include "summed_area.h"
+#include "tiling.h"
+#include "trace.h"
 #include <stddef.h>
+#include <stdint.h>
 
 #define OMP_ASSERT(expr, msg, error_msg)                                       \
   if (!(expr)) {                                                               \
@@ -21,28 +28,6 @@
     return 0;                                                                  \
   }
 
-int grayscale(PpmImage *image, int thread_count) {
-  if (image == NULL)
-    return 0;
-  size_t image_size = image->width * image->height;
-  char *error_msg = NULL;
-#pragma omp parallel for num_threads(thread_count)
-  for (size_t idx = 0; idx < image_size; idx++) {
-    OMP_SKIP_ON_ERROR(error_msg);
-    RgbTriplet rgb;
-    OMP_ASSERT(read_at_idx_ppm_image(image, idx, &rgb),
-               "Error reading PPM image at index", error_msg);
-    float y = 0.299f * rgb.r + 0.587f * rgb.g + 0.114f * rgb.b;
-    RgbTriplet grayscale_rgb = (RgbTriplet){.r = y, .g = y, .b = y};
-    OMP_ASSERT(write_at_idx_ppm_image(image, idx, grayscale_rgb),
-               "Error writing PPM image at index", error_msg);
-  }
-  OMP_HANDLE_ASSERTS(error_msg);
-  if (!flush_ppm_image(image))
-    return 0;
-  return 1;
-}
-
 size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   if (image == NULL)
     return 0;
@@ -56,7 +41,8 @@ size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   return (((size_t)(sum * 255)) % m) + 1;
 }
 
-int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
+int blur_at(PpmImage *image, SummedAreaTable *table, size_t m, size_t x,
+            size_t y, RgbTriplet *rgb) {
   if (image == NULL)
     return 0;
   if (x > image->width || y > image->height)
@@ -64,79 +50,151 @@ int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
   size_t radius = r_pixel(image, m, x, y);
   if (radius == 0)
     return 0;
-  float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
-  for (size_t i = 0; i <= 2 * radius; i++) {
-    for (size_t j = 0; j <= 2 * radius; j++) {
-      size_t neighbour_x = x + i;
-      if (neighbour_x < radius)
-        neighbour_x = 0;
-      else
-        neighbour_x -= radius;
-      size_t neighbour_y = y + j;
-      if (neighbour_y < radius)
-        neighbour_y = 0;
-      else
-        neighbour_y -= radius;
-      if (neighbour_x >= image->width)
-        neighbour_x = image->width - 1;
-      if (neighbour_y >= image->height)
-        neighbour_y = image->height - 1;
-      size_t neighbour_idx = neighbour_x + neighbour_y * image->width;
-      RgbTriplet neighbour_rgb;
-      if (!read_at_idx_ppm_image(image, neighbour_idx, &neighbour_rgb))
-        return 0;
-      sum_r += neighbour_rgb.r;
-      sum_g += neighbour_rgb.g;
-      sum_b += neighbour_rgb.b;
-    }
-  }
+  if (table != NULL)
+    return blur_at_summed_area_table(table, x, y, radius, rgb);
+  float sums[3];
+  if (!sum_window_simd(image, x, y, radius, sums))
+    return 0;
   float n = (float)((1 + radius * 2) * (1 + radius * 2));
-  *rgb = (RgbTriplet){.r = sum_r / n, .g = sum_g / n, .b = sum_b / n};
+  *rgb = (RgbTriplet){.r = sums[0] / n, .g = sums[1] / n, .b = sums[2] / n};
   return 1;
 }
 
-float clamp_zero_one(float input) {
-  return (input >= 1.0f) ? 1.0f : ((input <= 0.0f) ? 0.0f : input);
+// Explicit, so the time each thread waits for the others shows up in traces
+static inline void traced_barrier(void) {
+  uint64_t span = begin_trace_span();
+#pragma omp barrier
+  end_trace_span("barrier", span, TRACE_NO_ARG);
 }
 
-int sharpen(PpmImage *image, float threshold, float sharpen_factor, size_t m,
-            int thread_count) {
-  if (image == NULL)
-    return 0;
-  char *error_msg = NULL;
-#pragma omp parallel for num_threads(thread_count) collapse(2)
-  for (size_t x = 0; x < image->width; x++) {
-    for (size_t y = 0; y < image->height; y++) {
-      OMP_SKIP_ON_ERROR(error_msg);
-      RgbTriplet rgb, blur, new_rgb;
-      OMP_ASSERT(read_at_xy_ppm_image(image, x, y, &rgb),
-                 "Error reading PPM image at (X,Y) coords", error_msg);
-      OMP_ASSERT(blur_at(image, m, x, y, &blur),
-                 "Error calculating blur at (X,Y) coords", error_msg);
-      if (rgb.r <= threshold)
-        new_rgb = blur;
-      else
-        new_rgb = (RgbTriplet){
-            .r = clamp_zero_one(rgb.r + sharpen_factor * (rgb.r - blur.r)),
-            .g = clamp_zero_one(rgb.g + sharpen_factor * (rgb.g - blur.g)),
-            .b = clamp_zero_one(rgb.b + sharpen_factor * (rgb.b - blur.b))};
-      OMP_ASSERT(write_at_xy_ppm_image(image, x, y, new_rgb),
-                 "Error writing PPM image at (X,Y) coords", error_msg);
+// Must run inside a parallel region, sharing the team with the other stages.
+// Only the listed `tiles` of the grid are sharpened, unless it is NULL.
+void sharpen(PpmImage *image, SummedAreaTable *table, float threshold,
+             float sharpen_factor, size_t m, TileGrid *grid, size_t row_begin,
+             size_t row_end, const size_t *tiles, size_t tile_count,
+             char **error_msg) {
+  uint64_t stage_span = begin_trace_span();
+  if (grid != NULL) {
+    if (tiles == NULL)
+      tile_count = grid->count;
+    // Dynamic, as the per-pixel radius makes some tiles much costlier
+#pragma omp for schedule(dynamic) nowait
+    for (size_t idx = 0; idx < tile_count; idx++) {
+      OMP_SKIP_ON_ERROR(*error_msg);
+      size_t tile = (tiles != NULL) ? tiles[idx] : idx;
+      uint64_t span = begin_trace_span();
+      OMP_ASSERT(sharpen_tile(image, table, threshold, sharpen_factor, m,
+                              grid, tile, row_begin),
+                 "Error sharpening PPM image tile", *error_msg);
+      end_trace_span("chunk", span, (int64_t)tile);
     }
+  } else {
+#pragma omp for schedule(dynamic) nowait
+    for (size_t y = row_begin; y < row_end; y++) {
+      OMP_SKIP_ON_ERROR(*error_msg);
+      uint64_t span = begin_trace_span();
+      OMP_ASSERT(sharpen_span(image, table, threshold, sharpen_factor, m, y, 0,
+                              image->width),
+                 "Error sharpening PPM image row", *error_msg);
+      end_trace_span("chunk", span, (int64_t)y);
+    }
+  }
+  end_trace_span("sharpen", stage_span, TRACE_NO_ARG);
+  traced_barrier();
+}
+
+#define SUMMED_AREA_COLUMN_BLOCK 64
+
+// Must run inside a parallel region, sharing the team with the other stages
+void summed_area(PpmImage *image, SummedAreaTable *table, char **error_msg) {
+  uint64_t span = begin_trace_span();
+#pragma omp for nowait
+  for (size_t y = table->row_begin; y < table->row_end; y++) {
+    OMP_SKIP_ON_ERROR(*error_msg);
+    OMP_ASSERT(sum_rows_summed_area_table(table, image, y, y + 1),
+               "Error summing a row of the summed-area table", *error_msg);
+  }
+  end_trace_span("sum rows", span, TRACE_NO_ARG);
+  // Every row must be summed before the column pass
+  traced_barrier();
+  span = begin_trace_span();
+#pragma omp for nowait
+  for (size_t x = 0; x < image->width; x += SUMMED_AREA_COLUMN_BLOCK) {
+    OMP_SKIP_ON_ERROR(*error_msg);
+    size_t column_end = x + SUMMED_AREA_COLUMN_BLOCK;
+    if (column_end > image->width)
+      column_end = image->width;
+    OMP_ASSERT(sum_columns_summed_area_table(table, x, column_end),
+               "Error summing columns of the summed-area table", *error_msg);
   }
-  OMP_HANDLE_ASSERTS(error_msg);
-  if (!flush_ppm_image(image))
+  end_trace_span("sum columns", span, TRACE_NO_ARG);
+  traced_barrier();
+}
+
+int filter_rows_ppm_image(PpmImage *image, float threshold,
+                          float sharpen_factor, size_t m, int thread_count,
+                          BlurEngine blur_engine, size_t tile_size,
+                          size_t row_begin, size_t row_end,
+                          FilterScratch *scratch) {
+  if (image == NULL || row_begin > row_end || row_end > image->height)
     return 0;
-  return 1;
+  int result = 0;
+  char *error_msg = NULL;
+  FilterScratch own_scratch = {.table = NULL, .work = NULL, .work_capacity = 0};
+  if (scratch == NULL)
+    scratch = &own_scratch;
+  SummedAreaTable *table = NULL;
+  int needs_summing = 0;
+  if (blur_engine == BLUR_ENGINE_SUMMED_AREA) {
+    needs_summing = !scratch->is_table_summed;
+    if (needs_summing &&
+        !reserve_band_summed_area_table(&scratch->table, image, m, row_begin,
+                                        row_end))
+      return 0;
+    table = scratch->table;
+  }
+  TileGrid grid = tile_grid(image->width, row_end - row_begin, tile_size);
+  TileGrid *grid_ptr = (tile_size > 0) ? &grid : NULL;
+  // A single parallel region for every stage, so the team is woken once per
+  // image instead of once per stage
+#pragma omp parallel num_threads(thread_count)
+  {
+    if (needs_summing)
+      summed_area(image, table, &error_msg);
+    // The column pass ends on a barrier: the table is complete here
+    sharpen(image, table, threshold, sharpen_factor, m, grid_ptr, row_begin,
+            row_end, scratch->tiles, scratch->tile_count, &error_msg);
+  }
+  if (error_msg != NULL) {
+    puts(error_msg);
+    goto filter_exit;
+  }
+  result = 1;
+filter_exit:
+  free_filter_scratch(&own_scratch);
+  return result;
+}
+
+void free_filter_scratch(FilterScratch *scratch) {
+  if (scratch == NULL)
+    return;
+  free_summed_area_table(&scratch->table);
+  free_arena(scratch->work);
+  scratch->work = NULL;
+  scratch->work_capacity = 0;
+  scratch->is_table_summed = 0;
 }
 
+int filter_is_threaded(void) { return 1; }
+
 int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
-                     size_t m, int thread_count) {
+                     size_t m, int thread_count, BlurEngine blur_engine,
+                     size_t tile_size) {
   if (image == NULL)
     return 0;
-  if (!sharpen(image, threshold, sharpen_factor, m, thread_count))
+  if (!filter_rows_ppm_image(image, threshold, sharpen_factor, m,
+                             thread_count, blur_engine, tile_size, 0,
+                             image->height, NULL))
     return 0;
-  if (!grayscale(image, thread_count))
-    return 0;
-  return 1;
+  return flush_ppm_image(image);
 }
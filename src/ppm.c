@@ -3,11 +3,21 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "ppm.h"
+#include "arena.h"
+#include "numa.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include <errno.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define ASSERT(expr, msg, exit_label)                                          \
   if (!(expr)) {                                                               \
@@ -16,54 +26,1184 @@
   }
 #define MAX_LINE 4096
 
-PpmImage *read_ppm_image(FILE *source_file) {
-  ASSERT(source_file != NULL, "Source file is NULL", read_ppm_image_error);
-  PpmImage *image = malloc(sizeof(PpmImage));
+// Bytes per planar sample, which also matches the binary PPM sample width
+static inline size_t sample_size_ppm(PpmImage *image) {
+  return (image->max_value > UINT8_MAX) ? 2 : 1;
+}
+
+static inline void *read_buffer_ppm(PpmImage *image) {
+  if (image->storage != PPM_STORAGE_TRIPLETS)
+    return image->planes_read;
+  return image->color_values_read;
+}
+
+static inline void *write_buffer_ppm(PpmImage *image) {
+  if (image->storage != PPM_STORAGE_TRIPLETS)
+    return image->planes_write;
+  return image->color_values_write;
+}
+
+// Sample offset of an interleaved pixel channel in a buffer of `row_stride`
+// bytes per row; only padded rows pay for recovering the row
+static inline size_t interleaved_offset_ppm(PpmImage *image,
+                                            size_t row_stride, size_t idx,
+                                            size_t channel) {
+  size_t sample_size = sample_size_ppm(image);
+  if (row_stride == image->width * 3 * sample_size)
+    return idx * 3 + channel;
+  return (idx / image->width) * (row_stride / sample_size) +
+         (idx % image->width) * 3 + channel;
+}
+
+// Stores a raw 0..`max_value` integer in the given buffer, converting it to a
+// normalised float only for the triplet storage. Interleaved images are only
+// stored into through their write buffer.
+static inline void store_sample_ppm(PpmImage *image, void *buffer, size_t idx,
+                                    size_t channel, uint16_t value) {
+  if (image->storage != PPM_STORAGE_TRIPLETS) {
+    size_t offset = (image->storage == PPM_STORAGE_PLANAR)
+                        ? channel * image->width * image->height + idx
+                        : interleaved_offset_ppm(
+                              image, image->row_stride_write, idx, channel);
+    if (image->max_value > UINT8_MAX)
+      ((uint16_t *)buffer)[offset] = value;
+    else
+      ((uint8_t *)buffer)[offset] = (uint8_t)value;
+  } else {
+    float *samples = (float *)&((RgbTriplet *)buffer)[idx];
+    samples[channel] = ((float)value) / ((float)image->max_value);
+  }
+}
+
+// Raw 0..`max_value` integer of the read buffer, rounded the same way for
+// both storages so that saved images don't depend on it
+static inline uint16_t load_sample_ppm(PpmImage *image, size_t idx,
+                                       size_t channel) {
+  if (image->storage != PPM_STORAGE_TRIPLETS) {
+    size_t offset = (image->storage == PPM_STORAGE_PLANAR)
+                        ? channel * image->width * image->height + idx
+                        : interleaved_offset_ppm(
+                              image, image->row_stride_read, idx, channel);
+    if (image->max_value > UINT8_MAX)
+      return ((uint16_t *)image->planes_read)[offset];
+    return image->planes_read[offset];
+  }
+  float *samples = (float *)&image->color_values_read[idx];
+  return (uint16_t)roundf(samples[channel] * ((float)image->max_value));
+}
+
+// Raw sample of the grayscale formats, see `PPM_FORMAT_PGM_ASCII`
+static inline uint16_t load_gray_sample_ppm(PpmImage *image, size_t idx) {
+  if (image->luma_plane == NULL)
+    return load_sample_ppm(image, idx, 0);
+  if (image->max_value > UINT8_MAX)
+    return ((uint16_t *)image->luma_plane)[idx];
+  return image->luma_plane[idx];
+}
+
+// Maps the whole source file when it is a regular file, leaving `*mapping`
+// NULL otherwise (e.g. pipes), so callers can fall back to stdio
+static int map_source_file(FILE *source_file, uint8_t **mapping,
+                           size_t *mapping_size) {
+  *mapping = NULL;
+  *mapping_size = 0;
+  int fd = fileno(source_file);
+  struct stat source_stat;
+  if (fd < 0 || ftell(source_file) < 0 || fstat(fd, &source_stat) != 0 ||
+      !S_ISREG(source_stat.st_mode) || source_stat.st_size == 0)
+    return 1;
+  uint8_t *map = mmap(NULL, (size_t)source_stat.st_size, PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+  ASSERT(map != MAP_FAILED, "Error mapping the source file",
+         map_source_file_error);
+  madvise(map, (size_t)source_stat.st_size, MADV_SEQUENTIAL);
+  *mapping = map;
+  *mapping_size = (size_t)source_stat.st_size;
+  return 1;
+map_source_file_error:
+  return 0;
+}
+
+// Converts the binary samples (P6 or P5) of the pixels [idx_begin, idx_end),
+// which start at `body`, into `buffer`
+static void store_binary_ppm_samples(PpmImage *image, void *buffer,
+                                     const uint8_t *body, size_t idx_begin,
+                                     size_t idx_end, size_t channels) {
+  size_t sample_size = sample_size_ppm(image);
+  for (size_t idx = idx_begin; idx < idx_end; idx++) {
+    for (size_t channel = 0; channel < 3; channel++) {
+      // Grayscale (P5) samples are replicated into the three channels
+      size_t body_channel = (channels == 1) ? 0 : channel;
+      size_t offset =
+          ((idx - idx_begin) * channels + body_channel) * sample_size;
+      uint16_t sample = body[offset];
+      if (sample_size == 2)
+        sample = (uint16_t)((sample << 8) | body[offset + 1]);
+      store_sample_ppm(image, buffer, idx, channel, sample);
+    }
+  }
+}
+
+// Converts the binary body (P6 or P5) straight into the read buffer. Regular
+// files are memory-mapped; anything else (e.g. pipes) is read in bulk.
+static int read_binary_ppm_body(PpmImage *image, FILE *source_file,
+                                size_t channels) {
+  int result = 0;
+  size_t image_size = image->width * image->height;
+  size_t sample_size = sample_size_ppm(image);
+  size_t body_size = image_size * channels * sample_size;
+  uint8_t *body = NULL, *mapping = NULL;
+  size_t mapping_size = 0;
+  long body_offset = ftell(source_file);
+  ASSERT(map_source_file(source_file, &mapping, &mapping_size),
+         "Error mapping the binary PPM body", read_binary_ppm_body_exit);
+  if (mapping != NULL) {
+    ASSERT(mapping_size >= (size_t)body_offset + body_size,
+           "Binary PPM body is truncated", read_binary_ppm_body_exit);
+    body = mapping + body_offset;
+    ASSERT(fseek(source_file, body_offset + (long)body_size, SEEK_SET) == 0,
+           "Error seeking past the binary PPM body", read_binary_ppm_body_exit);
+  } else {
+    body = alloc_arena(body_size);
+    ASSERT(body != NULL, "Could not allocate the binary PPM body",
+           read_binary_ppm_body_exit);
+    ASSERT(fread(body, 1, body_size, source_file) == body_size,
+           "Binary PPM body is truncated", read_binary_ppm_body_exit);
+  }
+  store_binary_ppm_samples(image, read_buffer_ppm(image), body, 0, image_size,
+                           channels);
+  result = 1;
+read_binary_ppm_body_exit:
+  if (mapping != NULL)
+    munmap(mapping, mapping_size);
+  else
+    free_arena(body);
+  return result;
+}
+
+static inline int is_ascii_space(uint8_t c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+static inline int is_ascii_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+
+// Stores the `sample_idx`-th integer of a P3 body, or of a P2 one (with
+// `channels` 1), whose samples are replicated into the three channels
+static inline void store_ascii_sample_ppm(PpmImage *image, void *buffer,
+                                          size_t sample_idx, size_t channels,
+                                          uint16_t value) {
+  if (channels == 1) {
+    for (size_t channel = 0; channel < 3; channel++)
+      store_sample_ppm(image, buffer, sample_idx, channel, value);
+    return;
+  }
+  store_sample_ppm(image, buffer, sample_idx / 3, sample_idx % 3, value);
+}
+
+// Slice of a P3 body that starts and ends on whitespace, so that no integer
+// is split between two chunks
+typedef struct ascii_chunk {
+  PpmImage *image;
+  size_t channels;
+  const uint8_t *begin, *end;
+  size_t first_sample, sample_count;
+  int result;
+} AsciiChunk;
+
+static void *count_ascii_chunk(void *void_ptr) {
+  AsciiChunk *chunk = void_ptr;
+  size_t sample_count = 0;
+  int was_space = 1;
+  for (const uint8_t *cursor = chunk->begin; cursor < chunk->end; cursor++) {
+    int is_space = is_ascii_space(*cursor);
+    if (was_space && !is_space)
+      sample_count++;
+    was_space = is_space;
+  }
+  chunk->sample_count = sample_count;
+  return NULL;
+}
+
+// Parses the chunk integers straight into the samples of the write buffer
+static void *parse_ascii_chunk(void *void_ptr) {
+  AsciiChunk *chunk = void_ptr;
+  PpmImage *image = chunk->image;
+  void *buffer = write_buffer_ppm(image);
+  size_t sample_limit = image->width * image->height * chunk->channels;
+  size_t sample_idx = chunk->first_sample;
+  const uint8_t *cursor = chunk->begin;
+  chunk->result = 0;
+  while (cursor < chunk->end) {
+    while (cursor < chunk->end && is_ascii_space(*cursor))
+      cursor++;
+    if (cursor == chunk->end)
+      break;
+    uint32_t value = 0;
+    if (!is_ascii_digit(*cursor))
+      return NULL;
+    while (cursor < chunk->end && is_ascii_digit(*cursor)) {
+      value = value * 10 + (uint32_t)(*cursor++ - '0');
+      if (value > UINT16_MAX)
+        return NULL;
+    }
+    if (cursor < chunk->end && !is_ascii_space(*cursor))
+      return NULL;
+    if (sample_idx < sample_limit)
+      store_ascii_sample_ppm(image, buffer, sample_idx, chunk->channels,
+                             (uint16_t)value);
+    sample_idx++;
+  }
+  chunk->result = 1;
+  return NULL;
+}
+
+typedef struct ppm_workers {
+  // Span recorded for every item
+  const char *name;
+  void *(*routine)(void *);
+  uint8_t *items;
+  size_t item_size;
+} PpmWorkers;
+
+static void run_ppm_worker(void *context, size_t rank) {
+  PpmWorkers *workers = context;
+  uint64_t span = begin_trace_span();
+  workers->routine(&workers->items[rank * workers->item_size]);
+  end_trace_span(workers->name, span, (int64_t)rank);
+}
+
+// Runs `routine` over each of the `count` items of `items` on the shared
+// thread pool, the first one on the calling thread
+static void run_ppm_workers(const char *name, void *(*routine)(void *),
+                            void *items, size_t item_size, int count) {
+  PpmWorkers workers = {.name = name,
+                        .routine = routine,
+                        .items = items,
+                        .item_size = item_size};
+  run_thread_pool((size_t)count, run_ppm_worker, &workers);
+}
+
+// Parses a mapped P3 or P2 body on `thread_count` threads: each chunk counts
+// its integers, a prefix sum gives every chunk its first sample, and then
+// every chunk parses its integers in place
+static int parse_ascii_ppm_body(PpmImage *image, const uint8_t *body,
+                                size_t body_size, size_t channels,
+                                int thread_count) {
+  int result = 0;
+  if (thread_count < 1)
+    thread_count = 1;
+  // Tiny bodies aren't worth waking the pool
+  if (body_size / (size_t)thread_count < 4096)
+    thread_count = 1;
+  AsciiChunk *chunks = malloc(thread_count * sizeof(AsciiChunk));
+  ASSERT(chunks != NULL, "Could not allocate the P3 chunks",
+         parse_ascii_ppm_body_exit);
+  const uint8_t *body_end = body + body_size;
+  const uint8_t *chunk_begin = body;
+  for (int idx = 0; idx < thread_count; idx++) {
+    const uint8_t *chunk_end =
+        body + body_size * ((size_t)idx + 1) / (size_t)thread_count;
+    if (chunk_end < chunk_begin)
+      chunk_end = chunk_begin;
+    while (chunk_end < body_end && !is_ascii_space(*chunk_end))
+      chunk_end++;
+    chunks[idx] = (AsciiChunk){.image = image,
+                               .channels = channels,
+                               .begin = chunk_begin,
+                               .end = chunk_end,
+                               .first_sample = 0,
+                               .sample_count = 0,
+                               .result = 0};
+    chunk_begin = chunk_end;
+  }
+  run_ppm_workers("count P3", count_ascii_chunk, chunks, sizeof(AsciiChunk),
+                  thread_count);
+  size_t sample_count = 0;
+  for (int idx = 0; idx < thread_count; idx++) {
+    chunks[idx].first_sample = sample_count;
+    sample_count += chunks[idx].sample_count;
+  }
+  ASSERT(sample_count >= image->width * image->height * channels,
+         "Error reading `red`, `blue` and `green` integers",
+         parse_ascii_ppm_body_exit);
+  run_ppm_workers("parse P3", parse_ascii_chunk, chunks, sizeof(AsciiChunk),
+                  thread_count);
+  for (int idx = 0; idx < thread_count; idx++)
+    ASSERT(chunks[idx].result, "Malformed integer in the P3 body",
+           parse_ascii_ppm_body_exit);
+  image->needs_flushing = 1;
+  result = 1;
+parse_ascii_ppm_body_exit:
+  free(chunks);
+  return result;
+}
+
+// Serial tokenizer for sources that can't be mapped; it stops right after the
+// last needed integer, so any data that follows stays unread
+static int read_ascii_sample(FILE *source_file, uint16_t *sample) {
+  int c;
+  do {
+    c = getc_unlocked(source_file);
+  } while (c != EOF && is_ascii_space((uint8_t)c));
+  if (c == EOF || !is_ascii_digit((uint8_t)c))
+    return 0;
+  uint32_t value = 0;
+  do {
+    value = value * 10 + (uint32_t)(c - '0');
+    if (value > UINT16_MAX)
+      return 0;
+    c = getc_unlocked(source_file);
+  } while (c != EOF && is_ascii_digit((uint8_t)c));
+  if (c != EOF && !is_ascii_space((uint8_t)c))
+    return 0;
+  *sample = (uint16_t)value;
+  return 1;
+}
+
+// The mapped body is parsed up to the end of the file, so `may_map` must be 0
+// when more data (e.g. another frame) can follow it
+static int read_ascii_ppm_body(PpmImage *image, FILE *source_file,
+                               size_t channels, int thread_count,
+                               int may_map) {
+  int result = 0;
+  uint8_t *mapping = NULL;
+  size_t mapping_size = 0;
+  long body_offset = ftell(source_file);
+  ASSERT(!may_map || map_source_file(source_file, &mapping, &mapping_size),
+         "Error mapping the P3 body", read_ascii_ppm_body_exit);
+  if (mapping != NULL) {
+    ASSERT(mapping_size >= (size_t)body_offset, "P3 body is missing",
+           read_ascii_ppm_body_exit);
+    ASSERT(parse_ascii_ppm_body(image, mapping + body_offset,
+                                mapping_size - (size_t)body_offset, channels,
+                                thread_count),
+           "Error parsing the P3 body", read_ascii_ppm_body_exit);
+    ASSERT(fseek(source_file, 0, SEEK_END) == 0,
+           "Error seeking past the P3 body", read_ascii_ppm_body_exit);
+  } else {
+    void *buffer = write_buffer_ppm(image);
+    size_t sample_count = image->width * image->height * channels;
+    flockfile(source_file);
+    for (size_t idx = 0; idx < sample_count; idx++) {
+      uint16_t sample;
+      if (!read_ascii_sample(source_file, &sample)) {
+        funlockfile(source_file);
+        ASSERT(0, "Error reading `red`, `blue` and `green` integers",
+               read_ascii_ppm_body_exit);
+      }
+      store_ascii_sample_ppm(image, buffer, idx, channels, sample);
+    }
+    funlockfile(source_file);
+    image->needs_flushing = 1;
+  }
+  result = 1;
+read_ascii_ppm_body_exit:
+  if (mapping != NULL)
+    munmap(mapping, mapping_size);
+  return result;
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_OP_MASK 0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+// Rows per band, at most, of the encoder
+#define QOI_BAND_ROWS 64
+
+static const uint8_t qoi_end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+// Ends the band table, which is laid out after the end marker as the band
+// count, the offset of every band from the first chunk and the band count
+// again, all big-endian, so it can be found from either side
+static const uint8_t qoi_band_magic[4] = {'q', 'o', 'i', 'b'};
+
+static inline uint32_t load_be32(const uint8_t *bytes) {
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+         ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+static inline uint64_t load_be64(const uint8_t *bytes) {
+  return ((uint64_t)load_be32(bytes) << 32) | (uint64_t)load_be32(bytes + 4);
+}
+
+static inline void store_be32(uint8_t *bytes, uint32_t value) {
+  bytes[0] = (uint8_t)(value >> 24);
+  bytes[1] = (uint8_t)(value >> 16);
+  bytes[2] = (uint8_t)(value >> 8);
+  bytes[3] = (uint8_t)value;
+}
+
+static inline void store_be64(uint8_t *bytes, uint64_t value) {
+  store_be32(bytes, (uint32_t)(value >> 32));
+  store_be32(bytes + 4, (uint32_t)value);
+}
+
+static inline size_t hash_qoi_pixel(const uint8_t *pixel) {
+  return (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+}
+
+static void reset_qoi_decoder(QoiDecoder *decoder) {
+  memset(decoder, 0, sizeof(QoiDecoder));
+  decoder->pixel[3] = UINT8_MAX;
+}
+
+static inline size_t qoi_chunk_size(uint8_t tag) {
+  if (tag == QOI_OP_RGBA)
+    return 5;
+  if (tag == QOI_OP_RGB)
+    return 4;
+  return ((tag & QOI_OP_MASK) == QOI_OP_LUMA) ? 2 : 1;
+}
+
+static inline void decode_qoi_chunk(QoiDecoder *decoder,
+                                    const uint8_t *chunk) {
+  uint8_t *pixel = decoder->pixel;
+  uint8_t tag = chunk[0];
+  if (tag == QOI_OP_RGB || tag == QOI_OP_RGBA) {
+    memcpy(pixel, chunk + 1, (tag == QOI_OP_RGBA) ? 4 : 3);
+  } else if ((tag & QOI_OP_MASK) == QOI_OP_INDEX) {
+    memcpy(pixel, decoder->index[tag], 4);
+  } else if ((tag & QOI_OP_MASK) == QOI_OP_DIFF) {
+    pixel[0] = (uint8_t)(pixel[0] + ((tag >> 4) & 3) - 2);
+    pixel[1] = (uint8_t)(pixel[1] + ((tag >> 2) & 3) - 2);
+    pixel[2] = (uint8_t)(pixel[2] + (tag & 3) - 2);
+  } else if ((tag & QOI_OP_MASK) == QOI_OP_LUMA) {
+    int green_diff = (tag & 0x3f) - 32;
+    pixel[0] = (uint8_t)(pixel[0] + green_diff - 8 + (chunk[1] >> 4));
+    pixel[1] = (uint8_t)(pixel[1] + green_diff);
+    pixel[2] = (uint8_t)(pixel[2] + green_diff - 8 + (chunk[1] & 0x0f));
+  } else {
+    // The chunk itself is the first pixel of the run
+    decoder->run_length = tag & 0x3f;
+  }
+  memcpy(decoder->index[hash_qoi_pixel(pixel)], pixel, 4);
+}
+
+static inline void store_qoi_pixel(PpmImage *image, void *buffer, size_t idx,
+                                   const uint8_t *pixel) {
+  for (size_t channel = 0; channel < 3; channel++)
+    store_sample_ppm(image, buffer, idx, channel, pixel[channel]);
+}
+
+// Decodes the pixels [idx_begin, idx_end) from the chunks that start at
+// `*cursor`, which is left after the last one used; returns 0 when the
+// chunks end before the pixels
+static int decode_qoi_pixels(QoiDecoder *decoder, PpmImage *image,
+                             void *buffer, const uint8_t **cursor,
+                             const uint8_t *end, size_t idx_begin,
+                             size_t idx_end) {
+  const uint8_t *chunk = *cursor;
+  for (size_t idx = idx_begin; idx < idx_end; idx++) {
+    if (decoder->run_length > 0) {
+      decoder->run_length--;
+    } else {
+      if (chunk >= end || (size_t)(end - chunk) < qoi_chunk_size(*chunk))
+        return 0;
+      decode_qoi_chunk(decoder, chunk);
+      chunk += qoi_chunk_size(*chunk);
+    }
+    store_qoi_pixel(image, buffer, idx, decoder->pixel);
+  }
+  *cursor = chunk;
+  return 1;
+}
+
+// Same as `decode_qoi_pixels`, but reads the chunks from `source_file`,
+// leaving it right after the last one used
+static int read_qoi_pixels(QoiDecoder *decoder, PpmImage *image, void *buffer,
+                           FILE *source_file, size_t idx_begin,
+                           size_t idx_end) {
+  int result = 0;
+  flockfile(source_file);
+  for (size_t idx = idx_begin; idx < idx_end; idx++) {
+    if (decoder->run_length > 0) {
+      decoder->run_length--;
+    } else {
+      uint8_t chunk[5];
+      int c = getc_unlocked(source_file);
+      if (c == EOF)
+        goto read_qoi_pixels_exit;
+      chunk[0] = (uint8_t)c;
+      for (size_t offset = 1; offset < qoi_chunk_size(chunk[0]); offset++) {
+        c = getc_unlocked(source_file);
+        if (c == EOF)
+          goto read_qoi_pixels_exit;
+        chunk[offset] = (uint8_t)c;
+      }
+      decode_qoi_chunk(decoder, chunk);
+    }
+    store_qoi_pixel(image, buffer, idx, decoder->pixel);
+  }
+  result = 1;
+read_qoi_pixels_exit:
+  funlockfile(source_file);
+  return result;
+}
+
+// Reads the end marker and the band table, if any, after the last chunk,
+// without reading past them, so another frame may follow
+static int skip_qoi_trailer(FILE *source_file) {
+  uint8_t bytes[8];
+  ASSERT(fread(bytes, 1, 8, source_file) == 8 &&
+             memcmp(bytes, qoi_end_marker, 8) == 0,
+         "QOI end marker is missing", skip_qoi_trailer_error);
+  // A band table starts with the high byte of its count, never set, while
+  // frames start with a letter or whitespace
+  int c = getc(source_file);
+  if (c != 0) {
+    if (c != EOF)
+      ungetc(c, source_file);
+    return 1;
+  }
+  ASSERT(fread(bytes + 1, 1, 3, source_file) == 3,
+         "QOI band table is truncated", skip_qoi_trailer_error);
+  uint32_t band_count = load_be32(bytes);
+  for (uint32_t band = 0; band < band_count; band++)
+    ASSERT(fread(bytes, 1, 8, source_file) == 8,
+           "QOI band table is truncated", skip_qoi_trailer_error);
+  ASSERT(fread(bytes, 1, 8, source_file) == 8 &&
+             load_be32(bytes) == band_count &&
+             memcmp(bytes + 4, qoi_band_magic, 4) == 0,
+         "QOI band table is malformed", skip_qoi_trailer_error);
+  return 1;
+skip_qoi_trailer_error:
+  return 0;
+}
+
+// Looks for the band table at the very end of `[chunks, end)`, leaving
+// `*band_count` at 0 when there is none or it doesn't match `image`
+static void find_qoi_band_table(PpmImage *image, const uint8_t *chunks,
+                                const uint8_t *end, const uint8_t **offsets,
+                                size_t *band_count) {
+  *offsets = NULL;
+  *band_count = 0;
+  size_t size = (size_t)(end - chunks);
+  if (size < 8 + 12 || memcmp(end - 4, qoi_band_magic, 4) != 0)
+    return;
+  size_t count = load_be32(end - 8);
+  if (count == 0 || count > image->height || count > (size - 8 - 12) / 8)
+    return;
+  const uint8_t *table = end - 8 - 8 * count - 4;
+  if (load_be32(table) != count || memcmp(table - 8, qoi_end_marker, 8) != 0)
+    return;
+  // Bands must start in order, the first one right at `chunks`
+  uint64_t chunks_size = (uint64_t)(table - 8 - chunks), previous = 0;
+  for (size_t band = 0; band < count; band++) {
+    uint64_t offset = load_be64(table + 4 + 8 * band);
+    if ((band == 0 && offset != 0) || offset < previous ||
+        offset > chunks_size)
+      return;
+    previous = offset;
+  }
+  *offsets = table + 4;
+  *band_count = count;
+}
+
+// Consecutive bands of a QOI body decoded by one thread, each one from a
+// fresh decoder
+typedef struct qoi_slice {
+  PpmImage *image;
+  const uint8_t *chunks, *chunks_end, *offsets;
+  size_t band_count, band_begin, band_end;
+  int result;
+} QoiSlice;
+
+static void *decode_qoi_slice(void *void_ptr) {
+  QoiSlice *slice = void_ptr;
+  PpmImage *image = slice->image;
+  slice->result = 0;
+  for (size_t band = slice->band_begin; band < slice->band_end; band++) {
+    QoiDecoder decoder;
+    reset_qoi_decoder(&decoder);
+    const uint8_t *cursor =
+        slice->chunks + load_be64(slice->offsets + 8 * band);
+    const uint8_t *end =
+        (band + 1 < slice->band_count)
+            ? slice->chunks + load_be64(slice->offsets + 8 * (band + 1))
+            : slice->chunks_end;
+    size_t row_begin = image->height * band / slice->band_count;
+    size_t row_end = image->height * (band + 1) / slice->band_count;
+    if (!decode_qoi_pixels(&decoder, image, read_buffer_ppm(image), &cursor,
+                           end, row_begin * image->width,
+                           row_end * image->width))
+      return NULL;
+  }
+  slice->result = 1;
+  return NULL;
+}
+
+// Decodes the QOI body straight into the read buffer. Mapped files with a
+// band table are decoded on `thread_count` threads; `may_map` must be 0 when
+// another frame can follow, as for `read_ascii_ppm_body`.
+static int read_qoi_body(PpmImage *image, FILE *source_file,
+                         QoiDecoder *decoder, int thread_count, int may_map) {
+  int result = 0;
+  uint8_t *mapping = NULL;
+  size_t mapping_size = 0;
+  QoiSlice *slices = NULL;
+  size_t image_size = image->width * image->height;
+  long body_offset = ftell(source_file);
+  ASSERT(!may_map || map_source_file(source_file, &mapping, &mapping_size),
+         "Error mapping the QOI body", read_qoi_body_exit);
+  if (mapping == NULL) {
+    ASSERT(read_qoi_pixels(decoder, image, read_buffer_ppm(image),
+                           source_file, 0, image_size),
+           "QOI body is truncated", read_qoi_body_exit);
+    ASSERT(skip_qoi_trailer(source_file), "Error reading the QOI trailer",
+           read_qoi_body_exit);
+    result = 1;
+    goto read_qoi_body_exit;
+  }
+  ASSERT(mapping_size >= (size_t)body_offset, "QOI body is missing",
+         read_qoi_body_exit);
+  const uint8_t *chunks = mapping + body_offset;
+  const uint8_t *end = mapping + mapping_size;
+  const uint8_t *offsets;
+  size_t band_count;
+  find_qoi_band_table(image, chunks, end, &offsets, &band_count);
+  if (thread_count < 1)
+    thread_count = 1;
+  if ((size_t)thread_count > band_count)
+    thread_count = (band_count > 0) ? (int)band_count : 1;
+  if (thread_count == 1) {
+    ASSERT(decode_qoi_pixels(decoder, image, read_buffer_ppm(image), &chunks,
+                             end, 0, image_size),
+           "QOI body is truncated", read_qoi_body_exit);
+  } else {
+    slices = malloc(thread_count * sizeof(QoiSlice));
+    ASSERT(slices != NULL, "Could not allocate the QOI slices",
+           read_qoi_body_exit);
+    for (int idx = 0; idx < thread_count; idx++)
+      slices[idx] = (QoiSlice){
+          .image = image,
+          .chunks = chunks,
+          .chunks_end = offsets - 4 - 8,
+          .offsets = offsets,
+          .band_count = band_count,
+          .band_begin = band_count * (size_t)idx / (size_t)thread_count,
+          .band_end = band_count * ((size_t)idx + 1) / (size_t)thread_count,
+          .result = 0};
+    run_ppm_workers("decode QOI", decode_qoi_slice, slices, sizeof(QoiSlice),
+                    thread_count);
+    for (int idx = 0; idx < thread_count; idx++)
+      ASSERT(slices[idx].result, "QOI band is truncated", read_qoi_body_exit);
+  }
+  ASSERT(fseek(source_file, 0, SEEK_END) == 0,
+         "Error seeking past the QOI body", read_qoi_body_exit);
+  result = 1;
+read_qoi_body_exit:
+  free(slices);
+  if (mapping != NULL)
+    munmap(mapping, mapping_size);
+  return result;
+}
+
+// Reads the rest of the 14-byte QOI header, after its first two bytes
+static int read_qoi_header(FILE *source_file, PpmStream *stream) {
+  uint8_t header[QOI_HEADER_SIZE - 2];
+  ASSERT(fread(header, 1, sizeof(header), source_file) == sizeof(header),
+         "Error reading the QOI header", read_qoi_header_error);
+  ASSERT(header[0] == 'i' && header[1] == 'f', "Unsupported format",
+         read_qoi_header_error);
+  ASSERT(header[10] == 3 || header[10] == 4,
+         "QOI `channels` must be 3 or 4", read_qoi_header_error);
+  stream->source_file = source_file;
+  stream->width = load_be32(header + 2);
+  stream->height = load_be32(header + 6);
+  stream->max_value = UINT8_MAX;
+  stream->channels = 3;
+  stream->is_ascii = 0;
+  stream->is_qoi = 1;
+  stream->next_row = 0;
+  reset_qoi_decoder(&stream->qoi);
+  return 1;
+read_qoi_header_error:
+  return 0;
+}
+
+// Reads everything up to the body, leaving `source_file` at its first byte
+static int read_ppm_header(FILE *source_file, PpmStream *stream) {
   char header[2];
-  ASSERT(fscanf(source_file, "%c%c", &header[0], &header[1]),
-         "Error reading the file header", read_ppm_image_error);
-  ASSERT(header[0] == 'P' && header[1] == '3',
-         "Unsupported format (expected `P3`)", read_ppm_image_error)
+  ASSERT(fscanf(source_file, "%c%c", &header[0], &header[1]) == 2,
+         "Error reading the file header", read_ppm_header_error);
+  if (header[0] == 'q' && header[1] == 'o')
+    return read_qoi_header(source_file, stream);
+  ASSERT(header[0] == 'P' && (header[1] == '2' || header[1] == '3' ||
+                              header[1] == '5' || header[1] == '6'),
+         "Unsupported format (expected `P2`, `P3`, `P5`, `P6` or QOI)",
+         read_ppm_header_error)
   char line[MAX_LINE];
   do {
     ASSERT(fgets(line, MAX_LINE, source_file),
-           "Error reading line(s) after header", read_ppm_image_error);
+           "Error reading line(s) after header", read_ppm_header_error);
   } while (line[0] == '#' || line[0] == '\n');
-  ASSERT(sscanf(line, "%lu %lu", &image->width, &image->height),
-         "Error reading `width` and `height` integers", read_ppm_image_error);
-  ASSERT(fscanf(source_file, "%hu", &image->max_value),
-         "Error reading `max_value` integer", read_ppm_image_error);
+  ASSERT(sscanf(line, "%lu %lu", &stream->width, &stream->height),
+         "Error reading `width` and `height` integers", read_ppm_header_error);
+  ASSERT(fscanf(source_file, "%hu", &stream->max_value),
+         "Error reading `max_value` integer", read_ppm_header_error);
+  ASSERT(stream->max_value > 0, "PPM `max_value` integer must be positive",
+         read_ppm_header_error);
+  stream->source_file = source_file;
+  stream->is_ascii = header[1] == '2' || header[1] == '3';
+  stream->is_qoi = 0;
+  stream->channels = (header[1] == '2' || header[1] == '5') ? 1 : 3;
+  stream->next_row = 0;
+  // Exactly one whitespace character separates `max_value` from a binary
+  // body, while the P3 and P2 tokenizers skip any amount of it
+  if (!stream->is_ascii)
+    ASSERT(fgetc(source_file) != EOF, "Binary PPM body is missing",
+           read_ppm_header_error);
+  return 1;
+read_ppm_header_error:
+  return 0;
+}
+
+size_t buffer_size_ppm_image(PpmImage *image) {
   size_t image_size = image->width * image->height;
-  image->color_values_write = malloc(image_size * sizeof(RgbTriplet));
-  image->color_values_read = malloc(image_size * sizeof(RgbTriplet));
-  image->needs_flushing = 0;
-  for (size_t idx = 0; idx < image_size; idx++) {
-    uint16_t red, green, blue;
-    ASSERT(fscanf(source_file, "%hu %hu %hu", &red, &green, &blue),
-           "Error reading `red`, `blue` and `green` integers",
+  if (image->storage == PPM_STORAGE_TRIPLETS)
+    return image_size * sizeof(RgbTriplet);
+  return image_size * 3 * sample_size_ppm(image);
+}
+
+// Byte span of the pixels [x_begin, x_end) of row `y` in `plane`, in either
+// buffer of a triplet or planar image
+static inline void region_span_ppm(PpmImage *image, size_t plane, size_t y,
+                                   size_t x_begin, size_t x_end,
+                                   size_t *offset, size_t *length) {
+  size_t pixel_size = (image->storage == PPM_STORAGE_TRIPLETS)
+                          ? sizeof(RgbTriplet)
+                          : sample_size_ppm(image);
+  size_t plane_size = image->width * image->height * pixel_size;
+  *offset = plane * plane_size + (y * image->width + x_begin) * pixel_size;
+  *length = (x_end - x_begin) * pixel_size;
+}
+
+static inline int is_region_valid_ppm(PpmImage *image, size_t x_begin,
+                                      size_t x_end, size_t y_begin,
+                                      size_t y_end) {
+  return image->storage != PPM_STORAGE_INTERLEAVED && x_begin <= x_end &&
+         x_end <= image->width && y_begin <= y_end && y_end <= image->height;
+}
+
+int changed_region_ppm_image(PpmImage *image, PpmBuffer buffer,
+                             const void *snapshot, size_t *x_begin,
+                             size_t *x_end, size_t *y_begin, size_t *y_end) {
+  if (image == NULL || snapshot == NULL ||
+      !is_region_valid_ppm(image, *x_begin, *x_end, *y_begin, *y_end))
+    return 1;
+  const uint8_t *samples = (buffer == PPM_BUFFER_READ)
+                               ? read_buffer_ppm(image)
+                               : write_buffer_ppm(image);
+  const uint8_t *previous = snapshot;
+  size_t pixel_size = (image->storage == PPM_STORAGE_TRIPLETS)
+                          ? sizeof(RgbTriplet)
+                          : sample_size_ppm(image);
+  size_t plane_count = (image->storage == PPM_STORAGE_PLANAR) ? 3 : 1;
+  size_t changed_x_begin = *x_end, changed_x_end = *x_begin;
+  size_t changed_y_begin = *y_end, changed_y_end = *y_begin;
+  for (size_t plane = 0; plane < plane_count; plane++) {
+    for (size_t y = *y_begin; y < *y_end; y++) {
+      size_t offset, length;
+      region_span_ppm(image, plane, y, *x_begin, *x_end, &offset, &length);
+      if (memcmp(&samples[offset], &previous[offset], length) == 0)
+        continue;
+      // Only the first and last differing bytes of the row widen the box
+      size_t first = 0, last = length - 1;
+      while (samples[offset + first] == previous[offset + first])
+        first++;
+      while (samples[offset + last] == previous[offset + last])
+        last--;
+      if (*x_begin + first / pixel_size < changed_x_begin)
+        changed_x_begin = *x_begin + first / pixel_size;
+      if (*x_begin + last / pixel_size + 1 > changed_x_end)
+        changed_x_end = *x_begin + last / pixel_size + 1;
+      if (y < changed_y_begin)
+        changed_y_begin = y;
+      if (y + 1 > changed_y_end)
+        changed_y_end = y + 1;
+    }
+  }
+  if (changed_y_begin >= changed_y_end)
+    return 0;
+  *x_begin = changed_x_begin;
+  *x_end = changed_x_end;
+  *y_begin = changed_y_begin;
+  *y_end = changed_y_end;
+  return 1;
+}
+
+int copy_region_ppm_image(PpmImage *image, PpmBuffer buffer, void *snapshot,
+                          int is_restoring, size_t x_begin, size_t x_end,
+                          size_t y_begin, size_t y_end) {
+  ASSERT(image != NULL && snapshot != NULL, "PPM image or snapshot is NULL",
+         copy_region_ppm_image_error);
+  ASSERT(is_region_valid_ppm(image, x_begin, x_end, y_begin, y_end),
+         "Invalid PPM image region", copy_region_ppm_image_error);
+  uint8_t *samples = (buffer == PPM_BUFFER_READ) ? read_buffer_ppm(image)
+                                                 : write_buffer_ppm(image);
+  size_t plane_count = (image->storage == PPM_STORAGE_PLANAR) ? 3 : 1;
+  for (size_t plane = 0; plane < plane_count; plane++) {
+    for (size_t y = y_begin; y < y_end; y++) {
+      size_t offset, length;
+      region_span_ppm(image, plane, y, x_begin, x_end, &offset, &length);
+      if (is_restoring)
+        memcpy(&samples[offset], (uint8_t *)snapshot + offset, length);
+      else
+        memcpy((uint8_t *)snapshot + offset, &samples[offset], length);
+    }
+  }
+  if (is_restoring && buffer == PPM_BUFFER_WRITE)
+    image->needs_flushing = 1;
+  return 1;
+copy_region_ppm_image_error:
+  return 0;
+}
+
+void report_numa_ppm_image(PpmImage *image, int thread_count) {
+  if (image == NULL || thread_count < 1)
+    return;
+  size_t segment_count = (image->storage == PPM_STORAGE_PLANAR) ? 3 : 1;
+  report_numa_buffer("read buffer", read_buffer_ppm(image),
+                     buffer_size_ppm_image(image), segment_count,
+                     (size_t)thread_count);
+  report_numa_buffer("write buffer", write_buffer_ppm(image),
+                     buffer_size_ppm_image(image), segment_count,
+                     (size_t)thread_count);
+}
+
+static void free_ppm_buffers(PpmImage *image) {
+  // Interleaved buffers belong to the caller
+  if (image->storage == PPM_STORAGE_INTERLEAVED) {
+    image->planes_write = NULL;
+    image->planes_read = NULL;
+  }
+  free_arena(image->color_values_write);
+  free_arena(image->color_values_read);
+  free_arena(image->planes_write);
+  free_arena(image->planes_read);
+  free_arena(image->luma_plane);
+  image->color_values_write = NULL;
+  image->color_values_read = NULL;
+  image->planes_write = NULL;
+  image->planes_read = NULL;
+  image->luma_plane = NULL;
+  image->buffer_capacity = 0;
+}
+
+PpmImage *read_ppm_image(FILE *source_file, int thread_count,
+                         PpmStorage storage) {
+  return reread_ppm_image(source_file, thread_count, storage, NULL);
+}
+
+// Buffers are allocated with `alloc_shared_arena` when `is_shared`
+static PpmImage *load_ppm_image(FILE *source_file, int thread_count,
+                                PpmStorage storage, PpmImage *recycled,
+                                int may_map, int is_shared) {
+  PpmImage *image = recycled;
+  ASSERT(source_file != NULL, "Source file is NULL", read_ppm_image_error);
+  if (image == NULL) {
+    image = malloc(sizeof(PpmImage));
+    ASSERT(image != NULL, "Could not allocate the PPM image",
            read_ppm_image_error);
-    RgbTriplet rgb =
-        (RgbTriplet){.r = ((float)red) / ((float)image->max_value),
-                     .g = ((float)green) / ((float)image->max_value),
-                     .b = ((float)blue) / ((float)image->max_value)};
-    write_at_idx_ppm_image(image, idx, rgb);
+    *image = (PpmImage){.color_values_write = NULL,
+                        .color_values_read = NULL,
+                        .planes_write = NULL,
+                        .planes_read = NULL,
+                        .buffer_capacity = 0,
+                        .storage = storage};
+  }
+  // Buffers of the other storage can't be reused
+  if (image->storage != storage)
+    free_ppm_buffers(image);
+  image->storage = storage;
+  PpmStream header;
+  ASSERT(read_ppm_header(source_file, &header), "Error reading the PPM header",
+         read_ppm_image_error);
+  image->width = header.width;
+  image->height = header.height;
+  image->max_value = header.max_value;
+  size_t buffer_size = buffer_size_ppm_image(image);
+  if (buffer_size > image->buffer_capacity ||
+      read_buffer_ppm(image) == NULL || write_buffer_ppm(image) == NULL) {
+    free_ppm_buffers(image);
+    void *(*alloc_buffer)(size_t) =
+        is_shared ? alloc_shared_arena : alloc_arena;
+    if (storage == PPM_STORAGE_PLANAR) {
+      image->planes_write = alloc_buffer(buffer_size);
+      image->planes_read = alloc_buffer(buffer_size);
+    } else {
+      image->color_values_write = alloc_buffer(buffer_size);
+      image->color_values_read = alloc_buffer(buffer_size);
+    }
+    image->buffer_capacity = buffer_size;
+    // Before anything else touches them, so each band lands on its node
+    size_t segment_count = (storage == PPM_STORAGE_PLANAR) ? 3 : 1;
+    place_numa_buffer(read_buffer_ppm(image), buffer_size, segment_count,
+                      (size_t)thread_count);
+    place_numa_buffer(write_buffer_ppm(image), buffer_size, segment_count,
+                      (size_t)thread_count);
+  }
+  ASSERT(read_buffer_ppm(image) != NULL && write_buffer_ppm(image) != NULL,
+         "Could not allocate the PPM image buffers", read_ppm_image_error);
+  image->needs_flushing = 0;
+  uint64_t span = begin_trace_span();
+  if (header.is_qoi) {
+    ASSERT(read_qoi_body(image, source_file, &header.qoi, thread_count,
+                         may_map),
+           "Error reading the QOI body", read_ppm_image_error);
+    end_trace_span("parse", span, TRACE_NO_ARG);
+    return image;
+  }
+  if (!header.is_ascii) {
+    ASSERT(read_binary_ppm_body(image, source_file, header.channels),
+           "Error reading the binary PPM body", read_ppm_image_error);
+    end_trace_span("parse", span, TRACE_NO_ARG);
+    return image;
   }
+  ASSERT(read_ascii_ppm_body(image, source_file, header.channels,
+                             thread_count, may_map),
+         "Error reading the P3 body", read_ppm_image_error);
   ASSERT(flush_ppm_image(image), "Error flushing the image write buffer",
          read_ppm_image_error);
+  end_trace_span("parse", span, TRACE_NO_ARG);
   return image;
 read_ppm_image_error:
   free_ppm_image(&image);
   return NULL;
 }
 
+PpmImage *reread_ppm_image(FILE *source_file, int thread_count,
+                           PpmStorage storage, PpmImage *recycled) {
+  return load_ppm_image(source_file, thread_count, storage, recycled, 1, 0);
+}
+
+PpmImage *read_shared_ppm_image(FILE *source_file, int thread_count,
+                                PpmStorage storage) {
+  return load_ppm_image(source_file, thread_count, storage, NULL, 1, 1);
+}
+
+PpmImage *read_ppm_frame(FILE *source_file, int thread_count,
+                         PpmStorage storage, PpmImage *recycled) {
+  return load_ppm_image(source_file, thread_count, storage, recycled, 0, 0);
+}
+
+int has_ppm_frame(FILE *source_file) {
+  int c;
+  do {
+    c = getc(source_file);
+  } while (c != EOF && is_ascii_space((uint8_t)c));
+  if (c == EOF)
+    return 0;
+  ungetc(c, source_file);
+  return 1;
+}
+
+int open_ppm_stream(PpmStream *stream, FILE *source_file) {
+  ASSERT(stream != NULL, "PPM stream is NULL", open_ppm_stream_error);
+  ASSERT(source_file != NULL, "Source file is NULL", open_ppm_stream_error);
+  return read_ppm_header(source_file, stream);
+open_ppm_stream_error:
+  return 0;
+}
+
+PpmImage *alloc_ppm_window(PpmStream *stream, size_t row_capacity,
+                           PpmStorage storage) {
+  PpmImage *window = NULL;
+  ASSERT(stream != NULL, "PPM stream is NULL", alloc_ppm_window_error);
+  window = malloc(sizeof(PpmImage));
+  ASSERT(window != NULL, "Could not allocate the PPM window",
+         alloc_ppm_window_error);
+  *window = (PpmImage){.width = stream->width,
+                       .height = 0,
+                       .max_value = stream->max_value,
+                       .color_values_write = NULL,
+                       .color_values_read = NULL,
+                       .planes_write = NULL,
+                       .planes_read = NULL,
+                       .storage = storage,
+                       .needs_flushing = 0};
+  size_t window_size = stream->width * row_capacity;
+  size_t buffer_size = (storage == PPM_STORAGE_PLANAR)
+                           ? window_size * 3 * sample_size_ppm(window)
+                           : window_size * sizeof(RgbTriplet);
+  if (storage == PPM_STORAGE_PLANAR) {
+    window->planes_write = alloc_arena(buffer_size);
+    window->planes_read = alloc_arena(buffer_size);
+  } else {
+    window->color_values_write = alloc_arena(buffer_size);
+    window->color_values_read = alloc_arena(buffer_size);
+  }
+  window->buffer_capacity = buffer_size;
+  ASSERT(read_buffer_ppm(window) != NULL && write_buffer_ppm(window) != NULL,
+         "Could not allocate the PPM window buffers", alloc_ppm_window_error);
+  return window;
+alloc_ppm_window_error:
+  free_ppm_image(&window);
+  return NULL;
+}
+
+int slide_ppm_window(PpmStream *stream, PpmImage *window, size_t dropped_rows,
+                     size_t read_rows) {
+  int result = 0;
+  uint8_t *row = NULL;
+  ASSERT(stream != NULL, "PPM stream is NULL", slide_ppm_window_exit);
+  ASSERT(window != NULL, "PPM window is NULL", slide_ppm_window_exit);
+  ASSERT(dropped_rows <= window->height,
+         "Error dropping more rows than the PPM window holds",
+         slide_ppm_window_exit);
+  ASSERT(read_rows <= stream->height - stream->next_row,
+         "Error reading past the last row of the PPM stream",
+         slide_ppm_window_exit);
+  size_t width = window->width, sample_size = sample_size_ppm(window);
+  size_t kept_rows = window->height - dropped_rows;
+  size_t height = kept_rows + read_rows;
+  size_t pixel_size = (window->storage == PPM_STORAGE_PLANAR)
+                          ? 3 * sample_size
+                          : sizeof(RgbTriplet);
+  ASSERT(height * width * pixel_size <= window->buffer_capacity,
+         "PPM window is too small", slide_ppm_window_exit);
+  // No rows are pending in the write buffer between slides, so the kept ones
+  // are copied there in the layout of the new height and the buffers swapped
+  if (kept_rows > 0 && dropped_rows + read_rows > 0) {
+    if (window->storage == PPM_STORAGE_PLANAR) {
+      size_t plane_size = kept_rows * width * sample_size;
+      for (size_t channel = 0; channel < 3; channel++)
+        memcpy(window->planes_write + channel * width * height * sample_size,
+               window->planes_read +
+                   (channel * window->height + dropped_rows) * width *
+                       sample_size,
+               plane_size);
+    } else {
+      memcpy(window->color_values_write,
+             window->color_values_read + dropped_rows * width,
+             kept_rows * width * sizeof(RgbTriplet));
+    }
+    window->needs_flushing = 1;
+    ASSERT(flush_ppm_image(window), "Error flushing the PPM window",
+           slide_ppm_window_exit);
+  }
+  window->needs_flushing = 0;
+  window->height = height;
+  void *buffer = read_buffer_ppm(window);
+  size_t idx_begin = kept_rows * width;
+  if (stream->is_qoi) {
+    ASSERT(read_qoi_pixels(&stream->qoi, window, buffer, stream->source_file,
+                           idx_begin, height * width),
+           "QOI body is truncated", slide_ppm_window_exit);
+  } else if (stream->is_ascii) {
+    size_t channels = stream->channels;
+    flockfile(stream->source_file);
+    for (size_t idx = idx_begin * channels; idx < height * width * channels;
+         idx++) {
+      uint16_t sample;
+      if (!read_ascii_sample(stream->source_file, &sample)) {
+        funlockfile(stream->source_file);
+        ASSERT(0, "Error reading `red`, `blue` and `green` integers",
+               slide_ppm_window_exit);
+      }
+      store_ascii_sample_ppm(window, buffer, idx, channels, sample);
+    }
+    funlockfile(stream->source_file);
+  } else {
+    size_t row_size = width * stream->channels * sample_size;
+    row = malloc(row_size);
+    ASSERT(row != NULL, "Could not allocate the binary PPM row",
+           slide_ppm_window_exit);
+    for (size_t y = kept_rows; y < height; y++) {
+      ASSERT(fread(row, 1, row_size, stream->source_file) == row_size,
+             "Binary PPM body is truncated", slide_ppm_window_exit);
+      store_binary_ppm_samples(window, buffer, row, y * width,
+                               (y + 1) * width, stream->channels);
+    }
+  }
+  stream->next_row += read_rows;
+  result = 1;
+slide_ppm_window_exit:
+  free(row);
+  return result;
+}
+
+int wrap_ppm_image(PpmImage *image, size_t width, size_t height,
+                   uint16_t max_value, const void *source,
+                   size_t source_stride, void *destination,
+                   size_t destination_stride) {
+  ASSERT(image != NULL, "PPM image is NULL", wrap_ppm_image_error);
+  ASSERT(source != NULL && destination != NULL,
+         "Interleaved PPM buffers are NULL", wrap_ppm_image_error);
+  ASSERT(width > 0 && height > 0 && max_value > 0,
+         "Invalid interleaved PPM image dimensions", wrap_ppm_image_error);
+  size_t sample_size = (max_value > UINT8_MAX) ? 2 : 1;
+  size_t row_size = width * 3 * sample_size;
+  ASSERT(source_stride >= row_size && destination_stride >= row_size &&
+             source_stride % sample_size == 0 &&
+             destination_stride % sample_size == 0,
+         "Invalid interleaved PPM row stride", wrap_ppm_image_error);
+  // Never written through, as nothing flushes the image before it's dropped
+  *image = (PpmImage){.width = width,
+                      .height = height,
+                      .max_value = max_value,
+                      .color_values_write = NULL,
+                      .color_values_read = NULL,
+                      .planes_write = destination,
+                      .planes_read = (uint8_t *)source,
+                      .buffer_capacity = 0,
+                      .row_stride_read = source_stride,
+                      .row_stride_write = destination_stride,
+                      .storage = PPM_STORAGE_INTERLEAVED,
+                      .needs_flushing = 0};
+  return 1;
+wrap_ppm_image_error:
+  return 0;
+}
+
+int attach_luma_ppm_image(PpmImage *image, int thread_count) {
+  ASSERT(image != NULL, "PPM image is NULL", attach_luma_ppm_image_error);
+  ASSERT(image->storage != PPM_STORAGE_INTERLEAVED,
+         "Interleaved PPM images can't have a luma plane",
+         attach_luma_ppm_image_error);
+  ASSERT(!image->needs_flushing, "PPM image has an unflushed write buffer",
+         attach_luma_ppm_image_error);
+  if (image->luma_plane != NULL)
+    return 1;
+  size_t plane_size = image->width * image->height * sample_size_ppm(image);
+  image->luma_plane = alloc_arena(plane_size);
+  ASSERT(image->luma_plane != NULL, "Could not allocate the PPM luma plane",
+         attach_luma_ppm_image_error);
+  place_numa_buffer(image->luma_plane, plane_size, 1, (size_t)thread_count);
+  free_arena(image->color_values_write);
+  free_arena(image->planes_write);
+  image->color_values_write = NULL;
+  image->planes_write = NULL;
+  return 1;
+attach_luma_ppm_image_error:
+  return 0;
+}
+
 int write_at_idx_ppm_image(PpmImage *image, size_t idx, RgbTriplet rgb) {
   ASSERT(image != NULL, "PPM image is NULL", write_at_idx_ppm_image_error);
-  ASSERT(image->color_values_write != NULL, "PPM image write buffer is NULL",
+  ASSERT(write_buffer_ppm(image) != NULL, "PPM image write buffer is NULL",
          write_at_idx_ppm_image_error);
   ASSERT(idx < (image->width * image->height),
          "Error writing at out of bounds index from PPM image",
          write_at_idx_ppm_image_error);
-  image->color_values_write[idx] = rgb;
+  if (image->storage != PPM_STORAGE_TRIPLETS) {
+    // Quantised like `save_ppm_image` would, so saved images are unchanged
+    float max_value = (float)image->max_value;
+    float samples[3] = {rgb.r, rgb.g, rgb.b};
+    for (size_t channel = 0; channel < 3; channel++) {
+      float sample = samples[channel];
+      sample = (sample <= 0.0f) ? 0.0f : ((sample >= 1.0f) ? 1.0f : sample);
+      store_sample_ppm(image, image->planes_write, idx, channel,
+                       (uint16_t)roundf(sample * max_value));
+    }
+  } else {
+    image->color_values_write[idx] = rgb;
+  }
   image->needs_flushing = 1;
   return 1;
 write_at_idx_ppm_image_error:
@@ -77,17 +1217,49 @@ write_at_xy_ppm_image_error:
   return 0;
 }
 
+int write_luma_at_xy_ppm_image(PpmImage *image, size_t x, size_t y,
+                               float luma) {
+  ASSERT(image != NULL, "PPM image is NULL", write_luma_at_xy_ppm_image_error);
+  if (image->luma_plane == NULL)
+    return write_at_xy_ppm_image(image, x, y,
+                                 (RgbTriplet){.r = luma, .g = luma, .b = luma});
+  ASSERT(x < image->width && y < image->height,
+         "Error writing at out of bounds index from PPM image",
+         write_luma_at_xy_ppm_image_error);
+  // Quantised like `write_at_idx_ppm_image`
+  luma = (luma <= 0.0f) ? 0.0f : ((luma >= 1.0f) ? 1.0f : luma);
+  uint16_t sample = (uint16_t)roundf(luma * (float)image->max_value);
+  size_t idx = x + y * image->width;
+  if (image->max_value > UINT8_MAX)
+    ((uint16_t *)image->luma_plane)[idx] = sample;
+  else
+    image->luma_plane[idx] = (uint8_t)sample;
+  return 1;
+write_luma_at_xy_ppm_image_error:
+  return 0;
+}
+
 int flush_ppm_image(PpmImage *image) {
   ASSERT(image != NULL, "PPM image is NULL", flush_ppm_image_error);
-  ASSERT(image->color_values_read != NULL, "PPM image read buffer is NULL",
-         flush_ppm_image_error);
-  ASSERT(image->color_values_write != NULL, "PPM image write buffer is NULL",
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
          flush_ppm_image_error);
+  // Images with a luma plane have no write buffer, and nothing to flush
+  ASSERT(!image->needs_flushing || write_buffer_ppm(image) != NULL,
+         "PPM image write buffer is NULL", flush_ppm_image_error);
   if (image->needs_flushing) {
-    size_t image_size = image->width * image->height;
-    for (size_t idx = 0; idx < image_size; idx++)
-      image->color_values_read[idx] = image->color_values_write[idx];
+    uint64_t span = begin_trace_span();
+    // Swapping is enough as every pass rewrites each pixel before flushing
+    RgbTriplet *written = image->color_values_write;
+    image->color_values_write = image->color_values_read;
+    image->color_values_read = written;
+    uint8_t *written_planes = image->planes_write;
+    image->planes_write = image->planes_read;
+    image->planes_read = written_planes;
+    size_t written_stride = image->row_stride_write;
+    image->row_stride_write = image->row_stride_read;
+    image->row_stride_read = written_stride;
     image->needs_flushing = 0;
+    end_trace_span("flush", span, TRACE_NO_ARG);
   }
   return 1;
 flush_ppm_image_error:
@@ -96,13 +1268,22 @@ flush_ppm_image_error:
 
 int read_at_idx_ppm_image(PpmImage *image, size_t idx, RgbTriplet *rgb) {
   ASSERT(image != NULL, "PPM image is NULL", read_at_idx_ppm_image_error);
-  ASSERT(image->color_values_read != NULL, "PPM image read buffer is NULL",
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
          read_at_idx_ppm_image_error);
   ASSERT(rgb != NULL, "RgbTriplet is NULL", read_at_idx_ppm_image_error);
   ASSERT(idx < (image->width * image->height),
          "Error reading at out of bounds index from PPM image",
          read_at_idx_ppm_image_error);
-  *rgb = image->color_values_read[idx];
+  if (image->storage != PPM_STORAGE_TRIPLETS) {
+    float max_value = (float)image->max_value;
+    float red = (float)load_sample_ppm(image, idx, 0);
+    float green = (float)load_sample_ppm(image, idx, 1);
+    float blue = (float)load_sample_ppm(image, idx, 2);
+    *rgb = (RgbTriplet){
+        .r = red / max_value, .g = green / max_value, .b = blue / max_value};
+  } else {
+    *rgb = image->color_values_read[idx];
+  }
   return 1;
 read_at_idx_ppm_image_error:
   return 0;
@@ -115,44 +1296,598 @@ read_at_xy_ppm_image_error:
   return 0;
 }
 
-int save_ppm_image(PpmImage *image, FILE *output_file) {
-  ASSERT(image != NULL, "PPM image is NULL", save_ppm_image_error);
-  ASSERT(output_file != NULL, "Output file is NULL", save_ppm_image_error);
-  ASSERT(fprintf(output_file, "P3\n"), "Error writing PPM image header",
-         save_ppm_image_error);
-  ASSERT(fprintf(output_file, "%lu %lu\n", image->width, image->height),
-         "Error writing `width` and `height` integers", save_ppm_image_error);
-  ASSERT(fprintf(output_file, "%hu\n", image->max_value),
-         "Error writing `max_value` integer", save_ppm_image_error);
-  size_t image_size = image->width * image->height;
-  for (size_t idx = 0; idx < image_size; idx++) {
-    RgbTriplet rgb;
-    ASSERT(read_at_idx_ppm_image(image, idx, &rgb),
-           "Error reading at index from PPM image", save_ppm_image_error);
-    uint16_t red, green, blue;
-    red = (uint16_t)roundf(rgb.r * ((float)image->max_value));
-    green = (uint16_t)roundf(rgb.g * ((float)image->max_value));
-    blue = (uint16_t)roundf(rgb.b * ((float)image->max_value));
-    ASSERT(fprintf(output_file, "%hu %hu %hu\n", red, green, blue),
+// "00" to "99", so integers are formatted two digits at a time
+static const char digit_pairs[201] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+static inline uint8_t *format_ascii_sample(uint8_t *cursor, uint16_t value) {
+  uint8_t digits[5];
+  uint8_t *digit = digits + 5;
+  while (value >= 100) {
+    const char *pair = &digit_pairs[(value % 100) * 2];
+    value /= 100;
+    *--digit = (uint8_t)pair[1];
+    *--digit = (uint8_t)pair[0];
+  }
+  if (value >= 10) {
+    *--digit = (uint8_t)digit_pairs[value * 2 + 1];
+    *--digit = (uint8_t)digit_pairs[value * 2];
+  } else {
+    *--digit = (uint8_t)('0' + value);
+  }
+  while (digit < digits + 5)
+    *cursor++ = *digit++;
+  return cursor;
+}
+
+// Widest sample with its separator: "65535 " (or "65535\n")
+#define MAX_ASCII_SAMPLE 6
+// Output bytes each thread formats per round, before the bands are written
+#define ASCII_BAND_SIZE (4 << 20)
+
+// Rows formatted by one thread into its own reusable buffer, as P3 lines or,
+// with `channels` 1, as P2 ones
+typedef struct ascii_band {
+  PpmImage *image;
+  size_t channels;
+  size_t row_begin, row_end;
+  uint8_t *buffer;
+  size_t size;
+} AsciiBand;
+
+static void *format_ascii_band(void *void_ptr) {
+  AsciiBand *band = void_ptr;
+  PpmImage *image = band->image;
+  uint8_t *cursor = band->buffer;
+  size_t idx_end = band->row_end * image->width;
+  if (band->channels == 1) {
+    for (size_t idx = band->row_begin * image->width; idx < idx_end; idx++) {
+      cursor = format_ascii_sample(cursor, load_gray_sample_ppm(image, idx));
+      *cursor++ = '\n';
+    }
+    band->size = (size_t)(cursor - band->buffer);
+    return NULL;
+  }
+  for (size_t idx = band->row_begin * image->width; idx < idx_end; idx++) {
+    cursor = format_ascii_sample(cursor, load_sample_ppm(image, idx, 0));
+    *cursor++ = ' ';
+    cursor = format_ascii_sample(cursor, load_sample_ppm(image, idx, 1));
+    *cursor++ = ' ';
+    cursor = format_ascii_sample(cursor, load_sample_ppm(image, idx, 2));
+    *cursor++ = '\n';
+  }
+  band->size = (size_t)(cursor - band->buffer);
+  return NULL;
+}
+
+// Writes every vector in order, resuming after short and interrupted writes
+static int write_all_iovecs(int fd, struct iovec *iovecs, int count) {
+  int max_count = (int)sysconf(_SC_IOV_MAX);
+  if (max_count < 1)
+    max_count = 1;
+  while (count > 0) {
+    ssize_t written = writev(fd, iovecs, count > max_count ? max_count : count);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return 0;
+    while (count > 0 && (size_t)written >= iovecs->iov_len) {
+      written -= (ssize_t)iovecs->iov_len;
+      iovecs++;
+      count--;
+    }
+    if (count > 0) {
+      iovecs->iov_base = (uint8_t *)iovecs->iov_base + written;
+      iovecs->iov_len -= (size_t)written;
+    }
+  }
+  return 1;
+}
+
+// Formats the rows [row_begin, row_end) as P3 text, or P2 with `channels` 1,
+// behind whatever was already written to `output_file`
+static int write_ascii_ppm_rows(PpmImage *image, FILE *output_file,
+                                size_t channels, size_t row_begin,
+                                size_t row_end, int thread_count) {
+  int result = 0;
+  AsciiBand *bands = NULL;
+  struct iovec *iovecs = NULL;
+  if (thread_count < 1)
+    thread_count = 1;
+  ASSERT(fflush(output_file) == 0, "Error flushing the output file",
+         write_ascii_ppm_rows_exit);
+  size_t row_size = image->width * channels * MAX_ASCII_SAMPLE;
+  size_t rows_per_band = (row_size > 0) ? ASCII_BAND_SIZE / row_size : 1;
+  if (rows_per_band > row_end - row_begin)
+    rows_per_band = row_end - row_begin;
+  if (rows_per_band == 0)
+    rows_per_band = 1;
+  // No thread gets a buffer for a band it will never format
+  size_t band_total = (row_end - row_begin + rows_per_band - 1) / rows_per_band;
+  if ((size_t)thread_count > band_total && band_total > 0)
+    thread_count = (int)band_total;
+  bands = calloc(thread_count, sizeof(AsciiBand));
+  iovecs = malloc(thread_count * sizeof(struct iovec));
+  ASSERT(bands != NULL && iovecs != NULL, "Could not allocate the P3 bands",
+         write_ascii_ppm_rows_exit);
+  for (int idx = 0; idx < thread_count; idx++) {
+    bands[idx].image = image;
+    bands[idx].channels = channels;
+    bands[idx].buffer = alloc_arena(rows_per_band * row_size + 1);
+    ASSERT(bands[idx].buffer != NULL, "Could not allocate a P3 band buffer",
+           write_ascii_ppm_rows_exit);
+  }
+  // Every round formats up to `thread_count` consecutive bands in parallel
+  // and then writes them in order with a single gathered write
+  int fd = fileno(output_file);
+  for (size_t y = row_begin; y < row_end;) {
+    int band_count = 0;
+    for (; band_count < thread_count && y < row_end; band_count++) {
+      size_t band_end = y + rows_per_band;
+      if (band_end > row_end)
+        band_end = row_end;
+      bands[band_count].row_begin = y;
+      bands[band_count].row_end = band_end;
+      y = band_end;
+    }
+    run_ppm_workers("format P3", format_ascii_band, bands, sizeof(AsciiBand),
+                    band_count);
+    for (int idx = 0; idx < band_count; idx++)
+      iovecs[idx] = (struct iovec){.iov_base = bands[idx].buffer,
+                                   .iov_len = bands[idx].size};
+    uint64_t span = begin_trace_span();
+    ASSERT(write_all_iovecs(fd, iovecs, band_count),
            "Error writing `red`, `green` and `blue` integers",
-           save_ppm_image_error);
+           write_ascii_ppm_rows_exit);
+    end_trace_span("write P3", span, (int64_t)y);
+  }
+  // Keeps the stream position in sync with what went through the descriptor
+  fseek(output_file, 0, SEEK_CUR);
+  result = 1;
+write_ascii_ppm_rows_exit:
+  if (bands != NULL)
+    for (int idx = 0; idx < thread_count; idx++)
+      free_arena(bands[idx].buffer);
+  free(bands);
+  free(iovecs);
+  return result;
+}
+
+// Rows encoded by one thread into its own reusable buffer, as chunks that
+// only depend on each other: the first pixel is always a `QOI_OP_RGB` and
+// only the index entries set by the band itself are used, so a decoder can
+// start at any band, and the bands still make up a valid QOI stream
+typedef struct qoi_band {
+  PpmImage *image;
+  size_t row_begin, row_end;
+  uint8_t *buffer;
+  size_t size;
+} QoiBand;
+
+// Pixel of the read buffer, rescaled to 8 bits
+static inline void load_qoi_pixel(PpmImage *image, size_t idx,
+                                  uint8_t *pixel) {
+  uint32_t max_value = image->max_value;
+  for (size_t channel = 0; channel < 3; channel++) {
+    uint32_t sample = load_sample_ppm(image, idx, channel);
+    if (max_value != UINT8_MAX)
+      sample = (sample * UINT8_MAX + max_value / 2) / max_value;
+    pixel[channel] = (uint8_t)sample;
+  }
+  pixel[3] = UINT8_MAX;
+}
+
+static void *encode_qoi_band(void *void_ptr) {
+  QoiBand *band = void_ptr;
+  PpmImage *image = band->image;
+  uint8_t *cursor = band->buffer;
+  uint8_t index[64][4], is_indexed[64] = {0};
+  uint8_t pixel[4], previous[4] = {0, 0, 0, UINT8_MAX};
+  size_t run_length = 0;
+  size_t idx_begin = band->row_begin * image->width;
+  size_t idx_end = band->row_end * image->width;
+  for (size_t idx = idx_begin; idx < idx_end; idx++) {
+    load_qoi_pixel(image, idx, pixel);
+    if (idx > idx_begin && memcmp(pixel, previous, 4) == 0) {
+      // Runs never outlive the band
+      if (++run_length == QOI_MAX_RUN || idx + 1 == idx_end) {
+        *cursor++ = (uint8_t)(QOI_OP_RUN | (run_length - 1));
+        run_length = 0;
+      }
+      continue;
+    }
+    if (run_length > 0) {
+      *cursor++ = (uint8_t)(QOI_OP_RUN | (run_length - 1));
+      run_length = 0;
+    }
+    size_t hash = hash_qoi_pixel(pixel);
+    if (is_indexed[hash] && memcmp(index[hash], pixel, 4) == 0) {
+      *cursor++ = (uint8_t)(QOI_OP_INDEX | hash);
+      memcpy(previous, pixel, 4);
+      continue;
+    }
+    memcpy(index[hash], pixel, 4);
+    is_indexed[hash] = 1;
+    int8_t red_diff = (int8_t)(pixel[0] - previous[0]);
+    int8_t green_diff = (int8_t)(pixel[1] - previous[1]);
+    int8_t blue_diff = (int8_t)(pixel[2] - previous[2]);
+    int red_green = red_diff - green_diff, blue_green = blue_diff - green_diff;
+    if (idx == idx_begin) {
+      *cursor++ = QOI_OP_RGB;
+      memcpy(cursor, pixel, 3);
+      cursor += 3;
+    } else if (red_diff >= -2 && red_diff <= 1 && green_diff >= -2 &&
+               green_diff <= 1 && blue_diff >= -2 && blue_diff <= 1) {
+      *cursor++ = (uint8_t)(QOI_OP_DIFF | (red_diff + 2) << 4 |
+                            (green_diff + 2) << 2 | (blue_diff + 2));
+    } else if (green_diff >= -32 && green_diff <= 31 && red_green >= -8 &&
+               red_green <= 7 && blue_green >= -8 && blue_green <= 7) {
+      *cursor++ = (uint8_t)(QOI_OP_LUMA | (green_diff + 32));
+      *cursor++ = (uint8_t)((red_green + 8) << 4 | (blue_green + 8));
+    } else {
+      *cursor++ = QOI_OP_RGB;
+      memcpy(cursor, pixel, 3);
+      cursor += 3;
+    }
+    memcpy(previous, pixel, 4);
+  }
+  band->size = (size_t)(cursor - band->buffer);
+  return NULL;
+}
+
+// Bands of at most QOI_BAND_ROWS rows that `row_count` rows are split into
+static inline size_t qoi_band_count(size_t row_count) {
+  return (row_count + QOI_BAND_ROWS - 1) / QOI_BAND_ROWS;
+}
+
+// Encodes the rows [row_begin, row_end) as QOI chunks behind whatever was
+// already written to `output_file`, storing the big-endian offset of every
+// band from the first one in `band_offsets` when it isn't NULL
+static int write_qoi_rows(PpmImage *image, FILE *output_file,
+                          size_t row_begin, size_t row_end, int thread_count,
+                          uint8_t *band_offsets) {
+  int result = 0;
+  QoiBand *bands = NULL;
+  struct iovec *iovecs = NULL;
+  if (thread_count < 1)
+    thread_count = 1;
+  ASSERT(fflush(output_file) == 0, "Error flushing the output file",
+         write_qoi_rows_exit);
+  bands = calloc(thread_count, sizeof(QoiBand));
+  iovecs = malloc(thread_count * sizeof(struct iovec));
+  ASSERT(bands != NULL && iovecs != NULL, "Could not allocate the QOI bands",
+         write_qoi_rows_exit);
+  // No chunk is larger than the 4 bytes of a `QOI_OP_RGB` pixel
+  for (int idx = 0; idx < thread_count; idx++) {
+    bands[idx].image = image;
+    bands[idx].buffer = alloc_arena(QOI_BAND_ROWS * image->width * 4 + 1);
+    ASSERT(bands[idx].buffer != NULL, "Could not allocate a QOI band buffer",
+           write_qoi_rows_exit);
+  }
+  // Every round encodes up to `thread_count` consecutive bands in parallel
+  // and then writes them in order with a single gathered write
+  int fd = fileno(output_file);
+  size_t row_count = row_end - row_begin;
+  size_t band_count = qoi_band_count(row_count), offset = 0;
+  for (size_t band = 0; band < band_count;) {
+    int round_count = 0;
+    for (; round_count < thread_count && band < band_count;
+         round_count++, band++) {
+      bands[round_count].row_begin = row_begin + row_count * band / band_count;
+      bands[round_count].row_end =
+          row_begin + row_count * (band + 1) / band_count;
+    }
+    run_ppm_workers("encode QOI", encode_qoi_band, bands, sizeof(QoiBand),
+                    round_count);
+    for (int idx = 0; idx < round_count; idx++) {
+      if (band_offsets != NULL)
+        store_be64(band_offsets + 8 * (band - round_count + idx), offset);
+      offset += bands[idx].size;
+      iovecs[idx] = (struct iovec){.iov_base = bands[idx].buffer,
+                                   .iov_len = bands[idx].size};
+    }
+    uint64_t span = begin_trace_span();
+    ASSERT(write_all_iovecs(fd, iovecs, round_count),
+           "Error writing the QOI chunks", write_qoi_rows_exit);
+    end_trace_span("write QOI", span, (int64_t)band);
+  }
+  // Keeps the stream position in sync with what went through the descriptor
+  fseek(output_file, 0, SEEK_CUR);
+  result = 1;
+write_qoi_rows_exit:
+  if (bands != NULL)
+    for (int idx = 0; idx < thread_count; idx++)
+      free_arena(bands[idx].buffer);
+  free(bands);
+  free(iovecs);
+  return result;
+}
+
+// Magic number of the PPM and PGM formats
+static inline const char *magic_ppm_format(PpmFormat format) {
+  if (format == PPM_FORMAT_BINARY)
+    return "P6";
+  if (format == PPM_FORMAT_PGM_ASCII)
+    return "P2";
+  if (format == PPM_FORMAT_PGM_BINARY)
+    return "P5";
+  return "P3";
+}
+
+static inline size_t channels_ppm_format(PpmFormat format) {
+  return (format == PPM_FORMAT_PGM_ASCII || format == PPM_FORMAT_PGM_BINARY)
+             ? 1
+             : 3;
+}
+
+const char *extension_ppm_format(PpmFormat format) {
+  if (format == PPM_FORMAT_QOI)
+    return "qoi";
+  return (channels_ppm_format(format) == 1) ? "pgm" : "ppm";
+}
+
+int write_ppm_header(FILE *output_file, PpmFormat format, size_t width,
+                     size_t height, uint16_t max_value) {
+  ASSERT(output_file != NULL, "Output file is NULL", write_ppm_header_error);
+  if (format == PPM_FORMAT_QOI) {
+    ASSERT(width <= UINT32_MAX && height <= UINT32_MAX,
+           "Image is too large for a QOI header", write_ppm_header_error);
+    uint8_t header[QOI_HEADER_SIZE] = {'q', 'o', 'i', 'f'};
+    store_be32(header + 4, (uint32_t)width);
+    store_be32(header + 8, (uint32_t)height);
+    // 3 channels, sRGB with linear alpha
+    header[12] = 3;
+    header[13] = 0;
+    ASSERT(fwrite(header, 1, QOI_HEADER_SIZE, output_file) == QOI_HEADER_SIZE,
+           "Error writing QOI image header", write_ppm_header_error);
+    return 1;
+  }
+  ASSERT(fprintf(output_file, "%s\n", magic_ppm_format(format)),
+         "Error writing PPM image header", write_ppm_header_error);
+  ASSERT(fprintf(output_file, "%lu %lu\n", width, height),
+         "Error writing `width` and `height` integers", write_ppm_header_error);
+  ASSERT(fprintf(output_file, "%hu\n", max_value),
+         "Error writing `max_value` integer", write_ppm_header_error);
+  return 1;
+write_ppm_header_error:
+  return 0;
+}
+
+// Saves `image` as P3, or as P2 with the `PPM_FORMAT_PGM_ASCII` `format`
+static int save_ascii_image(PpmImage *image, FILE *output_file,
+                            PpmFormat format, int thread_count) {
+  ASSERT(image != NULL, "PPM image is NULL", save_ascii_image_error);
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
+         save_ascii_image_error);
+  ASSERT(write_ppm_header(output_file, format, image->width, image->height,
+                          image->max_value),
+         "Error writing PPM image header", save_ascii_image_error);
+  return write_ascii_ppm_rows(image, output_file, channels_ppm_format(format),
+                              0, image->height, thread_count);
+save_ascii_image_error:
+  return 0;
+}
+
+int save_ppm_image(PpmImage *image, FILE *output_file, int thread_count) {
+  return save_ascii_image(image, output_file, PPM_FORMAT_ASCII, thread_count);
+}
+
+int save_pgm_image(PpmImage *image, FILE *output_file, int thread_count) {
+  return save_ascii_image(image, output_file, PPM_FORMAT_PGM_ASCII,
+                          thread_count);
+}
+
+// Fills `body` with the P6 samples of the rows [row_begin, row_end), or the
+// P5 ones with `channels` 1
+static void encode_binary_ppm_rows(PpmImage *image, uint8_t *body,
+                                   size_t channels, size_t row_begin,
+                                   size_t row_end) {
+  uint64_t span = begin_trace_span();
+  size_t sample_size = sample_size_ppm(image);
+  size_t idx_end = row_end * image->width;
+  uint8_t *cursor = body;
+  for (size_t idx = row_begin * image->width; idx < idx_end; idx++) {
+    for (size_t channel = 0; channel < channels; channel++) {
+      uint16_t sample = (channels == 1) ? load_gray_sample_ppm(image, idx)
+                                        : load_sample_ppm(image, idx, channel);
+      if (sample_size == 2)
+        *cursor++ = (uint8_t)(sample >> 8);
+      *cursor++ = (uint8_t)sample;
+    }
   }
+  end_trace_span((channels == 1) ? "encode P5" : "encode P6", span,
+                 (int64_t)row_begin);
+}
+
+#define BINARY_ROWS_PER_WRITE 64
+
+// Writes the rows [row_begin, row_end) as P6 bytes, or P5 ones with
+// `channels` 1, with buffered writes
+static int write_binary_ppm_rows(PpmImage *image, FILE *output_file,
+                                 size_t channels, size_t row_begin,
+                                 size_t row_end) {
+  int result = 0;
+  size_t row_size = image->width * channels * sample_size_ppm(image);
+  uint8_t *rows = malloc(row_size * BINARY_ROWS_PER_WRITE);
+  ASSERT(rows != NULL, "Could not allocate the binary PPM rows",
+         write_binary_ppm_rows_exit);
+  for (size_t y = row_begin; y < row_end; y += BINARY_ROWS_PER_WRITE) {
+    size_t band_end = y + BINARY_ROWS_PER_WRITE;
+    if (band_end > row_end)
+      band_end = row_end;
+    encode_binary_ppm_rows(image, rows, channels, y, band_end);
+    size_t rows_size = row_size * (band_end - y);
+    ASSERT(fwrite(rows, 1, rows_size, output_file) == rows_size,
+           "Error writing the binary PPM body", write_binary_ppm_rows_exit);
+  }
+  result = 1;
+write_binary_ppm_rows_exit:
+  free(rows);
+  return result;
+}
+
+// Saves `image` as P6, or as P5 with the `PPM_FORMAT_PGM_BINARY` `format`
+static int save_binary_image(PpmImage *image, FILE *output_file,
+                             PpmFormat format) {
+  uint8_t *mapping = NULL;
+  size_t mapping_size = 0;
+  ASSERT(image != NULL, "PPM image is NULL", save_binary_image_error);
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
+         save_binary_image_error);
+  ASSERT(output_file != NULL, "Output file is NULL", save_binary_image_error);
+  char header[MAX_LINE];
+  int header_size = snprintf(header, MAX_LINE, "%s\n%lu %lu\n%hu\n",
+                             magic_ppm_format(format), image->width,
+                             image->height, image->max_value);
+  ASSERT(header_size > 0 && header_size < MAX_LINE,
+         "Error formatting PPM image header", save_binary_image_error);
+  size_t channels = channels_ppm_format(format);
+  size_t sample_size = sample_size_ppm(image);
+  size_t row_size = image->width * channels * sample_size;
+  size_t body_size = row_size * image->height;
+  ASSERT(fflush(output_file) == 0, "Error flushing the output file",
+         save_binary_image_error);
+  int fd = fileno(output_file);
+  struct stat output_stat;
+  long output_offset = ftell(output_file);
+  if (fd >= 0 && output_offset == 0 && fstat(fd, &output_stat) == 0 &&
+      S_ISREG(output_stat.st_mode)) {
+    // Preallocates the whole file and encodes straight into the page cache
+    mapping_size = (size_t)header_size + body_size;
+    ASSERT(ftruncate(fd, (off_t)mapping_size) == 0,
+           "Error preallocating the output file", save_binary_image_error);
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+  }
+  if (mapping != NULL && mapping != MAP_FAILED) {
+    memcpy(mapping, header, (size_t)header_size);
+    encode_binary_ppm_rows(image, mapping + header_size, channels, 0,
+                           image->height);
+    ASSERT(munmap(mapping, mapping_size) == 0,
+           "Error unmapping the output file", save_binary_image_error);
+    mapping = NULL;
+    ASSERT(fseek(output_file, (long)mapping_size, SEEK_SET) == 0,
+           "Error seeking past the binary PPM body",
+           save_binary_image_error);
+    return 1;
+  }
+  // Non-seekable or write-only outputs (e.g. pipes or /dev/null) get bulk
+  // writes instead
+  mapping = NULL;
+  ASSERT(fwrite(header, 1, (size_t)header_size, output_file) ==
+             (size_t)header_size,
+         "Error writing PPM image header", save_binary_image_error);
+  return write_binary_ppm_rows(image, output_file, channels, 0,
+                               image->height);
+save_binary_image_error:
+  if (mapping != NULL && mapping != MAP_FAILED)
+    munmap(mapping, mapping_size);
+  return 0;
+}
+
+int save_binary_ppm_image(PpmImage *image, FILE *output_file) {
+  return save_binary_image(image, output_file, PPM_FORMAT_BINARY);
+}
+
+int save_binary_pgm_image(PpmImage *image, FILE *output_file) {
+  return save_binary_image(image, output_file, PPM_FORMAT_PGM_BINARY);
+}
+
+int save_qoi_image(PpmImage *image, FILE *output_file, int thread_count) {
+  int result = 0;
+  uint8_t *table = NULL;
+  ASSERT(image != NULL, "PPM image is NULL", save_qoi_image_exit);
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
+         save_qoi_image_exit);
+  ASSERT(write_ppm_header(output_file, PPM_FORMAT_QOI, image->width,
+                          image->height, image->max_value),
+         "Error writing QOI image header", save_qoi_image_exit);
+  size_t band_count = qoi_band_count(image->height);
+  size_t table_size = 4 + 8 * band_count + 4 + sizeof(qoi_band_magic);
+  table = malloc(table_size);
+  ASSERT(table != NULL, "Could not allocate the QOI band table",
+         save_qoi_image_exit);
+  ASSERT(write_qoi_rows(image, output_file, 0, image->height, thread_count,
+                        table + 4),
+         "Error writing the QOI chunks", save_qoi_image_exit);
+  store_be32(table, (uint32_t)band_count);
+  store_be32(table + 4 + 8 * band_count, (uint32_t)band_count);
+  memcpy(table + 8 + 8 * band_count, qoi_band_magic, sizeof(qoi_band_magic));
+  ASSERT(write_ppm_trailer(output_file, PPM_FORMAT_QOI),
+         "Error writing the QOI end marker", save_qoi_image_exit);
+  ASSERT(fwrite(table, 1, table_size, output_file) == table_size,
+         "Error writing the QOI band table", save_qoi_image_exit);
+  result = 1;
+save_qoi_image_exit:
+  free(table);
+  return result;
+}
+
+int save_formatted_ppm_image(PpmImage *image, FILE *output_file,
+                             PpmFormat format, int thread_count) {
+  // The read buffer still holds the unfiltered colors
+  ASSERT(image == NULL || image->luma_plane == NULL ||
+             channels_ppm_format(format) == 1,
+         "Only grayscale formats can be saved from the luma plane",
+         save_formatted_ppm_image_error);
+  if (format == PPM_FORMAT_PGM_ASCII)
+    return save_pgm_image(image, output_file, thread_count);
+  if (format == PPM_FORMAT_PGM_BINARY)
+    return save_binary_pgm_image(image, output_file);
+  if (format == PPM_FORMAT_QOI)
+    return save_qoi_image(image, output_file, thread_count);
+  if (format == PPM_FORMAT_BINARY)
+    return save_binary_ppm_image(image, output_file);
+  return save_ppm_image(image, output_file, thread_count);
+save_formatted_ppm_image_error:
+  return 0;
+}
+
+int write_rows_ppm_image(PpmImage *image, FILE *output_file, PpmFormat format,
+                         size_t row_begin, size_t row_end, int thread_count) {
+  ASSERT(image != NULL, "PPM image is NULL", write_rows_ppm_image_error);
+  ASSERT(read_buffer_ppm(image) != NULL, "PPM image read buffer is NULL",
+         write_rows_ppm_image_error);
+  ASSERT(output_file != NULL, "Output file is NULL",
+         write_rows_ppm_image_error);
+  ASSERT(row_begin <= row_end && row_end <= image->height,
+         "PPM rows are out of bounds", write_rows_ppm_image_error);
+  if (format == PPM_FORMAT_QOI)
+    return write_qoi_rows(image, output_file, row_begin, row_end, thread_count,
+                          NULL);
+  size_t channels = channels_ppm_format(format);
+  return (format == PPM_FORMAT_BINARY || format == PPM_FORMAT_PGM_BINARY)
+             ? write_binary_ppm_rows(image, output_file, channels, row_begin,
+                                     row_end)
+             : write_ascii_ppm_rows(image, output_file, channels, row_begin,
+                                    row_end, thread_count);
+write_rows_ppm_image_error:
+  return 0;
+}
+
+int write_ppm_trailer(FILE *output_file, PpmFormat format) {
+  ASSERT(output_file != NULL, "Output file is NULL", write_ppm_trailer_error);
+  if (format == PPM_FORMAT_QOI)
+    ASSERT(fwrite(qoi_end_marker, 1, sizeof(qoi_end_marker), output_file) ==
+               sizeof(qoi_end_marker),
+           "Error writing the QOI end marker", write_ppm_trailer_error);
   return 1;
-save_ppm_image_error:
+write_ppm_trailer_error:
   return 0;
 }
 
 void free_ppm_image(PpmImage **image) {
   if (image == NULL || *image == NULL)
     return;
-  if ((*image)->color_values_write) {
-    free((*image)->color_values_write);
-    (*image)->color_values_write = NULL;
-  }
-  if ((*image)->color_values_read) {
-    free((*image)->color_values_read);
-    (*image)->color_values_read = NULL;
-  }
+  free_ppm_buffers(*image);
   free(*image);
   *image = NULL;
 }
@@ -9,6 +9,41 @@
 #include <stdint.h>
 #include <stdio.h>
 
+typedef enum ppm_format {
+  // Plain `P3` text
+  PPM_FORMAT_ASCII,
+  // Raw `P6` bytes (big-endian pairs when `max_value` > 255)
+  PPM_FORMAT_BINARY,
+  // Quite OK Image Format, whose samples always have 8 bits (other
+  // `max_value`s are rescaled), encoded in bands of rows that don't depend on
+  // each other so they can be encoded and decoded in parallel
+  PPM_FORMAT_QOI,
+  // Plain `P2` and raw `P5` grayscale, one sample per pixel: the luma plane
+  // (see `attach_luma_ppm_image`) or else the red channel, which the filter
+  // leaves equal to the other two
+  PPM_FORMAT_PGM_ASCII,
+  PPM_FORMAT_PGM_BINARY,
+} PpmFormat;
+
+typedef enum ppm_storage {
+  // Interleaved `RgbTriplet`s of normalised floats (24 bytes per pixel)
+  PPM_STORAGE_TRIPLETS,
+  // Red, green and blue planes of raw 8-bit samples, or 16-bit ones when
+  // `max_value` > 255 (6 or 12 bytes per pixel), only reachable through the
+  // accessors below
+  PPM_STORAGE_PLANAR,
+  // Caller-owned rows of interleaved 8-bit samples, or native-endian 16-bit
+  // ones when `max_value` > 255, set up by `wrap_ppm_image` and never copied
+  // nor freed by the image
+  PPM_STORAGE_INTERLEAVED,
+} PpmStorage;
+
+// One of the two buffers of an image, for the region functions below
+typedef enum ppm_buffer {
+  PPM_BUFFER_READ,
+  PPM_BUFFER_WRITE,
+} PpmBuffer;
+
 typedef struct rgb_triplet {
   float r, g, b;
 } RgbTriplet;
@@ -18,16 +53,135 @@ typedef struct ppm_image {
   uint16_t max_value;
   RgbTriplet *color_values_write;
   RgbTriplet *color_values_read;
+  uint8_t *planes_write;
+  uint8_t *planes_read;
+  // Bytes allocated for each of the two buffers, which may exceed the ones
+  // in use after `reread_ppm_image`
+  size_t buffer_capacity;
+  // Bytes from a row to the next in the interleaved `planes_read` and
+  // `planes_write`, which may be padded
+  size_t row_stride_read, row_stride_write;
+  PpmStorage storage;
   uint8_t needs_flushing;
+  // Row-major samples (as wide as in `planes_read`) that the filter stores
+  // the luma of every pixel into, in place of the write buffer, when set
+  uint8_t *luma_plane;
 } PpmImage;
 
-PpmImage *read_ppm_image(FILE *source_file);
+// State carried by a QOI decoder from a pixel to the next
+typedef struct qoi_decoder {
+  uint8_t pixel[4];
+  uint8_t index[64][4];
+  // Pixels still to repeat from the last run
+  size_t run_length;
+} QoiDecoder;
+
+// Incremental reader for images too large to be loaded whole
+typedef struct ppm_stream {
+  FILE *source_file;
+  size_t width, height;
+  uint16_t max_value;
+  // 3 for `P3`, `P6` and QOI, 1 for `P2` and `P5`
+  size_t channels;
+  uint8_t is_ascii;
+  uint8_t is_qoi;
+  QoiDecoder qoi;
+  // First row of the body that wasn't read yet
+  size_t next_row;
+} PpmStream;
+
+PpmImage *read_ppm_image(FILE *source_file, int thread_count,
+                         PpmStorage storage);
+// Same as `read_ppm_image`, but reuses `recycled` (if not NULL) and keeps its
+// buffers when they are large enough; `recycled` is freed on failure
+PpmImage *reread_ppm_image(FILE *source_file, int thread_count,
+                           PpmStorage storage, PpmImage *recycled);
+// Same as `read_ppm_image`, but both buffers are shared memory (see
+// `alloc_shared_arena`), written in place by processes forked afterwards
+PpmImage *read_shared_ppm_image(FILE *source_file, int thread_count,
+                                PpmStorage storage);
+// Same as `reread_ppm_image`, but leaves `source_file` right after the body,
+// for inputs holding several concatenated images
+PpmImage *read_ppm_frame(FILE *source_file, int thread_count,
+                         PpmStorage storage, PpmImage *recycled);
+// Skips the whitespace before the next frame; returns 0 at the end of input
+int has_ppm_frame(FILE *source_file);
+// Reads the header of `source_file`, which is left at the first row
+int open_ppm_stream(PpmStream *stream, FILE *source_file);
+// Image holding up to `row_capacity` consecutive rows of `stream`; its
+// `height` is the number of rows currently held, starting empty
+PpmImage *alloc_ppm_window(PpmStream *stream, size_t row_capacity,
+                           PpmStorage storage);
+// Drops the first `dropped_rows` rows of `window` and appends the next
+// `read_rows` rows of `stream` to it. Anything in the write buffer is lost.
+int slide_ppm_window(PpmStream *stream, PpmImage *window, size_t dropped_rows,
+                     size_t read_rows);
+// Fills `image` to read the interleaved samples of `source` and write those of
+// `destination` (which may be the same memory); it must not be freed with
+// `free_ppm_image`. Row strides must hold whole samples.
+int wrap_ppm_image(PpmImage *image, size_t width, size_t height,
+                   uint16_t max_value, const void *source,
+                   size_t source_stride, void *destination,
+                   size_t destination_stride);
+// Bytes needed by each of the two buffers of `image`, as allocated by
+// `read_ppm_image` (interleaved images report them without row padding)
+size_t buffer_size_ppm_image(PpmImage *image);
+// Shrinks the rectangle [x_begin, x_end) x [y_begin, y_end) to the bounding
+// box of the pixels of `buffer` that differ from `snapshot`, a buffer laid out
+// like the ones of `image` (see `buffer_size_ppm_image`); returns 0 when every
+// pixel matches, and 1 with the rectangle untouched when it can't be compared,
+// as with interleaved images
+int changed_region_ppm_image(PpmImage *image, PpmBuffer buffer,
+                             const void *snapshot, size_t *x_begin,
+                             size_t *x_end, size_t *y_begin, size_t *y_end);
+// Copies that rectangle from `buffer` into `snapshot`, or from `snapshot` back
+// into `buffer` when `is_restoring`; restoring into the write buffer marks the
+// image as needing a flush
+int copy_region_ppm_image(PpmImage *image, PpmBuffer buffer, void *snapshot,
+                          int is_restoring, size_t x_begin, size_t x_end,
+                          size_t y_begin, size_t y_end);
+// Prints how much of both buffers is away from the NUMA node of the rank
+// that filters it, see `report_numa_buffer`
+void report_numa_ppm_image(PpmImage *image, int thread_count);
+// Replaces the write buffer of `image` (which is freed) with a luma plane of
+// one raw sample per pixel instead of three, so the filter leaves the read
+// buffer untouched and needs no flush. Only the grayscale formats can be
+// saved afterwards.
+int attach_luma_ppm_image(PpmImage *image, int thread_count);
 int write_at_idx_ppm_image(PpmImage *image, size_t idx, RgbTriplet rgb);
 int write_at_xy_ppm_image(PpmImage *image, size_t x, size_t y, RgbTriplet rgb);
+// Stores the grayscale result of a pixel into the luma plane, or else as a
+// gray triplet of the write buffer
+int write_luma_at_xy_ppm_image(PpmImage *image, size_t x, size_t y,
+                               float luma);
 int read_at_idx_ppm_image(PpmImage *image, size_t idx, RgbTriplet *rgb);
 int read_at_xy_ppm_image(PpmImage *image, size_t x, size_t y, RgbTriplet *rgb);
+// Publishes the write buffer by swapping it with the read buffer, so the
+// pixels of the new write buffer are stale until they are written again
 int flush_ppm_image(PpmImage *image);
-int save_ppm_image(PpmImage *image, FILE *output_file);
+int save_ppm_image(PpmImage *image, FILE *output_file, int thread_count);
+int save_binary_ppm_image(PpmImage *image, FILE *output_file);
+int save_pgm_image(PpmImage *image, FILE *output_file, int thread_count);
+int save_binary_pgm_image(PpmImage *image, FILE *output_file);
+// Encodes QOI bands on `thread_count` threads, and appends a table of where
+// every band starts after the end marker (which plain QOI decoders ignore),
+// so `read_ppm_image` can decode them on as many threads
+int save_qoi_image(PpmImage *image, FILE *output_file, int thread_count);
+// Calls the saving function of `format`
+int save_formatted_ppm_image(PpmImage *image, FILE *output_file,
+                             PpmFormat format, int thread_count);
+// File extension of `format`, without the dot (`ppm`, `pgm` or `qoi`)
+const char *extension_ppm_format(PpmFormat format);
+int write_ppm_header(FILE *output_file, PpmFormat format, size_t width,
+                     size_t height, uint16_t max_value);
+// Appends the rows [row_begin, row_end) of the read buffer, without a
+// header, so an image can be saved in pieces after `write_ppm_header` and
+// before `write_ppm_trailer`
+int write_rows_ppm_image(PpmImage *image, FILE *output_file, PpmFormat format,
+                         size_t row_begin, size_t row_end, int thread_count);
+// Ends an image saved in pieces; only QOI has something to write (its end
+// marker, without the band table of `save_qoi_image`)
+int write_ppm_trailer(FILE *output_file, PpmFormat format);
 void free_ppm_image(PpmImage **image);
 
 #endif // PPM_HEADER
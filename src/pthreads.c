@@ -3,32 +3,22 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "filter.h"
+#include "arena.h"
 #include "ppm.h"
-#include <bits/pthreadtypes.h>
-#include <pthread.h>
+#include "sharpen.h"
+#include "simd.h"
+#include "summed_area.h"
+#include "thread_pool.h"
+#include "tiling.h"
+#include "trace.h"
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
-int grayscale(PpmImage *image, int rank, size_t step,
-              pthread_barrier_t *flush_barrier) {
-  if (image == NULL)
-    return 0;
-  size_t image_size = image->width * image->height;
-  for (size_t idx = (size_t)rank; idx < image_size; idx += step) {
-    RgbTriplet rgb;
-    if (!read_at_idx_ppm_image(image, idx, &rgb))
-      return 0;
-    float y = 0.299f * rgb.r + 0.587f * rgb.g + 0.114f * rgb.b;
-    RgbTriplet grayscale_rgb = (RgbTriplet){.r = y, .g = y, .b = y};
-    if (!write_at_idx_ppm_image(image, idx, grayscale_rgb))
-      return 0;
-  }
-  pthread_barrier_wait(flush_barrier);
-  if (rank == 0 && !flush_ppm_image(image))
-    return 0;
-  pthread_barrier_wait(flush_barrier);
-  return 1;
-}
+// Set to anything to print the per-thread work and steal counts
+#define SCHEDULER_STATS_VARIABLE "PP_EP2_SCHEDULER_STATS"
 
 size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   if (image == NULL)
@@ -43,7 +33,8 @@ size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   return (((size_t)(sum * 255)) % m) + 1;
 }
 
-int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
+int blur_at(PpmImage *image, SummedAreaTable *table, size_t m, size_t x,
+            size_t y, RgbTriplet *rgb) {
   if (image == NULL)
     return 0;
   if (x > image->width || y > image->height)
@@ -51,142 +42,324 @@ int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
   size_t radius = r_pixel(image, m, x, y);
   if (radius == 0)
     return 0;
-  float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
-  for (size_t i = 0; i <= 2 * radius; i++) {
-    for (size_t j = 0; j <= 2 * radius; j++) {
-      size_t neighbour_x = x + i;
-      if (neighbour_x < radius)
-        neighbour_x = 0;
-      else
-        neighbour_x -= radius;
-      size_t neighbour_y = y + j;
-      if (neighbour_y < radius)
-        neighbour_y = 0;
-      else
-        neighbour_y -= radius;
-      if (neighbour_x >= image->width)
-        neighbour_x = image->width - 1;
-      if (neighbour_y >= image->height)
-        neighbour_y = image->height - 1;
-      size_t neighbour_idx = neighbour_x + neighbour_y * image->width;
-      RgbTriplet neighbour_rgb;
-      if (!read_at_idx_ppm_image(image, neighbour_idx, &neighbour_rgb))
-        return 0;
-      sum_r += neighbour_rgb.r;
-      sum_g += neighbour_rgb.g;
-      sum_b += neighbour_rgb.b;
-    }
-  }
+  if (table != NULL)
+    return blur_at_summed_area_table(table, x, y, radius, rgb);
+  float sums[3];
+  if (!sum_window_simd(image, x, y, radius, sums))
+    return 0;
   float n = (float)((1 + radius * 2) * (1 + radius * 2));
-  *rgb = (RgbTriplet){.r = sum_r / n, .g = sum_g / n, .b = sum_b / n};
+  *rgb = (RgbTriplet){.r = sums[0] / n, .g = sums[1] / n, .b = sums[2] / n};
   return 1;
 }
 
-float clamp_zero_one(float input) {
-  return (input >= 1.0f) ? 1.0f : ((input <= 0.0f) ? 0.0f : input);
+// Contiguous bands, so each thread streams through its own rows/columns
+int sum_rows_band(PpmImage *image, SummedAreaTable *table, size_t rank,
+                  size_t step) {
+  if (image == NULL || table == NULL)
+    return 0;
+  size_t row_count = table->row_end - table->row_begin;
+  size_t row_begin = table->row_begin + row_count * rank / step;
+  size_t row_end = table->row_begin + row_count * (rank + 1) / step;
+  return sum_rows_summed_area_table(table, image, row_begin, row_end);
 }
 
-int sharpen(PpmImage *image, float threshold, float sharpen_factor, size_t m,
-            int rank, size_t step, pthread_barrier_t *flush_barrier) {
-  if (image == NULL)
+int sum_columns_band(PpmImage *image, SummedAreaTable *table, size_t rank,
+                     size_t step) {
+  if (image == NULL || table == NULL)
     return 0;
-  size_t image_size = image->width * image->height;
-  for (size_t idx = (size_t)rank; idx < image_size; idx += step) {
-    size_t x = idx % image->width;
-    size_t y = idx / image->width;
-    RgbTriplet rgb, blur, new_rgb;
-    if (!read_at_xy_ppm_image(image, x, y, &rgb))
-      return 0;
-    if (!blur_at(image, m, x, y, &blur))
+  size_t column_begin = image->width * rank / step;
+  size_t column_end = image->width * (rank + 1) / step;
+  return sum_columns_summed_area_table(table, column_begin, column_end);
+}
+
+// Row bands (or tiles) are handed out in contiguous runs, so each thread
+// writes its own rows; there are several chunks per thread for stealing
+#define WORK_CHUNKS_PER_THREAD 16
+
+// Chunks cover the rows [row_begin, row_end); with `tiles`, chunk `n` is
+// the tile `tiles[n]` of the grid
+typedef struct work_plan {
+  size_t tile_size, band_rows, chunk_count;
+  size_t row_begin, row_end;
+  TileGrid grid;
+  const size_t *tiles;
+} WorkPlan;
+
+WorkPlan plan_work(PpmImage *image, size_t tile_size, size_t thread_count,
+                   size_t row_begin, size_t row_end, const size_t *tiles,
+                   size_t tile_count) {
+  WorkPlan plan = {.tile_size = tile_size,
+                   .row_begin = row_begin,
+                   .row_end = row_end,
+                   .tiles = NULL};
+  size_t row_count = row_end - row_begin;
+  if (tile_size > 0) {
+    plan.grid = tile_grid(image->width, row_count, tile_size);
+    plan.tiles = tiles;
+    plan.chunk_count = (tiles != NULL) ? tile_count : plan.grid.count;
+    return plan;
+  }
+  size_t target = thread_count * WORK_CHUNKS_PER_THREAD;
+  plan.band_rows = (row_count + target - 1) / target;
+  if (plan.band_rows == 0)
+    plan.band_rows = 1;
+  plan.chunk_count = (row_count + plan.band_rows - 1) / plan.band_rows;
+  return plan;
+}
+
+// Chunk range [head, tail) owned by a thread, packed as `head | tail << 32`
+// so the owner popping the front and the thieves stealing the back all race
+// on a single compare-and-swap. Each deque sits on its own cache line, and
+// the counters its owner bumps on the next one, away from the thieves' CAS.
+typedef struct work_deque {
+  _Alignas(64) _Atomic uint64_t range;
+  _Alignas(64) size_t chunks_done;
+  size_t pixels_done, steal_count;
+} WorkDeque;
+
+static inline uint64_t pack_work_range(uint64_t head, uint64_t tail) {
+  return head | (tail << 32);
+}
+
+int pop_work_deque(WorkDeque *deque, size_t *chunk) {
+  uint64_t range = atomic_load_explicit(&deque->range, memory_order_acquire);
+  for (;;) {
+    uint64_t head = range & UINT32_MAX, tail = range >> 32;
+    if (head >= tail)
       return 0;
-    if (rgb.r <= threshold)
-      new_rgb = blur;
-    else
-      new_rgb = (RgbTriplet){
-          .r = clamp_zero_one(rgb.r + sharpen_factor * (rgb.r - blur.r)),
-          .g = clamp_zero_one(rgb.g + sharpen_factor * (rgb.g - blur.g)),
-          .b = clamp_zero_one(rgb.b + sharpen_factor * (rgb.b - blur.b))};
-    if (!write_at_xy_ppm_image(image, x, y, new_rgb))
+    if (atomic_compare_exchange_weak_explicit(
+            &deque->range, &range, pack_work_range(head + 1, tail),
+            memory_order_acq_rel, memory_order_acquire)) {
+      *chunk = (size_t)head;
+      return 1;
+    }
+  }
+}
+
+// Takes the back half of the victim's chunks, so a thread that ran dry does
+// not have to come back for every single one. Only an empty deque is ever
+// refilled, and nobody steals from an empty deque, so a plain store is enough.
+int steal_work_deque(WorkDeque *victim, WorkDeque *thief) {
+  uint64_t range = atomic_load_explicit(&victim->range, memory_order_acquire);
+  for (;;) {
+    uint64_t head = range & UINT32_MAX, tail = range >> 32;
+    if (head >= tail)
       return 0;
+    uint64_t stolen = (tail - head + 1) / 2;
+    if (atomic_compare_exchange_weak_explicit(
+            &victim->range, &range, pack_work_range(head, tail - stolen),
+            memory_order_acq_rel, memory_order_acquire)) {
+      atomic_store_explicit(&thief->range,
+                            pack_work_range(tail - stolen, tail),
+                            memory_order_release);
+      thief->steal_count++;
+      return 1;
+    }
+  }
+}
+
+// The deques live in the scratch work memory, grown only when too small
+WorkDeque *alloc_work_deques(WorkPlan *plan, size_t thread_count,
+                             FilterScratch *scratch) {
+  if (plan->chunk_count > UINT32_MAX)
+    return NULL;
+  size_t size = thread_count * sizeof(WorkDeque);
+  if (scratch->work == NULL || scratch->work_capacity < size) {
+    free_arena(scratch->work);
+    // Arena blocks are cache-line aligned, as the deques must be
+    scratch->work = alloc_arena(size);
+    scratch->work_capacity = (scratch->work != NULL) ? size : 0;
   }
-  pthread_barrier_wait(flush_barrier);
-  if (rank == 0 && !flush_ppm_image(image))
+  WorkDeque *deques = scratch->work;
+  if (deques == NULL)
+    return NULL;
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    size_t head = plan->chunk_count * idx / thread_count;
+    size_t tail = plan->chunk_count * (idx + 1) / thread_count;
+    atomic_init(&deques[idx].range, pack_work_range(head, tail));
+    deques[idx].chunks_done = 0;
+    deques[idx].pixels_done = 0;
+    deques[idx].steal_count = 0;
+  }
+  return deques;
+}
+
+void report_work_deques(WorkDeque *deques, size_t thread_count) {
+  for (size_t idx = 0; idx < thread_count; idx++)
+    fprintf(stderr, "Thread %lu: %lu chunks, %lu pixels, %lu steals\n", idx,
+            deques[idx].chunks_done, deques[idx].pixels_done,
+            deques[idx].steal_count);
+}
+
+int sharpen_chunk(PpmImage *image, SummedAreaTable *table, float threshold,
+                  float sharpen_factor, size_t m, WorkPlan *plan, size_t chunk,
+                  size_t *pixel_count) {
+  if (plan->tile_size > 0) {
+    size_t tile = (plan->tiles != NULL) ? plan->tiles[chunk] : chunk;
+    size_t x_begin, x_end, y_begin, y_end;
+    tile_bounds(&plan->grid, tile, &x_begin, &x_end, &y_begin, &y_end);
+    *pixel_count = (x_end - x_begin) * (y_end - y_begin);
+    return sharpen_tile(image, table, threshold, sharpen_factor, m,
+                        &plan->grid, tile, plan->row_begin);
+  }
+  // Whole rows, so the vector kernels get full spans
+  size_t y_begin = plan->row_begin + chunk * plan->band_rows;
+  size_t y_end = y_begin + plan->band_rows;
+  if (y_end > plan->row_end)
+    y_end = plan->row_end;
+  *pixel_count = (y_end - y_begin) * image->width;
+  for (size_t y = y_begin; y < y_end; y++)
+    if (!sharpen_span(image, table, threshold, sharpen_factor, m, y, 0,
+                      image->width))
+      return 0;
+  return 1;
+}
+
+int sharpen(PpmImage *image, SummedAreaTable *table, float threshold,
+            float sharpen_factor, size_t m, WorkPlan *plan, WorkDeque *deques,
+            size_t rank, size_t step) {
+  if (image == NULL)
     return 0;
-  pthread_barrier_wait(flush_barrier);
+  WorkDeque *own = &deques[rank];
+  for (;;) {
+    size_t chunk, pixel_count;
+    if (!pop_work_deque(own, &chunk)) {
+      // The per-pixel radius skews the cost of the chunks, so idle threads
+      // steal from the others instead of idling until the stage ends
+      uint64_t span = begin_trace_span();
+      int has_stolen = 0;
+      for (size_t offset = 1; offset < step && !has_stolen; offset++)
+        has_stolen =
+            steal_work_deque(&deques[(rank + offset) % step], own);
+      if (!has_stolen)
+        break;
+      end_trace_span("steal", span, TRACE_NO_ARG);
+      continue;
+    }
+    uint64_t span = begin_trace_span();
+    if (!sharpen_chunk(image, table, threshold, sharpen_factor, m, plan, chunk,
+                       &pixel_count))
+      return 0;
+    end_trace_span("chunk", span, (int64_t)chunk);
+    own->chunks_done++;
+    own->pixels_done += pixel_count;
+  }
   return 1;
 }
 
-typedef struct sharpen_and_grayscale_args {
-  int rank, thread_count;
+// Shared by every rank of a stage; the pool run is the barrier between them
+typedef struct filter_context {
   PpmImage *image;
+  SummedAreaTable *table;
   float threshold, sharpen_factor;
-  size_t m;
-  int *result_ptr;
-  pthread_barrier_t *barrier;
-} SharpenAndGrayscaleArgs;
-
-void *sharpen_and_grayscale_thread(void *void_ptr) {
-  SharpenAndGrayscaleArgs *args = void_ptr;
-  if (args == NULL || args->image == NULL ||
-      args->image->color_values_read == NULL ||
-      args->image->color_values_write == NULL || args->result_ptr == NULL)
-    goto thread_error;
-  *args->result_ptr = 0;
-  size_t per_thread_step = args->thread_count;
-  if (!sharpen(args->image, args->threshold, args->sharpen_factor, args->m,
-               args->rank, per_thread_step, args->barrier))
-    goto thread_error;
-  if (!grayscale(args->image, args->rank, per_thread_step, args->barrier))
-    goto thread_error;
-  *args->result_ptr = 1;
-thread_error:
-  return NULL;
+  size_t m, step;
+  WorkPlan *plan;
+  WorkDeque *deques;
+  atomic_int has_failed;
+} FilterContext;
+
+void sum_rows_stage(void *void_ptr, size_t rank) {
+  FilterContext *context = void_ptr;
+  uint64_t span = begin_trace_span();
+  if (!sum_rows_band(context->image, context->table, rank, context->step))
+    atomic_store(&context->has_failed, 1);
+  end_trace_span("sum rows", span, (int64_t)rank);
 }
 
-int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
-                     size_t m, int thread_count) {
-  if (image == NULL)
+void sum_columns_stage(void *void_ptr, size_t rank) {
+  FilterContext *context = void_ptr;
+  uint64_t span = begin_trace_span();
+  if (!sum_columns_band(context->image, context->table, rank, context->step))
+    atomic_store(&context->has_failed, 1);
+  end_trace_span("sum columns", span, (int64_t)rank);
+}
+
+void sharpen_stage(void *void_ptr, size_t rank) {
+  FilterContext *context = void_ptr;
+  uint64_t span = begin_trace_span();
+  if (!sharpen(context->image, context->table, context->threshold,
+               context->sharpen_factor, context->m, context->plan,
+               context->deques, rank, context->step))
+    atomic_store(&context->has_failed, 1);
+  end_trace_span("sharpen", span, (int64_t)rank);
+}
+
+int filter_rows_ppm_image(PpmImage *image, float threshold,
+                          float sharpen_factor, size_t m, int thread_count,
+                          BlurEngine blur_engine, size_t tile_size,
+                          size_t row_begin, size_t row_end,
+                          FilterScratch *scratch) {
+  if (image == NULL || thread_count < 1)
+    return 0;
+  if (row_begin > row_end || row_end > image->height)
+    return 0;
+  if (image->storage == PPM_STORAGE_TRIPLETS &&
+      (image->color_values_read == NULL ||
+       (image->color_values_write == NULL && image->luma_plane == NULL)))
     return 0;
   int result = 0;
-  pthread_t *thread_handles = malloc(thread_count * sizeof(pthread_t));
-  int *result_array = malloc(thread_count * sizeof(int));
-  pthread_barrier_t *barrier = malloc(sizeof(pthread_barrier_t));
-  SharpenAndGrayscaleArgs *args_array =
-      malloc(thread_count * sizeof(SharpenAndGrayscaleArgs));
-  pthread_barrier_init(barrier, NULL, thread_count);
-  int running_thread_count = 0;
-  for (int idx = 0; idx < thread_count; idx++) {
-    args_array[idx] =
-        (SharpenAndGrayscaleArgs){.rank = idx,
-                                  .image = image,
-                                  .threshold = threshold,
-                                  .sharpen_factor = sharpen_factor,
-                                  .m = m,
-                                  .result_ptr = &result_array[idx],
-                                  .barrier = barrier,
-                                  .thread_count = thread_count};
-    if (pthread_create(&thread_handles[idx], NULL, sharpen_and_grayscale_thread,
-                       &args_array[idx]))
-      break;
-    running_thread_count++;
-  }
-  if (running_thread_count != thread_count)
-    for (int idx = 0; idx < running_thread_count; idx++)
-      pthread_cancel(thread_handles[idx]);
-  for (int idx = 0; idx < running_thread_count; idx++)
-    pthread_join(thread_handles[idx], NULL);
-  if (running_thread_count == thread_count) {
-    result = 1;
-    for (int idx = 0; idx < running_thread_count; idx++)
-      if (!result_array[idx]) {
-        result = 0;
-        break;
-      }
+  FilterScratch own_scratch = {.table = NULL, .work = NULL, .work_capacity = 0};
+  if (scratch == NULL)
+    scratch = &own_scratch;
+  size_t step = (size_t)thread_count;
+  WorkPlan plan = plan_work(image, tile_size, step, row_begin, row_end,
+                            scratch->tiles, scratch->tile_count);
+  FilterContext context = {.image = image,
+                           .table = NULL,
+                           .threshold = threshold,
+                           .sharpen_factor = sharpen_factor,
+                           .m = m,
+                           .step = step,
+                           .plan = &plan,
+                           .deques = NULL};
+  atomic_init(&context.has_failed, 0);
+  context.deques = alloc_work_deques(&plan, step, scratch);
+  if (context.deques == NULL)
+    goto filter_exit;
+  if (blur_engine == BLUR_ENGINE_SUMMED_AREA && scratch->is_table_summed) {
+    context.table = scratch->table;
+  } else if (blur_engine == BLUR_ENGINE_SUMMED_AREA) {
+    if (!reserve_band_summed_area_table(&scratch->table, image, m, row_begin,
+                                        row_end))
+      goto filter_exit;
+    context.table = scratch->table;
+    // Every row must be summed before the column pass
+    run_thread_pool(step, sum_rows_stage, &context);
+    if (!atomic_load(&context.has_failed))
+      run_thread_pool(step, sum_columns_stage, &context);
   }
-  pthread_barrier_destroy(barrier);
-  free(thread_handles);
-  free(result_array);
-  free(barrier);
-  free(args_array);
+  if (!atomic_load(&context.has_failed))
+    run_thread_pool(step, sharpen_stage, &context);
+  if (atomic_load(&context.has_failed))
+    goto filter_exit;
+  if (getenv(SCHEDULER_STATS_VARIABLE) != NULL)
+    report_work_deques(context.deques, step);
+  result = 1;
+filter_exit:
+  free_filter_scratch(&own_scratch);
   return result;
 }
+
+void free_filter_scratch(FilterScratch *scratch) {
+  if (scratch == NULL)
+    return;
+  free_summed_area_table(&scratch->table);
+  free_arena(scratch->work);
+  scratch->work = NULL;
+  scratch->work_capacity = 0;
+  scratch->is_table_summed = 0;
+}
+
+int filter_is_threaded(void) { return 1; }
+
+int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
+                     size_t m, int thread_count, BlurEngine blur_engine,
+                     size_t tile_size) {
+  if (image == NULL)
+    return 0;
+  if (!filter_rows_ppm_image(image, threshold, sharpen_factor, m,
+                             thread_count, blur_engine, tile_size, 0,
+                             image->height, NULL))
+    return 0;
+  return flush_ppm_image(image);
+}
@@ -3,29 +3,18 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 
 #include "filter.h"
+#include "arena.h"
 #include "ppm.h"
+#include "sharpen.h"
+#include "simd.h"
+#include "summed_area.h"
+#include "tiling.h"
+#include "trace.h"
 #include <stddef.h>
+#include <stdint.h>
 
 #define UNUSED(x) (void)(x)
 
-int grayscale(PpmImage *image) {
-  if (image == NULL)
-    return 0;
-  size_t image_size = image->width * image->height;
-  for (size_t idx = 0; idx < image_size; idx++) {
-    RgbTriplet rgb;
-    if (!read_at_idx_ppm_image(image, idx, &rgb))
-      return 0;
-    float y = 0.299f * rgb.r + 0.587f * rgb.g + 0.114f * rgb.b;
-    RgbTriplet grayscale_rgb = (RgbTriplet){.r = y, .g = y, .b = y};
-    if (!write_at_idx_ppm_image(image, idx, grayscale_rgb))
-      return 0;
-  }
-  if (!flush_ppm_image(image))
-    return 0;
-  return 1;
-}
-
 size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   if (image == NULL)
     return 0;
@@ -39,7 +28,8 @@ size_t r_pixel(PpmImage *image, size_t m, size_t x, size_t y) {
   return (((size_t)(sum * 255)) % m) + 1;
 }
 
-int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
+int blur_at(PpmImage *image, SummedAreaTable *table, size_t m, size_t x,
+            size_t y, RgbTriplet *rgb) {
   if (image == NULL)
     return 0;
   if (x > image->width || y > image->height)
@@ -47,75 +37,106 @@ int blur_at(PpmImage *image, size_t m, size_t x, size_t y, RgbTriplet *rgb) {
   size_t radius = r_pixel(image, m, x, y);
   if (radius == 0)
     return 0;
-  float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
-  for (size_t i = 0; i <= 2 * radius; i++) {
-    for (size_t j = 0; j <= 2 * radius; j++) {
-      size_t neighbour_x = x + i;
-      if (neighbour_x < radius)
-        neighbour_x = 0;
-      else
-        neighbour_x -= radius;
-      size_t neighbour_y = y + j;
-      if (neighbour_y < radius)
-        neighbour_y = 0;
-      else
-        neighbour_y -= radius;
-      if (neighbour_x >= image->width)
-        neighbour_x = image->width - 1;
-      if (neighbour_y >= image->height)
-        neighbour_y = image->height - 1;
-      size_t neighbour_idx = neighbour_x + neighbour_y * image->width;
-      RgbTriplet neighbour_rgb;
-      if (!read_at_idx_ppm_image(image, neighbour_idx, &neighbour_rgb))
-        return 0;
-      sum_r += neighbour_rgb.r;
-      sum_g += neighbour_rgb.g;
-      sum_b += neighbour_rgb.b;
-    }
-  }
+  if (table != NULL)
+    return blur_at_summed_area_table(table, x, y, radius, rgb);
+  float sums[3];
+  if (!sum_window_simd(image, x, y, radius, sums))
+    return 0;
   float n = (float)((1 + radius * 2) * (1 + radius * 2));
-  *rgb = (RgbTriplet){.r = sum_r / n, .g = sum_g / n, .b = sum_b / n};
+  *rgb = (RgbTriplet){.r = sums[0] / n, .g = sums[1] / n, .b = sums[2] / n};
   return 1;
 }
 
-float clamp_zero_one(float input) {
-  return (input >= 1.0f) ? 1.0f : ((input <= 0.0f) ? 0.0f : input);
-}
-
-int sharpen(PpmImage *image, float threshold, float sharpen_factor, size_t m) {
+// Only the listed `tiles` are sharpened, unless it is NULL
+int sharpen(PpmImage *image, SummedAreaTable *table, float threshold,
+            float sharpen_factor, size_t m, size_t tile_size, size_t row_begin,
+            size_t row_end, const size_t *tiles, size_t tile_count) {
   if (image == NULL)
     return 0;
-  for (size_t x = 0; x < image->width; x++) {
-    for (size_t y = 0; y < image->height; y++) {
-      RgbTriplet rgb, blur, new_rgb;
-      if (!read_at_xy_ppm_image(image, x, y, &rgb))
+  if (tile_size > 0) {
+    TileGrid grid = tile_grid(image->width, row_end - row_begin, tile_size);
+    if (tiles == NULL)
+      tile_count = grid.count;
+    for (size_t idx = 0; idx < tile_count; idx++)
+      if (!sharpen_tile(image, table, threshold, sharpen_factor, m, &grid,
+                        (tiles != NULL) ? tiles[idx] : idx, row_begin))
         return 0;
-      if (!blur_at(image, m, x, y, &blur))
+  } else {
+    for (size_t y = row_begin; y < row_end; y++)
+      if (!sharpen_span(image, table, threshold, sharpen_factor, m, y, 0,
+                        image->width))
         return 0;
-      if (rgb.r <= threshold)
-        new_rgb = blur;
-      else
-        new_rgb = (RgbTriplet){
-            .r = clamp_zero_one(rgb.r + sharpen_factor * (rgb.r - blur.r)),
-            .g = clamp_zero_one(rgb.g + sharpen_factor * (rgb.g - blur.g)),
-            .b = clamp_zero_one(rgb.b + sharpen_factor * (rgb.b - blur.b))};
-      if (!write_at_xy_ppm_image(image, x, y, new_rgb))
-        return 0;
-    }
   }
-  if (!flush_ppm_image(image))
-    return 0;
   return 1;
 }
 
-int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
-                     size_t m, int thread_count) {
-  UNUSED(thread_count);
+// Sums the rows of `image` needed by the rows [row_begin, row_end) into
+// `*table`, which is reused when large enough
+int summed_area(PpmImage *image, size_t m, size_t row_begin, size_t row_end,
+                SummedAreaTable **table) {
   if (image == NULL)
     return 0;
-  if (!sharpen(image, threshold, sharpen_factor, m))
+  if (!reserve_band_summed_area_table(table, image, m, row_begin, row_end))
     return 0;
-  if (!grayscale(image))
+  return sum_rows_summed_area_table(*table, image, (*table)->row_begin,
+                                    (*table)->row_end) &&
+         sum_columns_summed_area_table(*table, 0, image->width);
+}
+
+int filter_rows_ppm_image(PpmImage *image, float threshold,
+                          float sharpen_factor, size_t m, int thread_count,
+                          BlurEngine blur_engine, size_t tile_size,
+                          size_t row_begin, size_t row_end,
+                          FilterScratch *scratch) {
+  UNUSED(thread_count);
+  if (image == NULL || row_begin > row_end || row_end > image->height)
     return 0;
-  return 1;
+  int result = 0;
+  FilterScratch own_scratch = {.table = NULL, .work = NULL, .work_capacity = 0};
+  if (scratch == NULL)
+    scratch = &own_scratch;
+  SummedAreaTable *table = NULL;
+  uint64_t span;
+  if (blur_engine == BLUR_ENGINE_SUMMED_AREA) {
+    if (!scratch->is_table_summed) {
+      span = begin_trace_span();
+      if (!summed_area(image, m, row_begin, row_end, &scratch->table))
+        goto filter_exit;
+      end_trace_span("summed area", span, TRACE_NO_ARG);
+    }
+    table = scratch->table;
+  }
+  span = begin_trace_span();
+  if (!sharpen(image, table, threshold, sharpen_factor, m, tile_size,
+               row_begin, row_end, scratch->tiles, scratch->tile_count))
+    goto filter_exit;
+  end_trace_span("sharpen", span, TRACE_NO_ARG);
+  result = 1;
+filter_exit:
+  free_filter_scratch(&own_scratch);
+  return result;
+}
+
+void free_filter_scratch(FilterScratch *scratch) {
+  if (scratch == NULL)
+    return;
+  free_summed_area_table(&scratch->table);
+  free_arena(scratch->work);
+  scratch->work = NULL;
+  scratch->work_capacity = 0;
+  scratch->is_table_summed = 0;
+}
+
+int filter_is_threaded(void) { return 0; }
+
+int filter_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
+                     size_t m, int thread_count, BlurEngine blur_engine,
+                     size_t tile_size) {
+  if (image == NULL)
+    return 0;
+  if (!filter_rows_ppm_image(image, threshold, sharpen_factor, m,
+                             thread_count, blur_engine, tile_size, 0,
+                             image->height, NULL))
+    return 0;
+  return flush_ppm_image(image);
 }
@@ -0,0 +1,115 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "session.h"
+#include "arena.h"
+#include "filter.h"
+#include "ppm.h"
+#include "tiling.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+FilterSession *alloc_filter_session(int thread_count, BlurEngine blur_engine,
+                                    size_t tile_size) {
+  FilterSession *session = NULL;
+  ASSERT(thread_count >= 1, "Invalid filter session thread count",
+         alloc_filter_session_error);
+  session = malloc(sizeof(FilterSession));
+  ASSERT(session != NULL, "Could not allocate the filter session",
+         alloc_filter_session_error);
+  *session = (FilterSession){
+      .thread_count = thread_count,
+      .blur_engine = blur_engine,
+      .tile_size = tile_size,
+      .scratch = {.table = NULL, .work = NULL, .work_capacity = 0},
+      .source_copy = NULL,
+      .source_copy_capacity = 0};
+  return session;
+alloc_filter_session_error:
+  return NULL;
+}
+
+// Packs the rows of `source` into the session copy, grown only when too small
+static const uint8_t *copy_source_session(FilterSession *session,
+                                          const FilterBuffer *source,
+                                          size_t row_size) {
+  size_t size = row_size * source->height;
+  if (session->source_copy == NULL || session->source_copy_capacity < size) {
+    free_arena(session->source_copy);
+    session->source_copy = alloc_arena(size);
+    session->source_copy_capacity = (session->source_copy != NULL) ? size : 0;
+    if (session->source_copy == NULL)
+      return NULL;
+  }
+  const uint8_t *rows = source->samples;
+  for (size_t y = 0; y < source->height; y++)
+    memcpy(&session->source_copy[y * row_size], &rows[y * source->row_stride],
+           row_size);
+  return session->source_copy;
+}
+
+int filter_buffer_session(FilterSession *session, const FilterBuffer *source,
+                          const FilterBuffer *destination, float threshold,
+                          float sharpen_factor, size_t m) {
+  ASSERT(session != NULL, "Filter session is NULL",
+         filter_buffer_session_error);
+  ASSERT(source != NULL && source->samples != NULL,
+         "Filter source buffer is NULL", filter_buffer_session_error);
+  if (destination == NULL)
+    destination = source;
+  ASSERT(destination->samples != NULL, "Filter destination buffer is NULL",
+         filter_buffer_session_error);
+  ASSERT(destination->width == source->width &&
+             destination->height == source->height &&
+             destination->max_value == source->max_value,
+         "Filter buffers differ in size or maximum value",
+         filter_buffer_session_error);
+  const void *samples = source->samples;
+  size_t stride = source->row_stride;
+  // A summed-area blur only reads each pixel right before overwriting it
+  // once the table is built, so sharing the buffer is safe there
+  if (destination->samples == source->samples &&
+      session->blur_engine == BLUR_ENGINE_WINDOW) {
+    stride = source->width * 3 * ((source->max_value > UINT8_MAX) ? 2 : 1);
+    ASSERT(source->row_stride >= stride, "Invalid filter buffer row stride",
+           filter_buffer_session_error);
+    samples = copy_source_session(session, source, stride);
+    ASSERT(samples != NULL, "Could not allocate the filter source copy",
+           filter_buffer_session_error);
+  }
+  PpmImage image;
+  ASSERT(wrap_ppm_image(&image, source->width, source->height,
+                        source->max_value, samples, stride,
+                        destination->samples, destination->row_stride),
+         "Error wrapping the filter buffers", filter_buffer_session_error);
+  size_t tile_size = (session->tile_size == SIZE_MAX) ? default_tile_size(m)
+                                                      : session->tile_size;
+  // Left unflushed: the results already are in the destination
+  ASSERT(filter_rows_ppm_image(&image, threshold, sharpen_factor, m,
+                               session->thread_count, session->blur_engine,
+                               tile_size, 0, image.height, &session->scratch),
+         "Error applying the filter to the buffer",
+         filter_buffer_session_error);
+  return 1;
+filter_buffer_session_error:
+  return 0;
+}
+
+void free_filter_session(FilterSession **session) {
+  if (session == NULL || *session == NULL)
+    return;
+  free_filter_scratch(&(*session)->scratch);
+  free_arena((*session)->source_copy);
+  free(*session);
+  *session = NULL;
+}
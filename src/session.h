@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SESSION_HEADER
+#define SESSION_HEADER
+
+#include "filter.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The shared library is built with hidden visibility, so only these entry
+// points are exported
+#define FILTER_SESSION_API __attribute__((visibility("default")))
+
+// Interleaved RGB pixels in caller-owned memory
+typedef struct filter_buffer {
+  // 8-bit samples when `max_value` <= 255, native-endian 16-bit ones
+  // otherwise
+  void *samples;
+  size_t width, height;
+  // Bytes from a row to the next, at least `width * 3` samples
+  size_t row_stride;
+  uint16_t max_value;
+} FilterBuffer;
+
+// Entry point for programs that already hold decoded pixels. A session keeps
+// the engine choice and the working memory of the filter, so calls on images
+// no larger than the ones already filtered allocate nothing; the threads come
+// from the process-wide pool of `thread_pool.h` (or the OpenMP runtime).
+typedef struct filter_session {
+  int thread_count;
+  BlurEngine blur_engine;
+  // Same meaning as in `filter_ppm_image`, `SIZE_MAX` picking the default
+  // size for each `m`
+  size_t tile_size;
+  FilterScratch scratch;
+  // Source rows kept by in-place `window` blurs, which read the neighbours
+  // of pixels that were already overwritten
+  uint8_t *source_copy;
+  size_t source_copy_capacity;
+} FilterSession;
+
+FILTER_SESSION_API FilterSession *
+alloc_filter_session(int thread_count, BlurEngine blur_engine,
+                     size_t tile_size);
+// Filters `source` into `destination`, which must have the same dimensions
+// and `max_value`, or into `source` itself when `destination` is NULL or
+// points to the same samples. Pixels are read and written in place through
+// the strides; only in-place `window` blurs copy the source.
+FILTER_SESSION_API int
+filter_buffer_session(FilterSession *session, const FilterBuffer *source,
+                      const FilterBuffer *destination, float threshold,
+                      float sharpen_factor, size_t m);
+FILTER_SESSION_API void free_filter_session(FilterSession **session);
+
+#endif // SESSION_HEADER
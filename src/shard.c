@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "shard.h"
+#include "filter.h"
+#include "ppm.h"
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+typedef struct shard {
+  size_t row_begin, row_end;
+  pid_t worker;
+  size_t attempt_count;
+} Shard;
+
+// Never returns in the worker, which leaves through `_exit` so the atexit
+// reports and stdio buffers inherited from the coordinator stay with it
+static pid_t fork_shard_worker(PpmImage *image, BatchSettings *settings,
+                               Shard *shards, size_t shard) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t worker = fork();
+  if (worker != 0)
+    return worker;
+  const char *crash = getenv(SHARD_CRASH_VARIABLE);
+  if (crash != NULL && shards[shard].attempt_count == 0 &&
+      strtoul(crash, NULL, 10) == shard)
+    raise(SIGKILL);
+  int is_filtered = filter_rows_ppm_image(
+      image, settings->threshold, settings->sharpen_factor, settings->m,
+      settings->thread_count, settings->blur_engine, settings->tile_size,
+      shards[shard].row_begin, shards[shard].row_end, NULL);
+  fflush(stdout);
+  _exit(is_filtered ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void report_shard_worker(size_t shard, pid_t worker, int status) {
+  if (WIFSIGNALED(status))
+    fprintf(stderr, "Shard %lu worker %d was killed by signal %d\n", shard,
+            (int)worker, WTERMSIG(status));
+  else
+    fprintf(stderr, "Shard %lu worker %d exited with status %d\n", shard,
+            (int)worker, WEXITSTATUS(status));
+}
+
+int filter_sharded_ppm_image(PpmImage *image, size_t process_count,
+                             BatchSettings *settings) {
+  int result = 0;
+  Shard *shards = NULL;
+  size_t running_count = 0, failure_count = 0;
+  ASSERT(image != NULL && settings != NULL, "PPM image or settings is NULL",
+         filter_sharded_exit);
+  ASSERT(process_count >= 1, "Process count must be positive",
+         filter_sharded_exit);
+  if (process_count > image->height && image->height > 0)
+    process_count = image->height;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  shards = calloc(process_count, sizeof(Shard));
+  ASSERT(shards != NULL, "Could not allocate the shards", filter_sharded_exit);
+  for (size_t shard = 0; shard < process_count; shard++) {
+    shards[shard].row_begin = image->height * shard / process_count;
+    shards[shard].row_end = image->height * (shard + 1) / process_count;
+    shards[shard].worker = fork_shard_worker(image, settings, shards, shard);
+    if (shards[shard].worker < 0) {
+      failure_count++;
+      break;
+    }
+    running_count++;
+  }
+  // Waits for every worker even after a failure, so none is left behind
+  while (running_count > 0) {
+    int status;
+    pid_t worker = waitpid(-1, &status, 0);
+    if (worker < 0 && errno == EINTR)
+      continue;
+    ASSERT(worker >= 0, "Error waiting for the shard workers",
+           filter_sharded_exit);
+    size_t shard = 0;
+    while (shard < process_count && shards[shard].worker != worker)
+      shard++;
+    if (shard == process_count)
+      continue;
+    running_count--;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+      continue;
+    report_shard_worker(shard, worker, status);
+    // Shards only write their own rows, so running one again is harmless
+    if (failure_count == 0 &&
+        shards[shard].attempt_count < SHARD_RETRY_COUNT) {
+      shards[shard].attempt_count++;
+      shards[shard].worker =
+          fork_shard_worker(image, settings, shards, shard);
+      if (shards[shard].worker >= 0) {
+        running_count++;
+        continue;
+      }
+    }
+    failure_count++;
+  }
+  ASSERT(failure_count == 0, "Error filtering the PPM image shards",
+         filter_sharded_exit);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (double)(end.tv_sec - begin.tv_sec) +
+                   (double)(end.tv_nsec - begin.tv_nsec) * 1e-9;
+  size_t restart_count = 0;
+  for (size_t shard = 0; shard < process_count; shard++)
+    restart_count += shards[shard].attempt_count;
+  fprintf(stderr, "Filtered %lu shards (%lu restarts) in %.3f s\n",
+          process_count, restart_count, seconds);
+  // The workers wrote the shared write buffer behind this process' back
+  image->needs_flushing = 1;
+  ASSERT(flush_ppm_image(image), "Error flushing the image write buffer",
+         filter_sharded_exit);
+  result = 1;
+filter_sharded_exit:
+  free(shards);
+  return result;
+}
@@ -0,0 +1,30 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SHARD_HEADER
+#define SHARD_HEADER
+
+#include "batch.h"
+#include "ppm.h"
+#include <stddef.h>
+
+// Set to a shard index to kill the first worker of that shard before it
+// filters anything, which exercises the restart
+#define SHARD_CRASH_VARIABLE "PP_EP2_SHARD_CRASH"
+// Times a shard is forked again after its worker died or failed
+#define SHARD_RETRY_COUNT 2
+
+// Same as `filter_ppm_image` with the parameters of `settings`, but on
+// `process_count` forked worker processes, each one sharpening a horizontal
+// shard of rows with `settings->thread_count` threads. Workers read their
+// shard plus up to `m` rows around it from the read buffer and write only
+// their shard of the write buffer, both of which must be shared memory (see
+// `read_shared_ppm_image`), so the shards need no stitching and a shard
+// whose worker dies is simply forked again. With the `summed-area` engine,
+// every worker sums the whole image, as the sums of a row depend on all the
+// rows above it.
+int filter_sharded_ppm_image(PpmImage *image, size_t process_count,
+                             BatchSettings *settings);
+
+#endif // SHARD_HEADER
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "sharpen.h"
+#include "ppm.h"
+#include "simd.h"
+#include "summed_area.h"
+#include "tiling.h"
+#include <stddef.h>
+
+// Gathers the pixels into the structure-of-arrays input of the kernels
+int sharpen_span(PpmImage *image, SummedAreaTable *table, float threshold,
+                 float sharpen_factor, size_t m, size_t y, size_t x_begin,
+                 size_t x_end) {
+  const SimdKernels *kernels = simd_kernels();
+  SharpenSpan span;
+  for (size_t chunk = x_begin; chunk < x_end; chunk += SIMD_SPAN) {
+    size_t count = (x_end - chunk < SIMD_SPAN) ? x_end - chunk : SIMD_SPAN;
+    for (size_t i = 0; i < count; i++) {
+      RgbTriplet rgb, blur;
+      if (!read_at_xy_ppm_image(image, chunk + i, y, &rgb))
+        return 0;
+      if (!blur_at(image, table, m, chunk + i, y, &blur))
+        return 0;
+      span.red[i] = rgb.r;
+      span.green[i] = rgb.g;
+      span.blue[i] = rgb.b;
+      span.blur_red[i] = blur.r;
+      span.blur_green[i] = blur.g;
+      span.blur_blue[i] = blur.b;
+    }
+    // Fused with the grayscale conversion, saving a whole pass and flush
+    kernels->sharpen_grayscale(&span, count, threshold, sharpen_factor);
+    for (size_t i = 0; i < count; i++)
+      if (!write_luma_at_xy_ppm_image(image, chunk + i, y, span.luma[i]))
+        return 0;
+  }
+  return 1;
+}
+
+int sharpen_tile(PpmImage *image, SummedAreaTable *table, float threshold,
+                 float sharpen_factor, size_t m, TileGrid *grid, size_t tile,
+                 size_t row_offset) {
+  size_t x_begin, x_end, y_begin, y_end;
+  tile_bounds(grid, tile, &x_begin, &x_end, &y_begin, &y_end);
+  for (size_t y = y_begin + row_offset; y < y_end + row_offset; y++)
+    if (!sharpen_span(image, table, threshold, sharpen_factor, m, y, x_begin,
+                      x_end))
+      return 0;
+  return 1;
+}
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SHARPEN_HEADER
+#define SHARPEN_HEADER
+
+#include "ppm.h"
+#include "summed_area.h"
+#include "tiling.h"
+#include <stddef.h>
+
+// Blur of the window around (x, y), read from `table` when it isn't NULL;
+// defined by each variant
+int blur_at(PpmImage *image, SummedAreaTable *table, size_t m, size_t x,
+            size_t y, RgbTriplet *rgb);
+
+// Sharpens pixels [x_begin, x_end) of row `y` into the luma of the write
+// buffer, gathered SIMD_SPAN at a time into the vector kernels
+int sharpen_span(PpmImage *image, SummedAreaTable *table, float threshold,
+                 float sharpen_factor, size_t m, size_t y, size_t x_begin,
+                 size_t x_end);
+// Sharpens `tile` of `grid`, which covers the rows from `row_offset` onwards
+int sharpen_tile(PpmImage *image, SummedAreaTable *table, float threshold,
+                 float sharpen_factor, size_t m, TileGrid *grid, size_t tile,
+                 size_t row_offset);
+
+#endif // SHARPEN_HEADER
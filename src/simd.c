@@ -0,0 +1,755 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "simd.h"
+#include "ppm.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// SCALAR SECTION
+
+static void sum_rows_scalar(const RgbTriplet *first, size_t stride,
+                            size_t rows, size_t count, float sums[3]) {
+  float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
+  for (size_t row = 0; row < rows; row++) {
+    const RgbTriplet *triplets = &first[row * stride];
+    for (size_t idx = 0; idx < count; idx++) {
+      sum_r += triplets[idx].r;
+      sum_g += triplets[idx].g;
+      sum_b += triplets[idx].b;
+    }
+  }
+  sums[0] = sum_r;
+  sums[1] = sum_g;
+  sums[2] = sum_b;
+}
+
+static inline float clamp_unit(float input) {
+  return (input >= 1.0f) ? 1.0f : ((input <= 0.0f) ? 0.0f : input);
+}
+
+// Also finishes the tails left by the vector kernels
+static void sharpen_grayscale_range(SharpenSpan *span, size_t begin,
+                                    size_t end, float threshold,
+                                    float sharpen_factor) {
+  for (size_t idx = begin; idx < end; idx++) {
+    float red = span->red[idx], green = span->green[idx],
+          blue = span->blue[idx];
+    if (red <= threshold) {
+      red = span->blur_red[idx];
+      green = span->blur_green[idx];
+      blue = span->blur_blue[idx];
+    } else {
+      red = clamp_unit(red + sharpen_factor * (red - span->blur_red[idx]));
+      green =
+          clamp_unit(green + sharpen_factor * (green - span->blur_green[idx]));
+      blue = clamp_unit(blue + sharpen_factor * (blue - span->blur_blue[idx]));
+    }
+    span->luma[idx] = 0.299f * red + 0.587f * green + 0.114f * blue;
+  }
+}
+
+static void sharpen_grayscale_scalar(SharpenSpan *span, size_t count,
+                                     float threshold, float sharpen_factor) {
+  sharpen_grayscale_range(span, 0, count, threshold, sharpen_factor);
+}
+
+// Also finishes the tails left by the vector kernels
+static void compare_samples_range(const float *a, const float *b, size_t begin,
+                                  size_t end, float limit, SampleDiff *diff) {
+  for (size_t idx = begin; idx < end; idx++) {
+    float abs_diff = a[idx] - b[idx];
+    if (abs_diff < 0.0f)
+      abs_diff = -abs_diff;
+    if (abs_diff > diff->max_abs)
+      diff->max_abs = abs_diff;
+    diff->sum_squares += abs_diff * abs_diff;
+    diff->over_limit += abs_diff > limit;
+  }
+}
+
+static void compare_samples_scalar(const float *a, const float *b,
+                                   size_t count, float limit,
+                                   SampleDiff *diff) {
+  *diff = (SampleDiff){.max_abs = 0.0f, .sum_squares = 0.0f, .over_limit = 0};
+  compare_samples_range(a, b, 0, count, limit, diff);
+}
+
+static uint64_t sum_plane_u8_scalar(const uint8_t *first, size_t stride,
+                                    size_t rows, size_t count) {
+  uint64_t sum = 0;
+  for (size_t row = 0; row < rows; row++)
+    for (size_t idx = 0; idx < count; idx++)
+      sum += first[row * stride + idx];
+  return sum;
+}
+
+static uint64_t sum_plane_u16_scalar(const uint16_t *first, size_t stride,
+                                     size_t rows, size_t count) {
+  uint64_t sum = 0;
+  for (size_t row = 0; row < rows; row++)
+    for (size_t idx = 0; idx < count; idx++)
+      sum += first[row * stride + idx];
+  return sum;
+}
+
+#ifdef SIMD_X86
+
+// Interleaved samples repeat their channel every 3 floats. The rows are
+// summed vertically into 3 vectors per chunk of columns, keeping lane `i` of
+// the concatenated accumulators on channel `i % 3`, so the horizontal
+// reduction runs once per chunk instead of once per row
+static void reduce_lanes(const float *lanes, size_t lane_count,
+                         float sums[3]) {
+  for (size_t lane = 0; lane < lane_count; lane += 3) {
+    sums[0] += lanes[lane];
+    sums[1] += lanes[lane + 1];
+    sums[2] += lanes[lane + 2];
+  }
+}
+
+// SSE4.2 SECTION
+
+__attribute__((target("sse4.2"))) static void
+sum_rows_sse42(const RgbTriplet *first, size_t stride, size_t rows,
+               size_t count, float sums[3]) {
+  const float *samples = (const float *)first;
+  size_t sample_count = count * 3, sample_stride = stride * 3, idx = 0;
+  sums[0] = sums[1] = sums[2] = 0.0f;
+  for (; idx + 12 <= sample_count; idx += 12) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(),
+           acc2 = _mm_setzero_ps();
+    for (size_t row = 0; row < rows; row++) {
+      const float *chunk = &samples[row * sample_stride + idx];
+      acc0 = _mm_add_ps(acc0, _mm_loadu_ps(&chunk[0]));
+      acc1 = _mm_add_ps(acc1, _mm_loadu_ps(&chunk[4]));
+      acc2 = _mm_add_ps(acc2, _mm_loadu_ps(&chunk[8]));
+    }
+    float lanes[12];
+    _mm_storeu_ps(&lanes[0], acc0);
+    _mm_storeu_ps(&lanes[4], acc1);
+    _mm_storeu_ps(&lanes[8], acc2);
+    reduce_lanes(lanes, 12, sums);
+  }
+  // SSE has no masked loads, so the last few triplets are summed by hand
+  for (size_t row = 0; row < rows; row++)
+    for (size_t tail = idx; tail < sample_count; tail += 3) {
+      const float *triplet = &samples[row * sample_stride + tail];
+      sums[0] += triplet[0];
+      sums[1] += triplet[1];
+      sums[2] += triplet[2];
+    }
+}
+
+__attribute__((target("sse4.2"))) static void
+sharpen_grayscale_sse42(SharpenSpan *span, size_t count, float threshold,
+                        float sharpen_factor) {
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 limit = _mm_set1_ps(threshold);
+  const __m128 factor = _mm_set1_ps(sharpen_factor);
+  const __m128 luma_r = _mm_set1_ps(0.299f), luma_g = _mm_set1_ps(0.587f),
+               luma_b = _mm_set1_ps(0.114f);
+  size_t idx = 0;
+  for (; idx + 4 <= count; idx += 4) {
+    __m128 red = _mm_loadu_ps(&span->red[idx]);
+    __m128 green = _mm_loadu_ps(&span->green[idx]);
+    __m128 blue = _mm_loadu_ps(&span->blue[idx]);
+    __m128 blur_red = _mm_loadu_ps(&span->blur_red[idx]);
+    __m128 blur_green = _mm_loadu_ps(&span->blur_green[idx]);
+    __m128 blur_blue = _mm_loadu_ps(&span->blur_blue[idx]);
+    __m128 is_dark = _mm_cmple_ps(red, limit);
+    __m128 new_red =
+        _mm_add_ps(red, _mm_mul_ps(factor, _mm_sub_ps(red, blur_red)));
+    __m128 new_green =
+        _mm_add_ps(green, _mm_mul_ps(factor, _mm_sub_ps(green, blur_green)));
+    __m128 new_blue =
+        _mm_add_ps(blue, _mm_mul_ps(factor, _mm_sub_ps(blue, blur_blue)));
+    new_red = _mm_min_ps(_mm_max_ps(new_red, zero), one);
+    new_green = _mm_min_ps(_mm_max_ps(new_green, zero), one);
+    new_blue = _mm_min_ps(_mm_max_ps(new_blue, zero), one);
+    new_red = _mm_blendv_ps(new_red, blur_red, is_dark);
+    new_green = _mm_blendv_ps(new_green, blur_green, is_dark);
+    new_blue = _mm_blendv_ps(new_blue, blur_blue, is_dark);
+    __m128 luma = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(luma_r, new_red), _mm_mul_ps(luma_g, new_green)),
+        _mm_mul_ps(luma_b, new_blue));
+    _mm_storeu_ps(&span->luma[idx], luma);
+  }
+  sharpen_grayscale_range(span, idx, count, threshold, sharpen_factor);
+}
+
+__attribute__((target("sse4.2"))) static void
+compare_samples_sse42(const float *a, const float *b, size_t count,
+                      float limit, SampleDiff *diff) {
+  const __m128 sign = _mm_set1_ps(-0.0f), bound = _mm_set1_ps(limit);
+  __m128 max_abs = _mm_setzero_ps(), squares = _mm_setzero_ps();
+  __m128i over = _mm_setzero_si128();
+  size_t idx = 0;
+  for (; idx + 4 <= count; idx += 4) {
+    __m128 abs_diff = _mm_andnot_ps(
+        sign, _mm_sub_ps(_mm_loadu_ps(&a[idx]), _mm_loadu_ps(&b[idx])));
+    max_abs = _mm_max_ps(max_abs, abs_diff);
+    squares = _mm_add_ps(squares, _mm_mul_ps(abs_diff, abs_diff));
+    // Comparisons yield -1 per lane, so subtracting them counts
+    over = _mm_sub_epi32(over, _mm_castps_si128(_mm_cmpgt_ps(abs_diff, bound)));
+  }
+  float max_lanes[4], square_lanes[4];
+  int over_lanes[4];
+  _mm_storeu_ps(max_lanes, max_abs);
+  _mm_storeu_ps(square_lanes, squares);
+  _mm_storeu_si128((__m128i *)over_lanes, over);
+  *diff = (SampleDiff){.max_abs = 0.0f, .sum_squares = 0.0f, .over_limit = 0};
+  for (int lane = 0; lane < 4; lane++) {
+    if (max_lanes[lane] > diff->max_abs)
+      diff->max_abs = max_lanes[lane];
+    diff->sum_squares += square_lanes[lane];
+    diff->over_limit += (size_t)over_lanes[lane];
+  }
+  compare_samples_range(a, b, idx, count, limit, diff);
+}
+
+// Sums of absolute differences against zero add up 8 bytes into each 64-bit
+// lane, so 8-bit planes never overflow
+__attribute__((target("sse4.2"))) static uint64_t
+sum_plane_u8_sse42(const uint8_t *first, size_t stride, size_t rows,
+                   size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  uint64_t tail_sum = 0;
+  for (size_t row = 0; row < rows; row++) {
+    const uint8_t *samples = &first[row * stride];
+    size_t idx = 0;
+    for (; idx + 16 <= count; idx += 16)
+      acc = _mm_add_epi64(
+          acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)&samples[idx]),
+                            zero));
+    if (idx + 8 <= count) {
+      acc = _mm_add_epi64(
+          acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i *)&samples[idx]),
+                            zero));
+      idx += 8;
+    }
+    for (; idx < count; idx++)
+      tail_sum += samples[idx];
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + tail_sum;
+}
+
+// Each row is summed into 32-bit lanes (enough below 2^18 samples per row)
+// and then widened
+__attribute__((target("sse4.2"))) static uint64_t
+sum_plane_u16_sse42(const uint16_t *first, size_t stride, size_t rows,
+                    size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  uint64_t tail_sum = 0;
+  for (size_t row = 0; row < rows; row++) {
+    const uint16_t *samples = &first[row * stride];
+    __m128i row_acc = _mm_setzero_si128();
+    size_t idx = 0;
+    for (; idx + 8 <= count; idx += 8) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *)&samples[idx]);
+      row_acc = _mm_add_epi32(row_acc, _mm_cvtepu16_epi32(chunk));
+      row_acc = _mm_add_epi32(row_acc, _mm_unpackhi_epi16(chunk, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(row_acc));
+    acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(_mm_srli_si128(row_acc, 8)));
+    for (; idx < count; idx++)
+      tail_sum += samples[idx];
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + tail_sum;
+}
+
+// AVX2 SECTION
+
+__attribute__((target("avx2"))) static void
+sum_rows_avx2(const RgbTriplet *first, size_t stride, size_t rows,
+              size_t count, float sums[3]) {
+  const float *samples = (const float *)first;
+  const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  size_t sample_count = count * 3, sample_stride = stride * 3;
+  sums[0] = sums[1] = sums[2] = 0.0f;
+  for (size_t idx = 0; idx < sample_count; idx += 24) {
+    // Masked loads finish the last chunk without touching the next pixels
+    int remaining = (int)(sample_count - idx);
+    __m256i mask0 = _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), lane_ids);
+    __m256i mask1 =
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining - 8), lane_ids);
+    __m256i mask2 =
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining - 16), lane_ids);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(),
+           acc2 = _mm256_setzero_ps();
+    for (size_t row = 0; row < rows; row++) {
+      const float *chunk = &samples[row * sample_stride + idx];
+      acc0 = _mm256_add_ps(acc0, _mm256_maskload_ps(&chunk[0], mask0));
+      acc1 = _mm256_add_ps(acc1, _mm256_maskload_ps(&chunk[8], mask1));
+      acc2 = _mm256_add_ps(acc2, _mm256_maskload_ps(&chunk[16], mask2));
+    }
+    float lanes[24];
+    _mm256_storeu_ps(&lanes[0], acc0);
+    _mm256_storeu_ps(&lanes[8], acc1);
+    _mm256_storeu_ps(&lanes[16], acc2);
+    reduce_lanes(lanes, 24, sums);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+sharpen_grayscale_avx2(SharpenSpan *span, size_t count, float threshold,
+                       float sharpen_factor) {
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 limit = _mm256_set1_ps(threshold);
+  const __m256 factor = _mm256_set1_ps(sharpen_factor);
+  const __m256 luma_r = _mm256_set1_ps(0.299f),
+               luma_g = _mm256_set1_ps(0.587f),
+               luma_b = _mm256_set1_ps(0.114f);
+  size_t idx = 0;
+  for (; idx + 8 <= count; idx += 8) {
+    __m256 red = _mm256_loadu_ps(&span->red[idx]);
+    __m256 green = _mm256_loadu_ps(&span->green[idx]);
+    __m256 blue = _mm256_loadu_ps(&span->blue[idx]);
+    __m256 blur_red = _mm256_loadu_ps(&span->blur_red[idx]);
+    __m256 blur_green = _mm256_loadu_ps(&span->blur_green[idx]);
+    __m256 blur_blue = _mm256_loadu_ps(&span->blur_blue[idx]);
+    __m256 is_dark = _mm256_cmp_ps(red, limit, _CMP_LE_OQ);
+    __m256 new_red =
+        _mm256_add_ps(red, _mm256_mul_ps(factor, _mm256_sub_ps(red, blur_red)));
+    __m256 new_green = _mm256_add_ps(
+        green, _mm256_mul_ps(factor, _mm256_sub_ps(green, blur_green)));
+    __m256 new_blue = _mm256_add_ps(
+        blue, _mm256_mul_ps(factor, _mm256_sub_ps(blue, blur_blue)));
+    new_red = _mm256_min_ps(_mm256_max_ps(new_red, zero), one);
+    new_green = _mm256_min_ps(_mm256_max_ps(new_green, zero), one);
+    new_blue = _mm256_min_ps(_mm256_max_ps(new_blue, zero), one);
+    new_red = _mm256_blendv_ps(new_red, blur_red, is_dark);
+    new_green = _mm256_blendv_ps(new_green, blur_green, is_dark);
+    new_blue = _mm256_blendv_ps(new_blue, blur_blue, is_dark);
+    __m256 luma =
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(luma_r, new_red),
+                                    _mm256_mul_ps(luma_g, new_green)),
+                      _mm256_mul_ps(luma_b, new_blue));
+    _mm256_storeu_ps(&span->luma[idx], luma);
+  }
+  sharpen_grayscale_range(span, idx, count, threshold, sharpen_factor);
+}
+
+__attribute__((target("avx2"))) static void
+compare_samples_avx2(const float *a, const float *b, size_t count,
+                     float limit, SampleDiff *diff) {
+  const __m256 sign = _mm256_set1_ps(-0.0f), bound = _mm256_set1_ps(limit);
+  __m256 max_abs = _mm256_setzero_ps(), squares = _mm256_setzero_ps();
+  __m256i over = _mm256_setzero_si256();
+  size_t idx = 0;
+  for (; idx + 8 <= count; idx += 8) {
+    __m256 abs_diff = _mm256_andnot_ps(
+        sign,
+        _mm256_sub_ps(_mm256_loadu_ps(&a[idx]), _mm256_loadu_ps(&b[idx])));
+    max_abs = _mm256_max_ps(max_abs, abs_diff);
+    squares = _mm256_add_ps(squares, _mm256_mul_ps(abs_diff, abs_diff));
+    over = _mm256_sub_epi32(
+        over,
+        _mm256_castps_si256(_mm256_cmp_ps(abs_diff, bound, _CMP_GT_OQ)));
+  }
+  float max_lanes[8], square_lanes[8];
+  int over_lanes[8];
+  _mm256_storeu_ps(max_lanes, max_abs);
+  _mm256_storeu_ps(square_lanes, squares);
+  _mm256_storeu_si256((__m256i *)over_lanes, over);
+  *diff = (SampleDiff){.max_abs = 0.0f, .sum_squares = 0.0f, .over_limit = 0};
+  for (int lane = 0; lane < 8; lane++) {
+    if (max_lanes[lane] > diff->max_abs)
+      diff->max_abs = max_lanes[lane];
+    diff->sum_squares += square_lanes[lane];
+    diff->over_limit += (size_t)over_lanes[lane];
+  }
+  compare_samples_range(a, b, idx, count, limit, diff);
+}
+
+// Same as `sum_plane_u8_sse42`, 32 bytes at a time
+__attribute__((target("avx2"))) static uint64_t
+sum_plane_u8_avx2(const uint8_t *first, size_t stride, size_t rows,
+                  size_t count) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  uint64_t tail_sum = 0;
+  for (size_t row = 0; row < rows; row++) {
+    const uint8_t *samples = &first[row * stride];
+    size_t idx = 0;
+    for (; idx + 32 <= count; idx += 32)
+      acc = _mm256_add_epi64(
+          acc,
+          _mm256_sad_epu8(
+              _mm256_loadu_si256((const __m256i *)&samples[idx]), zero));
+    if (idx + 16 <= count) {
+      acc = _mm256_add_epi64(
+          acc, _mm256_zextsi128_si256(_mm_sad_epu8(
+                   _mm_loadu_si128((const __m128i *)&samples[idx]),
+                   _mm_setzero_si128())));
+      idx += 16;
+    }
+    if (idx + 8 <= count) {
+      acc = _mm256_add_epi64(
+          acc, _mm256_zextsi128_si256(_mm_sad_epu8(
+                   _mm_loadl_epi64((const __m128i *)&samples[idx]),
+                   _mm_setzero_si128())));
+      idx += 8;
+    }
+    for (; idx < count; idx++)
+      tail_sum += samples[idx];
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail_sum;
+}
+
+// Same as `sum_plane_u16_sse42`, 16 samples at a time
+__attribute__((target("avx2"))) static uint64_t
+sum_plane_u16_avx2(const uint16_t *first, size_t stride, size_t rows,
+                   size_t count) {
+  __m256i acc = _mm256_setzero_si256();
+  uint64_t tail_sum = 0;
+  for (size_t row = 0; row < rows; row++) {
+    const uint16_t *samples = &first[row * stride];
+    __m256i row_acc = _mm256_setzero_si256();
+    size_t idx = 0;
+    for (; idx + 16 <= count; idx += 16) {
+      row_acc = _mm256_add_epi32(
+          row_acc, _mm256_cvtepu16_epi32(
+                       _mm_loadu_si128((const __m128i *)&samples[idx])));
+      row_acc = _mm256_add_epi32(
+          row_acc, _mm256_cvtepu16_epi32(
+                       _mm_loadu_si128((const __m128i *)&samples[idx + 8])));
+    }
+    if (idx + 8 <= count) {
+      row_acc = _mm256_add_epi32(
+          row_acc, _mm256_cvtepu16_epi32(
+                       _mm_loadu_si128((const __m128i *)&samples[idx])));
+      idx += 8;
+    }
+    acc = _mm256_add_epi64(
+        acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(row_acc)));
+    acc = _mm256_add_epi64(
+        acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(row_acc, 1)));
+    for (; idx < count; idx++)
+      tail_sum += samples[idx];
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail_sum;
+}
+
+// AVX-512 SECTION
+
+static inline __mmask16 tail_mask_avx512(long remaining) {
+  if (remaining >= 16)
+    return (__mmask16)0xFFFF;
+  if (remaining <= 0)
+    return (__mmask16)0;
+  return (__mmask16)((1u << remaining) - 1u);
+}
+
+__attribute__((target("avx512f"))) static void
+sum_rows_avx512(const RgbTriplet *first, size_t stride, size_t rows,
+                size_t count, float sums[3]) {
+  const float *samples = (const float *)first;
+  size_t sample_count = count * 3, sample_stride = stride * 3;
+  sums[0] = sums[1] = sums[2] = 0.0f;
+  for (size_t idx = 0; idx < sample_count; idx += 48) {
+    long remaining = (long)(sample_count - idx);
+    __mmask16 mask0 = tail_mask_avx512(remaining);
+    __mmask16 mask1 = tail_mask_avx512(remaining - 16);
+    __mmask16 mask2 = tail_mask_avx512(remaining - 32);
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(),
+           acc2 = _mm512_setzero_ps();
+    for (size_t row = 0; row < rows; row++) {
+      const float *chunk = &samples[row * sample_stride + idx];
+      acc0 = _mm512_add_ps(acc0, _mm512_maskz_loadu_ps(mask0, &chunk[0]));
+      acc1 = _mm512_add_ps(acc1, _mm512_maskz_loadu_ps(mask1, &chunk[16]));
+      acc2 = _mm512_add_ps(acc2, _mm512_maskz_loadu_ps(mask2, &chunk[32]));
+    }
+    float lanes[48];
+    _mm512_storeu_ps(&lanes[0], acc0);
+    _mm512_storeu_ps(&lanes[16], acc1);
+    _mm512_storeu_ps(&lanes[32], acc2);
+    reduce_lanes(lanes, 48, sums);
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+sharpen_grayscale_avx512(SharpenSpan *span, size_t count, float threshold,
+                         float sharpen_factor) {
+  const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+  const __m512 limit = _mm512_set1_ps(threshold);
+  const __m512 factor = _mm512_set1_ps(sharpen_factor);
+  const __m512 luma_r = _mm512_set1_ps(0.299f),
+               luma_g = _mm512_set1_ps(0.587f),
+               luma_b = _mm512_set1_ps(0.114f);
+  size_t idx = 0;
+  for (; idx + 16 <= count; idx += 16) {
+    __m512 red = _mm512_loadu_ps(&span->red[idx]);
+    __m512 green = _mm512_loadu_ps(&span->green[idx]);
+    __m512 blue = _mm512_loadu_ps(&span->blue[idx]);
+    __m512 blur_red = _mm512_loadu_ps(&span->blur_red[idx]);
+    __m512 blur_green = _mm512_loadu_ps(&span->blur_green[idx]);
+    __m512 blur_blue = _mm512_loadu_ps(&span->blur_blue[idx]);
+    __mmask16 is_dark = _mm512_cmp_ps_mask(red, limit, _CMP_LE_OQ);
+    __m512 new_red =
+        _mm512_add_ps(red, _mm512_mul_ps(factor, _mm512_sub_ps(red, blur_red)));
+    __m512 new_green = _mm512_add_ps(
+        green, _mm512_mul_ps(factor, _mm512_sub_ps(green, blur_green)));
+    __m512 new_blue = _mm512_add_ps(
+        blue, _mm512_mul_ps(factor, _mm512_sub_ps(blue, blur_blue)));
+    new_red = _mm512_min_ps(_mm512_max_ps(new_red, zero), one);
+    new_green = _mm512_min_ps(_mm512_max_ps(new_green, zero), one);
+    new_blue = _mm512_min_ps(_mm512_max_ps(new_blue, zero), one);
+    new_red = _mm512_mask_blend_ps(is_dark, new_red, blur_red);
+    new_green = _mm512_mask_blend_ps(is_dark, new_green, blur_green);
+    new_blue = _mm512_mask_blend_ps(is_dark, new_blue, blur_blue);
+    __m512 luma =
+        _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(luma_r, new_red),
+                                    _mm512_mul_ps(luma_g, new_green)),
+                      _mm512_mul_ps(luma_b, new_blue));
+    _mm512_storeu_ps(&span->luma[idx], luma);
+  }
+  sharpen_grayscale_range(span, idx, count, threshold, sharpen_factor);
+}
+
+__attribute__((target("avx512f"))) static void
+compare_samples_avx512(const float *a, const float *b, size_t count,
+                       float limit, SampleDiff *diff) {
+  const __m512 bound = _mm512_set1_ps(limit);
+  __m512 max_abs = _mm512_setzero_ps(), squares = _mm512_setzero_ps();
+  size_t over_limit = 0;
+  for (size_t idx = 0; idx < count; idx += 16) {
+    // Masked-off lanes load zeros on both sides, adding nothing
+    __mmask16 mask = tail_mask_avx512((long)(count - idx));
+    __m512 abs_diff = _mm512_abs_ps(_mm512_sub_ps(
+        _mm512_maskz_loadu_ps(mask, &a[idx]),
+        _mm512_maskz_loadu_ps(mask, &b[idx])));
+    max_abs = _mm512_max_ps(max_abs, abs_diff);
+    squares = _mm512_add_ps(squares, _mm512_mul_ps(abs_diff, abs_diff));
+    over_limit += (size_t)__builtin_popcount(
+        _mm512_cmp_ps_mask(abs_diff, bound, _CMP_GT_OQ));
+  }
+  *diff = (SampleDiff){.max_abs = _mm512_reduce_max_ps(max_abs),
+                       .sum_squares = _mm512_reduce_add_ps(squares),
+                       .over_limit = over_limit};
+}
+
+#endif // SIMD_X86
+
+// DISPATCH SECTION
+
+static const char *simd_level_names[] = {"scalar", "sse4.2", "avx2",
+                                         "avx512"};
+
+const char *simd_level_name(SimdLevel level) {
+  if (level > SIMD_LEVEL_AVX512)
+    return "unknown";
+  return simd_level_names[level];
+}
+
+static SimdLevel detect_simd_level(void) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SIMD_LEVEL_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_LEVEL_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return SIMD_LEVEL_SSE42;
+#endif
+  return SIMD_LEVEL_SCALAR;
+}
+
+static SimdKernels resolved_kernels;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void resolve_simd_kernels(void) {
+  SimdLevel level = detect_simd_level();
+  const char *forced = getenv(SIMD_LEVEL_VARIABLE);
+  if (forced != NULL) {
+    SimdLevel forced_level = level;
+    int is_known = 0;
+    for (int idx = SIMD_LEVEL_SCALAR; idx <= SIMD_LEVEL_AVX512; idx++)
+      if (strcmp(forced, simd_level_names[idx]) == 0) {
+        forced_level = (SimdLevel)idx;
+        is_known = 1;
+      }
+    if (!is_known)
+      fprintf(stderr, "Unknown %s level `%s`, keeping %s\n",
+              SIMD_LEVEL_VARIABLE, forced, simd_level_name(level));
+    else if (forced_level > level)
+      fprintf(stderr, "CPU lacks %s, keeping %s\n",
+              simd_level_name(forced_level), simd_level_name(level));
+    else
+      level = forced_level;
+  }
+  resolved_kernels = (SimdKernels){.level = SIMD_LEVEL_SCALAR,
+                                   .sum_rows = sum_rows_scalar,
+                                   .sharpen_grayscale =
+                                       sharpen_grayscale_scalar,
+                                   .compare_samples = compare_samples_scalar,
+                                   .sum_plane_u8 = sum_plane_u8_scalar,
+                                   .sum_plane_u16 = sum_plane_u16_scalar};
+#ifdef SIMD_X86
+  switch (level) {
+  case SIMD_LEVEL_AVX512:
+    resolved_kernels = (SimdKernels){.level = level,
+                                     .sum_rows = sum_rows_avx512,
+                                     .sharpen_grayscale =
+                                         sharpen_grayscale_avx512,
+                                     .compare_samples =
+                                         compare_samples_avx512,
+                                     .sum_plane_u8 = sum_plane_u8_avx2,
+                                     .sum_plane_u16 = sum_plane_u16_avx2};
+    break;
+  case SIMD_LEVEL_AVX2:
+    resolved_kernels = (SimdKernels){.level = level,
+                                     .sum_rows = sum_rows_avx2,
+                                     .sharpen_grayscale =
+                                         sharpen_grayscale_avx2,
+                                     .compare_samples = compare_samples_avx2,
+                                     .sum_plane_u8 = sum_plane_u8_avx2,
+                                     .sum_plane_u16 = sum_plane_u16_avx2};
+    break;
+  case SIMD_LEVEL_SSE42:
+    resolved_kernels = (SimdKernels){.level = level,
+                                     .sum_rows = sum_rows_sse42,
+                                     .sharpen_grayscale =
+                                         sharpen_grayscale_sse42,
+                                     .compare_samples =
+                                         compare_samples_sse42,
+                                     .sum_plane_u8 = sum_plane_u8_sse42,
+                                     .sum_plane_u16 = sum_plane_u16_sse42};
+    break;
+  case SIMD_LEVEL_SCALAR:
+    break;
+  }
+#endif
+}
+
+const SimdKernels *simd_kernels(void) {
+  pthread_once(&resolve_once, resolve_simd_kernels);
+  return &resolved_kernels;
+}
+
+// WINDOW SECTION
+
+// Interleaved rows are caller-owned and seldom filtered by the window engine,
+// so they are summed without vectors
+static void sum_interleaved_rect(PpmImage *image, size_t x, size_t count,
+                                 size_t y, size_t rows, uint64_t sums[3]) {
+  sums[0] = sums[1] = sums[2] = 0;
+  for (size_t row = y; row < y + rows; row++) {
+    const uint8_t *bytes = &image->planes_read[row * image->row_stride_read];
+    for (size_t idx = x * 3; idx < (x + count) * 3; idx += 3)
+      for (size_t channel = 0; channel < 3; channel++)
+        sums[channel] += (image->max_value > UINT8_MAX)
+                             ? ((const uint16_t *)bytes)[idx + channel]
+                             : bytes[idx + channel];
+  }
+}
+
+// Per-channel sums of the rectangle [x, x + count) x [y, y + rows), normalised
+// like the triplets for every storage
+static void sum_rect(PpmImage *image, const SimdKernels *kernels, size_t x,
+                     size_t count, size_t y, size_t rows, float sums[3]) {
+  size_t width = image->width;
+  if (image->storage == PPM_STORAGE_TRIPLETS) {
+    kernels->sum_rows(&image->color_values_read[y * width + x], width, rows,
+                      count, sums);
+    return;
+  }
+  uint64_t raw_sums[3];
+  if (image->storage == PPM_STORAGE_PLANAR) {
+    size_t plane_size = width * image->height;
+    for (size_t channel = 0; channel < 3; channel++) {
+      size_t offset = channel * plane_size + y * width + x;
+      const uint16_t *wide_samples = (const uint16_t *)image->planes_read;
+      raw_sums[channel] =
+          (image->max_value > UINT8_MAX)
+              ? kernels->sum_plane_u16(&wide_samples[offset], width, rows,
+                                       count)
+              : kernels->sum_plane_u8(&image->planes_read[offset], width,
+                                      rows, count);
+    }
+  } else {
+    sum_interleaved_rect(image, x, count, y, rows, raw_sums);
+  }
+  float scale = 1.0f / (float)image->max_value;
+  for (size_t channel = 0; channel < 3; channel++)
+    sums[channel] = (float)raw_sums[channel] * scale;
+}
+
+// Sums of the columns [x, x + count) over the rows [y_begin, y_end], adding
+// the first and last image rows again for the neighbours clamped onto them
+static void sum_clamped_rows(PpmImage *image, const SimdKernels *kernels,
+                             size_t x, size_t count, size_t y_begin,
+                             size_t y_end, float top_weight,
+                             float bottom_weight, float sums[3]) {
+  float edge_sums[3];
+  sum_rect(image, kernels, x, count, y_begin, y_end - y_begin + 1, sums);
+  if (top_weight > 0.0f) {
+    sum_rect(image, kernels, x, count, 0, 1, edge_sums);
+    for (int channel = 0; channel < 3; channel++)
+      sums[channel] += top_weight * edge_sums[channel];
+  }
+  if (bottom_weight > 0.0f) {
+    sum_rect(image, kernels, x, count, image->height - 1, 1, edge_sums);
+    for (int channel = 0; channel < 3; channel++)
+      sums[channel] += bottom_weight * edge_sums[channel];
+  }
+}
+
+// Clamp-to-edge repeats the first/last column (row) for every neighbour that
+// fell off the image, so the window is an in-bounds rectangle plus the edge
+// rows and columns weighted by how many neighbours they stand in for
+int sum_window_simd(PpmImage *image, size_t x, size_t y, size_t radius,
+                    float sums[3]) {
+  if (image == NULL || sums == NULL)
+    return 0;
+  if (x >= image->width || y >= image->height)
+    return 0;
+  const SimdKernels *kernels = simd_kernels();
+  size_t last_x = image->width - 1, last_y = image->height - 1;
+  size_t x_begin = (x < radius) ? 0 : x - radius;
+  size_t x_end = (x + radius > last_x) ? last_x : x + radius;
+  size_t y_begin = (y < radius) ? 0 : y - radius;
+  size_t y_end = (y + radius > last_y) ? last_y : y + radius;
+  float left_weight = (x < radius) ? (float)(radius - x) : 0.0f;
+  float right_weight =
+      (x + radius > last_x) ? (float)(x + radius - last_x) : 0.0f;
+  float top_weight = (y < radius) ? (float)(radius - y) : 0.0f;
+  float bottom_weight =
+      (y + radius > last_y) ? (float)(y + radius - last_y) : 0.0f;
+  float edge_sums[3];
+  sum_clamped_rows(image, kernels, x_begin, x_end - x_begin + 1, y_begin,
+                   y_end, top_weight, bottom_weight, sums);
+  if (left_weight > 0.0f) {
+    sum_clamped_rows(image, kernels, 0, 1, y_begin, y_end, top_weight,
+                     bottom_weight, edge_sums);
+    for (int channel = 0; channel < 3; channel++)
+      sums[channel] += left_weight * edge_sums[channel];
+  }
+  if (right_weight > 0.0f) {
+    sum_clamped_rows(image, kernels, last_x, 1, y_begin, y_end, top_weight,
+                     bottom_weight, edge_sums);
+    for (int channel = 0; channel < 3; channel++)
+      sums[channel] += right_weight * edge_sums[channel];
+  }
+  return 1;
+}
@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SIMD_HEADER
+#define SIMD_HEADER
+
+#include "ppm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Environment variable that forces a level (`scalar`, `sse4.2`, `avx2` or
+// `avx512`) instead of the best one reported by CPUID
+#define SIMD_LEVEL_VARIABLE "PP_EP2_SIMD"
+
+typedef enum simd_level {
+  SIMD_LEVEL_SCALAR,
+  SIMD_LEVEL_SSE42,
+  SIMD_LEVEL_AVX2,
+  SIMD_LEVEL_AVX512,
+} SimdLevel;
+
+// Pixels sharpened per kernel call, laid out as structure-of-arrays so every
+// channel is a contiguous stream
+#define SIMD_SPAN 256
+
+typedef struct sharpen_span {
+  float red[SIMD_SPAN], green[SIMD_SPAN], blue[SIMD_SPAN];
+  float blur_red[SIMD_SPAN], blur_green[SIMD_SPAN], blur_blue[SIMD_SPAN];
+  float luma[SIMD_SPAN];
+} SharpenSpan;
+
+// Differences between two runs of samples
+typedef struct sample_diff {
+  float max_abs, sum_squares;
+  size_t over_limit;
+} SampleDiff;
+
+typedef struct simd_kernels {
+  SimdLevel level;
+  // Per-channel sums of `count` consecutive triplets on each of `rows` rows,
+  // `stride` triplets apart
+  void (*sum_rows)(const RgbTriplet *first, size_t stride, size_t rows,
+                   size_t count, float sums[3]);
+  // Blur below the threshold, clamped sharpen above it, then luma
+  void (*sharpen_grayscale)(SharpenSpan *span, size_t count, float threshold,
+                            float sharpen_factor);
+  // Largest absolute difference, sum of the squared ones and how many are
+  // above `limit`, over `count` samples of `a` and `b`
+  void (*compare_samples)(const float *a, const float *b, size_t count,
+                          float limit, SampleDiff *diff);
+  // Sums of `count` consecutive raw samples of a plane on each of `rows`
+  // rows, `stride` samples apart
+  uint64_t (*sum_plane_u8)(const uint8_t *first, size_t stride, size_t rows,
+                           size_t count);
+  uint64_t (*sum_plane_u16)(const uint16_t *first, size_t stride, size_t rows,
+                            size_t count);
+} SimdKernels;
+
+const SimdKernels *simd_kernels(void);
+const char *simd_level_name(SimdLevel level);
+int sum_window_simd(PpmImage *image, size_t x, size_t y, size_t radius,
+                    float sums[3]);
+
+#endif // SIMD_HEADER
@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "stream.h"
+#include "filter.h"
+#include "ppm.h"
+#include <stddef.h>
+#include <stdio.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+static inline size_t min_rows(size_t a, size_t b) { return (a < b) ? a : b; }
+
+int stream_ppm_image(FILE *source_file, FILE *output_file,
+                     BatchSettings *settings) {
+  int result = 0;
+  PpmImage *window = NULL;
+  // Shared by every band, so the summed-area table is allocated once
+  FilterScratch scratch = {.table = NULL, .work = NULL, .work_capacity = 0};
+  PpmStream stream;
+  ASSERT(open_ppm_stream(&stream, source_file), "Error opening the PPM stream",
+         stream_ppm_image_exit);
+  ASSERT(write_ppm_header(output_file, settings->output_format, stream.width,
+                          stream.height, stream.max_value),
+         "Error writing PPM image header", stream_ppm_image_exit);
+  size_t m = settings->m;
+  size_t band_rows = (2 * m + 1 > STREAM_BAND_ROWS) ? 2 * m + 1
+                                                    : STREAM_BAND_ROWS;
+  window = alloc_ppm_window(&stream, band_rows + 2 * m, settings->storage);
+  ASSERT(window != NULL, "Error allocating the PPM window",
+         stream_ppm_image_exit);
+  // Image row held by the first row of the window. Every band is surrounded
+  // by `m` rows of context, except where it meets the edges of the image, so
+  // clamping to the window is the same as clamping to the whole image.
+  size_t window_row = 0;
+  ASSERT(slide_ppm_window(&stream, window, 0,
+                          min_rows(band_rows + m, stream.height)),
+         "Error reading the first PPM band", stream_ppm_image_exit);
+  for (size_t band_begin = 0; band_begin < stream.height;
+       band_begin += band_rows) {
+    size_t band_end = min_rows(band_begin + band_rows, stream.height);
+    ASSERT(filter_rows_ppm_image(window, settings->threshold,
+                                 settings->sharpen_factor, m,
+                                 settings->thread_count,
+                                 settings->blur_engine, settings->tile_size,
+                                 band_begin - window_row,
+                                 band_end - window_row, &scratch),
+           "Error applying the filter to a PPM band", stream_ppm_image_exit);
+    // The sharpened rows are written straight from the write buffer, through
+    // a view that reads from it
+    PpmImage sharpened = *window;
+    sharpened.color_values_read = window->color_values_write;
+    sharpened.planes_read = window->planes_write;
+    ASSERT(write_rows_ppm_image(&sharpened, output_file,
+                                settings->output_format,
+                                band_begin - window_row, band_end - window_row,
+                                settings->thread_count),
+           "Error writing a PPM band", stream_ppm_image_exit);
+    if (band_end == stream.height)
+      break;
+    size_t next_row = (band_end > m) ? band_end - m : 0;
+    size_t last_row = min_rows(band_end + band_rows + m, stream.height);
+    ASSERT(slide_ppm_window(&stream, window, next_row - window_row,
+                            last_row - stream.next_row),
+           "Error reading the next PPM band", stream_ppm_image_exit);
+    window_row = next_row;
+  }
+  ASSERT(write_ppm_trailer(output_file, settings->output_format),
+         "Error writing PPM image trailer", stream_ppm_image_exit);
+  result = 1;
+stream_ppm_image_exit:
+  free_filter_scratch(&scratch);
+  free_ppm_image(&window);
+  return result;
+}
@@ -0,0 +1,21 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef STREAM_HEADER
+#define STREAM_HEADER
+
+#include "batch.h"
+#include <stdio.h>
+
+// Rows sharpened per band, unless the blur needs taller ones
+#define STREAM_BAND_ROWS 64
+
+// Filters the image of `source_file` into `output_file` one band of rows at
+// a time, holding only the band and its `m` rows of blur context on each
+// side, so memory no longer grows with the image height. The output is the
+// same as with `filter_ppm_image` and the usual `settings`.
+int stream_ppm_image(FILE *source_file, FILE *output_file,
+                     BatchSettings *settings);
+
+#endif // STREAM_HEADER
@@ -0,0 +1,240 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "summed_area.h"
+#include "arena.h"
+#include "ppm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+// Zeroes the first row and column for the new rows; every other sum is
+// written by the passes, and these never are
+static void resize_summed_area_table(SummedAreaTable *table, size_t width,
+                                     size_t height, size_t row_begin,
+                                     size_t row_end) {
+  table->width = width;
+  table->height = height;
+  table->row_begin = row_begin;
+  table->row_end = row_end;
+  size_t stride = width + 1;
+  for (size_t x = 0; x < stride; x++)
+    table->sums[x] = (SummedRgb){.r = 0.0, .g = 0.0, .b = 0.0};
+  for (size_t y = 1; y <= row_end - row_begin; y++)
+    table->sums[y * stride] = (SummedRgb){.r = 0.0, .g = 0.0, .b = 0.0};
+}
+
+static SummedAreaTable *alloc_rows_summed_area_table(size_t width,
+                                                     size_t height,
+                                                     size_t row_begin,
+                                                     size_t row_end) {
+  SummedAreaTable *table = malloc(sizeof(SummedAreaTable));
+  ASSERT(table != NULL, "Could not allocate the summed-area table",
+         alloc_summed_area_table_error);
+  table->capacity = (width + 1) * (row_end - row_begin + 1);
+  table->sums = alloc_arena(table->capacity * sizeof(SummedRgb));
+  ASSERT(table->sums != NULL, "Could not allocate the summed-area table sums",
+         alloc_summed_area_table_error);
+  resize_summed_area_table(table, width, height, row_begin, row_end);
+  return table;
+alloc_summed_area_table_error:
+  free_summed_area_table(&table);
+  return NULL;
+}
+
+SummedAreaTable *alloc_summed_area_table(size_t width, size_t height) {
+  return alloc_rows_summed_area_table(width, height, 0, height);
+}
+
+static int reserve_rows_summed_area_table(SummedAreaTable **table,
+                                          size_t width, size_t height,
+                                          size_t row_begin, size_t row_end) {
+  ASSERT(table != NULL, "Summed-area table is NULL",
+         reserve_summed_area_table_error);
+  size_t size = (width + 1) * (row_end - row_begin + 1);
+  if (*table == NULL || (*table)->capacity < size) {
+    free_summed_area_table(table);
+    *table = alloc_rows_summed_area_table(width, height, row_begin, row_end);
+    return *table != NULL;
+  }
+  resize_summed_area_table(*table, width, height, row_begin, row_end);
+  return 1;
+reserve_summed_area_table_error:
+  return 0;
+}
+
+int reserve_summed_area_table(SummedAreaTable **table, size_t width,
+                              size_t height) {
+  return reserve_rows_summed_area_table(table, width, height, 0, height);
+}
+
+int reserve_band_summed_area_table(SummedAreaTable **table, PpmImage *image,
+                                   size_t m, size_t row_begin,
+                                   size_t row_end) {
+  ASSERT(image != NULL, "PPM image is NULL", reserve_band_error);
+  ASSERT(row_begin <= row_end && row_end <= image->height,
+         "Error reserving out of bounds rows of the summed-area table",
+         reserve_band_error);
+  // Radii range from 1 to `m`, see `r_pixel`
+  size_t band_begin = (row_begin > m) ? row_begin - m : 0;
+  size_t band_end =
+      (image->height - row_end > m) ? row_end + m : image->height;
+  return reserve_rows_summed_area_table(table, image->width, image->height,
+                                        band_begin, band_end);
+reserve_band_error:
+  return 0;
+}
+
+int sum_rows_summed_area_table(SummedAreaTable *table, PpmImage *image,
+                               size_t row_begin, size_t row_end) {
+  ASSERT(table != NULL, "Summed-area table is NULL",
+         sum_rows_summed_area_table_error);
+  ASSERT(image != NULL, "PPM image is NULL", sum_rows_summed_area_table_error);
+  ASSERT(image->storage != PPM_STORAGE_TRIPLETS ||
+             image->color_values_read != NULL,
+         "PPM image read buffer is NULL", sum_rows_summed_area_table_error);
+  ASSERT(table->width == image->width && table->height == image->height,
+         "Summed-area table and PPM image dimensions differ",
+         sum_rows_summed_area_table_error);
+  ASSERT(row_begin <= row_end && row_begin >= table->row_begin &&
+             row_end <= table->row_end,
+         "Error summing out of bounds rows of the summed-area table",
+         sum_rows_summed_area_table_error);
+  size_t stride = table->width + 1;
+  for (size_t y = row_begin; y < row_end; y++) {
+    SummedRgb *sums = &table->sums[(y - table->row_begin + 1) * stride + 1];
+    SummedRgb running = (SummedRgb){.r = 0.0, .g = 0.0, .b = 0.0};
+    for (size_t x = 0; x < table->width; x++) {
+      RgbTriplet rgb;
+      // Raw samples are only reachable through the converting accessor
+      if (image->storage != PPM_STORAGE_TRIPLETS) {
+        ASSERT(read_at_idx_ppm_image(image, x + y * image->width, &rgb),
+               "Error reading PPM image at index",
+               sum_rows_summed_area_table_error);
+      } else {
+        rgb = image->color_values_read[x + y * image->width];
+      }
+      running.r += (double)rgb.r;
+      running.g += (double)rgb.g;
+      running.b += (double)rgb.b;
+      sums[x] = running;
+    }
+  }
+  return 1;
+sum_rows_summed_area_table_error:
+  return 0;
+}
+
+// Must only run after every row was summed by `sum_rows_summed_area_table`
+int sum_columns_summed_area_table(SummedAreaTable *table, size_t column_begin,
+                                  size_t column_end) {
+  ASSERT(table != NULL, "Summed-area table is NULL",
+         sum_columns_summed_area_table_error);
+  ASSERT(column_begin <= column_end && column_end <= table->width,
+         "Error summing out of bounds columns of the summed-area table",
+         sum_columns_summed_area_table_error);
+  size_t stride = table->width + 1;
+  // Walks row by row inside the column range to keep the accesses contiguous
+  for (size_t y = 2; y <= table->row_end - table->row_begin; y++) {
+    SummedRgb *above = &table->sums[(y - 1) * stride + 1];
+    SummedRgb *sums = &table->sums[y * stride + 1];
+    for (size_t x = column_begin; x < column_end; x++) {
+      sums[x].r += above[x].r;
+      sums[x].g += above[x].g;
+      sums[x].b += above[x].b;
+    }
+  }
+  return 1;
+sum_columns_summed_area_table_error:
+  return 0;
+}
+
+// Sum of the inclusive rectangle [x_begin, x_end] x [y_begin, y_end], whose
+// rows must have been summed
+static SummedRgb rectangle_sum(SummedAreaTable *table, size_t x_begin,
+                               size_t x_end, size_t y_begin, size_t y_end) {
+  size_t stride = table->width + 1;
+  y_begin -= table->row_begin;
+  y_end -= table->row_begin;
+  SummedRgb a = table->sums[x_begin + y_begin * stride];
+  SummedRgb b = table->sums[(x_end + 1) + y_begin * stride];
+  SummedRgb c = table->sums[x_begin + (y_end + 1) * stride];
+  SummedRgb d = table->sums[(x_end + 1) + (y_end + 1) * stride];
+  return (SummedRgb){.r = d.r - b.r - c.r + a.r,
+                     .g = d.g - b.g - c.g + a.g,
+                     .b = d.b - b.b - c.b + a.b};
+}
+
+int blur_at_summed_area_table(SummedAreaTable *table, size_t x, size_t y,
+                              size_t radius, RgbTriplet *rgb) {
+  if (table == NULL || rgb == NULL)
+    return 0;
+  if (x >= table->width || y >= table->height)
+    return 0;
+  // Clamp-to-edge repeats the border pixels, which is the same as giving the
+  // first/last column (row) an extra weight for every neighbour that fell off
+  // the image. Each axis is thus split in up to three weighted spans.
+  size_t x_begin[3], x_end[3], y_begin[3], y_end[3];
+  double x_weight[3], y_weight[3];
+  size_t x_spans = 0, y_spans = 0;
+  size_t last_x = table->width - 1, last_y = table->height - 1;
+  x_begin[x_spans] = (x < radius) ? 0 : x - radius;
+  x_end[x_spans] = (x + radius > last_x) ? last_x : x + radius;
+  x_weight[x_spans++] = 1.0;
+  if (x < radius) {
+    x_begin[x_spans] = x_end[x_spans] = 0;
+    x_weight[x_spans++] = (double)(radius - x);
+  }
+  if (x + radius > last_x) {
+    x_begin[x_spans] = x_end[x_spans] = last_x;
+    x_weight[x_spans++] = (double)(x + radius - last_x);
+  }
+  y_begin[y_spans] = (y < radius) ? 0 : y - radius;
+  y_end[y_spans] = (y + radius > last_y) ? last_y : y + radius;
+  y_weight[y_spans++] = 1.0;
+  // The edge rows are only needed when the window reaches them
+  if (y_begin[0] < table->row_begin || y_end[0] >= table->row_end)
+    return 0;
+  if (y < radius) {
+    y_begin[y_spans] = y_end[y_spans] = 0;
+    y_weight[y_spans++] = (double)(radius - y);
+  }
+  if (y + radius > last_y) {
+    y_begin[y_spans] = y_end[y_spans] = last_y;
+    y_weight[y_spans++] = (double)(y + radius - last_y);
+  }
+  double sum_r = 0.0, sum_g = 0.0, sum_b = 0.0;
+  for (size_t i = 0; i < x_spans; i++) {
+    for (size_t j = 0; j < y_spans; j++) {
+      SummedRgb sum =
+          rectangle_sum(table, x_begin[i], x_end[i], y_begin[j], y_end[j]);
+      double weight = x_weight[i] * y_weight[j];
+      sum_r += weight * sum.r;
+      sum_g += weight * sum.g;
+      sum_b += weight * sum.b;
+    }
+  }
+  double n = (double)((1 + radius * 2) * (1 + radius * 2));
+  *rgb = (RgbTriplet){.r = (float)(sum_r / n),
+                      .g = (float)(sum_g / n),
+                      .b = (float)(sum_b / n)};
+  return 1;
+}
+
+void free_summed_area_table(SummedAreaTable **table) {
+  if (table == NULL || *table == NULL)
+    return;
+  if ((*table)->sums) {
+    free_arena((*table)->sums);
+    (*table)->sums = NULL;
+  }
+  free(*table);
+  *table = NULL;
+}
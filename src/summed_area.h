@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SUMMED_AREA_HEADER
+#define SUMMED_AREA_HEADER
+
+#include "ppm.h"
+#include <stddef.h>
+
+// Sums are kept in double precision so that 50+ MP images don't lose the
+// low-order bits of the per-channel running totals
+typedef struct summed_rgb {
+  double r, g, b;
+} SummedRgb;
+
+// Integral image with an extra zeroed row and column at the top-left, so
+// `sums[x + (y - row_begin) * (width + 1)]` holds the sum of every pixel of
+// the rows [row_begin, y) to the left of x. Only the image rows
+// [row_begin, row_end) are summed, which is enough to blur the rows at least
+// the radius away from both ends of that range (or from the image borders).
+typedef struct summed_area_table {
+  // Dimensions of the whole image, which the blur clamps to
+  size_t width, height;
+  size_t row_begin, row_end;
+  // Sums allocated, which may exceed the ones in use after
+  // `reserve_summed_area_table`
+  size_t capacity;
+  SummedRgb *sums;
+} SummedAreaTable;
+
+SummedAreaTable *alloc_summed_area_table(size_t width, size_t height);
+// Resizes `*table` to width x height, only reallocating it (or allocating it,
+// when NULL) if its sums don't fit; `*table` is freed on failure
+int reserve_summed_area_table(SummedAreaTable **table, size_t width,
+                              size_t height);
+// Same as `reserve_summed_area_table`, but only for the image rows needed to
+// blur the rows [row_begin, row_end) of `image` with radii up to `m`
+int reserve_band_summed_area_table(SummedAreaTable **table, PpmImage *image,
+                                   size_t m, size_t row_begin,
+                                   size_t row_end);
+// Sums the image rows [row_begin, row_end), which must be inside the ones of
+// the table
+int sum_rows_summed_area_table(SummedAreaTable *table, PpmImage *image,
+                               size_t row_begin, size_t row_end);
+int sum_columns_summed_area_table(SummedAreaTable *table, size_t column_begin,
+                                  size_t column_end);
+int blur_at_summed_area_table(SummedAreaTable *table, size_t x, size_t y,
+                              size_t radius, RgbTriplet *rgb);
+void free_summed_area_table(SummedAreaTable **table);
+
+#endif // SUMMED_AREA_HEADER
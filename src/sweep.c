@@ -0,0 +1,281 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "sweep.h"
+#include "arena.h"
+#include "filter.h"
+#include "ppm.h"
+#include "summed_area.h"
+#include "thread_pool.h"
+#include "tiling.h"
+#include "trace.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+#define UNUSED(x) (void)(x)
+
+// Shared by every rank; combinations are handed out one at a time, as their
+// cost grows with `m`
+typedef struct sweep {
+  PpmImage *image;
+  SweepGrid *grid;
+  BatchSettings *settings;
+  const char *output_directory;
+  SummedAreaTable *table;
+  size_t combination_count, step;
+  atomic_size_t next_combination, failure_count;
+  atomic_int has_failed;
+} Sweep;
+
+static size_t count_sweep_values(const char *list) {
+  size_t count = 1;
+  for (const char *cursor = list; *cursor != '\0'; cursor++)
+    count += *cursor == ',';
+  return count;
+}
+
+// Each value must be followed by a comma, or by the end of the list
+static int parse_sweep_sizes(const char *list, size_t **values,
+                             size_t *count) {
+  *count = count_sweep_values(list);
+  *values = malloc(*count * sizeof(size_t));
+  if (*values == NULL)
+    return 0;
+  const char *cursor = list;
+  for (size_t idx = 0; idx < *count; idx++) {
+    int length;
+    if (sscanf(cursor, "%lu%n", &(*values)[idx], &length) != 1)
+      return 0;
+    cursor += length;
+    if (*cursor != ((idx + 1 < *count) ? ',' : '\0'))
+      return 0;
+    cursor++;
+  }
+  return 1;
+}
+
+static int parse_sweep_floats(const char *list, float **values,
+                              size_t *count) {
+  *count = count_sweep_values(list);
+  *values = malloc(*count * sizeof(float));
+  if (*values == NULL)
+    return 0;
+  const char *cursor = list;
+  for (size_t idx = 0; idx < *count; idx++) {
+    int length;
+    if (sscanf(cursor, "%f%n", &(*values)[idx], &length) != 1)
+      return 0;
+    cursor += length;
+    if (*cursor != ((idx + 1 < *count) ? ',' : '\0'))
+      return 0;
+    cursor++;
+  }
+  return 1;
+}
+
+int parse_sweep_grid(SweepGrid *grid, const char *ms, const char *thresholds,
+                     const char *sharpen_factors) {
+  *grid = (SweepGrid){.ms = NULL,
+                      .m_count = 0,
+                      .thresholds = NULL,
+                      .threshold_count = 0,
+                      .sharpen_factors = NULL,
+                      .sharpen_factor_count = 0};
+  ASSERT(parse_sweep_sizes(ms, &grid->ms, &grid->m_count),
+         "Error reading variable radius' `m` integer list",
+         parse_sweep_grid_error);
+  ASSERT(parse_sweep_sizes(thresholds, &grid->thresholds,
+                           &grid->threshold_count),
+         "Error reading sharpen's `threshold` integer list",
+         parse_sweep_grid_error);
+  for (size_t idx = 0; idx < grid->threshold_count; idx++)
+    ASSERT(grid->thresholds[idx] <= 255,
+           "Sharpen's `threshold` integer isn't inside 0..255 interval",
+           parse_sweep_grid_error);
+  ASSERT(parse_sweep_floats(sharpen_factors, &grid->sharpen_factors,
+                            &grid->sharpen_factor_count),
+         "Error reading sharpen's `sharpen_factor` float list",
+         parse_sweep_grid_error);
+  for (size_t idx = 0; idx < grid->sharpen_factor_count; idx++)
+    ASSERT(grid->sharpen_factors[idx] >= 0.0f &&
+               grid->sharpen_factors[idx] <= 2.0f,
+           "Sharpen's `sharpen_factor` float isn't inside 0..2 interval",
+           parse_sweep_grid_error);
+  return 1;
+parse_sweep_grid_error:
+  free_sweep_grid(grid);
+  return 0;
+}
+
+static void sum_rows_sweep_stage(void *void_ptr, size_t rank) {
+  Sweep *sweep = void_ptr;
+  size_t height = sweep->image->height;
+  uint64_t span = begin_trace_span();
+  if (!sum_rows_summed_area_table(sweep->table, sweep->image,
+                                  height * rank / sweep->step,
+                                  height * (rank + 1) / sweep->step))
+    atomic_store(&sweep->has_failed, 1);
+  end_trace_span("sum rows", span, (int64_t)rank);
+}
+
+static void sum_columns_sweep_stage(void *void_ptr, size_t rank) {
+  Sweep *sweep = void_ptr;
+  size_t width = sweep->image->width;
+  uint64_t span = begin_trace_span();
+  if (!sum_columns_summed_area_table(sweep->table, width * rank / sweep->step,
+                                     width * (rank + 1) / sweep->step))
+    atomic_store(&sweep->has_failed, 1);
+  end_trace_span("sum columns", span, (int64_t)rank);
+}
+
+// Filters `view`, which reads the parsed image, into its own write buffer and
+// saves it from there
+static int filter_sweep_combination(Sweep *sweep, size_t combination,
+                                    PpmImage *view, FilterScratch *scratch) {
+  SweepGrid *grid = sweep->grid;
+  BatchSettings *settings = sweep->settings;
+  size_t per_m = grid->threshold_count * grid->sharpen_factor_count;
+  size_t m = grid->ms[combination / per_m];
+  size_t raw_threshold =
+      grid->thresholds[(combination % per_m) / grid->sharpen_factor_count];
+  float sharpen_factor =
+      grid->sharpen_factors[combination % grid->sharpen_factor_count];
+  size_t tile_size = (settings->tile_size == SIZE_MAX) ? default_tile_size(m)
+                                                       : settings->tile_size;
+  // The combinations already run in parallel, so each one gets a thread
+  if (!filter_rows_ppm_image(view, ((float)raw_threshold) / 255.0f,
+                             sharpen_factor, m, 1, settings->blur_engine,
+                             tile_size, 0, view->height, scratch))
+    return 0;
+  const char *format = "%s/m%lu-t%lu-f%g.%s";
+  const char *extension = extension_ppm_format(settings->output_format);
+  int size = snprintf(NULL, 0, format, sweep->output_directory, m,
+                      raw_threshold, (double)sharpen_factor, extension);
+  char *path = malloc((size_t)size + 1);
+  if (path == NULL)
+    return 0;
+  snprintf(path, (size_t)size + 1, format, sweep->output_directory, m,
+           raw_threshold, (double)sharpen_factor, extension);
+  // Read-write, so binary outputs can be memory-mapped
+  FILE *output_file = fopen(path, "w+");
+  free(path);
+  if (output_file == NULL)
+    return 0;
+  PpmImage sharpened = *view;
+  sharpened.color_values_read = view->color_values_write;
+  sharpened.planes_read = view->planes_write;
+  int saved = save_formatted_ppm_image(&sharpened, output_file,
+                                       settings->output_format, 1);
+  return fclose(output_file) == 0 && saved;
+}
+
+static void sweep_stage(void *void_ptr, size_t rank) {
+  UNUSED(rank);
+  Sweep *sweep = void_ptr;
+  // Only the write buffer is per rank, allocated on its first combination
+  void *buffer = NULL;
+  PpmImage view = *sweep->image;
+  FilterScratch scratch = {.table = sweep->table,
+                           .work = NULL,
+                           .work_capacity = 0,
+                           .is_table_summed = sweep->table != NULL};
+  size_t combination;
+  while ((combination = atomic_fetch_add(&sweep->next_combination, 1)) <
+         sweep->combination_count) {
+    uint64_t span = begin_trace_span();
+    if (buffer == NULL) {
+      buffer = alloc_arena(buffer_size_ppm_image(sweep->image));
+      if (sweep->image->storage == PPM_STORAGE_TRIPLETS)
+        view.color_values_write = buffer;
+      else
+        view.planes_write = buffer;
+    }
+    if (buffer == NULL ||
+        !filter_sweep_combination(sweep, combination, &view, &scratch)) {
+      printf("Error filtering the sweep combination %lu\n", combination);
+      atomic_fetch_add(&sweep->failure_count, 1);
+    }
+    end_trace_span("combination", span, (int64_t)combination);
+  }
+  // The table belongs to the sweep
+  scratch.table = NULL;
+  free_filter_scratch(&scratch);
+  free_arena(buffer);
+}
+
+int sweep_ppm_image(FILE *source_file, const char *output_directory,
+                    SweepGrid *grid, BatchSettings *settings) {
+  int result = 0;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  Sweep sweep = {.image = NULL,
+                 .grid = grid,
+                 .settings = settings,
+                 .output_directory = output_directory,
+                 .table = NULL,
+                 .combination_count = grid->m_count * grid->threshold_count *
+                                      grid->sharpen_factor_count,
+                 .step = (settings->thread_count > 0)
+                             ? (size_t)settings->thread_count
+                             : 1};
+  atomic_init(&sweep.next_combination, 0);
+  atomic_init(&sweep.failure_count, 0);
+  atomic_init(&sweep.has_failed, 0);
+  ASSERT(mkdir(output_directory, 0777) == 0 || errno == EEXIST,
+         "Error creating the output directory", sweep_ppm_image_exit);
+  sweep.image =
+      read_ppm_image(source_file, settings->thread_count, settings->storage);
+  ASSERT(sweep.image != NULL, "Error reading the PPM image",
+         sweep_ppm_image_exit);
+  // The only radius-independent work, so it's shared by every combination
+  if (settings->blur_engine == BLUR_ENGINE_SUMMED_AREA) {
+    sweep.table =
+        alloc_summed_area_table(sweep.image->width, sweep.image->height);
+    ASSERT(sweep.table != NULL, "Error allocating the summed-area table",
+           sweep_ppm_image_exit);
+    // Every row must be summed before the column pass
+    run_thread_pool(sweep.step, sum_rows_sweep_stage, &sweep);
+    if (!atomic_load(&sweep.has_failed))
+      run_thread_pool(sweep.step, sum_columns_sweep_stage, &sweep);
+    ASSERT(!atomic_load(&sweep.has_failed),
+           "Error summing the summed-area table", sweep_ppm_image_exit);
+  }
+  size_t rank_count = (sweep.combination_count < sweep.step)
+                          ? sweep.combination_count
+                          : sweep.step;
+  run_thread_pool(rank_count, sweep_stage, &sweep);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (double)(end.tv_sec - begin.tv_sec) +
+                   (double)(end.tv_nsec - begin.tv_nsec) * 1e-9;
+  size_t failure_count = atomic_load(&sweep.failure_count);
+  fprintf(stderr, "Sweep of %lu combinations (%lu failed) in %.3f s\n",
+          sweep.combination_count, failure_count, seconds);
+  result = failure_count == 0;
+sweep_ppm_image_exit:
+  free_summed_area_table(&sweep.table);
+  free_ppm_image(&sweep.image);
+  return result;
+}
+
+void free_sweep_grid(SweepGrid *grid) {
+  if (grid == NULL)
+    return;
+  free(grid->ms);
+  free(grid->thresholds);
+  free(grid->sharpen_factors);
+  grid->ms = NULL;
+  grid->thresholds = NULL;
+  grid->sharpen_factors = NULL;
+}
@@ -0,0 +1,34 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef SWEEP_HEADER
+#define SWEEP_HEADER
+
+#include "batch.h"
+#include <stddef.h>
+#include <stdio.h>
+
+// Every combination of the listed `m`, raw 0..255 `threshold` and
+// `sharpen_factor` values
+typedef struct sweep_grid {
+  size_t *ms, m_count;
+  size_t *thresholds, threshold_count;
+  float *sharpen_factors;
+  size_t sharpen_factor_count;
+} SweepGrid;
+
+// Reads comma-separated lists, e.g. `3,5,7`, `50,100` and `0.5,1.25`
+int parse_sweep_grid(SweepGrid *grid, const char *ms, const char *thresholds,
+                     const char *sharpen_factors);
+// Parses the image of `source_file` once and filters it with every
+// combination of `grid`, in parallel, into `output_directory` as
+// `m<m>-t<threshold>-f<sharpen_factor>.ppm`. The summed-area table is built
+// once for all of them. The parameters of `settings` itself are ignored, and
+// a `SIZE_MAX` tile size picks the default one for each `m`. Returns 0 if any
+// combination failed, after trying all of them.
+int sweep_ppm_image(FILE *source_file, const char *output_directory,
+                    SweepGrid *grid, BatchSettings *settings);
+void free_sweep_grid(SweepGrid *grid);
+
+#endif // SWEEP_HEADER
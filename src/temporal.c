@@ -0,0 +1,257 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "temporal.h"
+#include "arena.h"
+#include "filter.h"
+#include "ppm.h"
+#include "thread_pool.h"
+#include "tiling.h"
+#include "trace.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+// The input of the tile differs from the previous frame's
+#define TILE_CHANGED 1
+// The tile is sharpened again, as it is within `m` pixels of a changed pixel
+#define TILE_SHARPENED 2
+
+// Shared by every rank; each one takes a contiguous run of tiles
+typedef struct temporal_stage {
+  TemporalCache *cache;
+  PpmImage *image;
+  TileGrid *grid;
+  size_t step;
+  atomic_int has_failed;
+} TemporalStage;
+
+static void tile_range(TemporalStage *stage, size_t rank, size_t *begin,
+                       size_t *end) {
+  *begin = stage->grid->count * rank / stage->step;
+  *end = stage->grid->count * (rank + 1) / stage->step;
+}
+
+static void compare_stage(void *void_ptr, size_t rank) {
+  TemporalStage *stage = void_ptr;
+  uint64_t span = begin_trace_span();
+  size_t begin, end;
+  tile_range(stage, rank, &begin, &end);
+  for (size_t tile = begin; tile < end; tile++) {
+    size_t *bounds = stage->cache->changed_bounds[tile];
+    tile_bounds(stage->grid, tile, &bounds[0], &bounds[1], &bounds[2],
+                &bounds[3]);
+    stage->cache->tile_flags[tile] =
+        changed_region_ppm_image(stage->image, PPM_BUFFER_READ,
+                                 stage->cache->input, &bounds[0], &bounds[1],
+                                 &bounds[2], &bounds[3])
+            ? TILE_CHANGED
+            : 0;
+  }
+  end_trace_span("compare tiles", span, (int64_t)rank);
+}
+
+// Fills the write buffer of the tiles that aren't sharpened again
+static void reuse_stage(void *void_ptr, size_t rank) {
+  TemporalStage *stage = void_ptr;
+  uint64_t span = begin_trace_span();
+  size_t begin, end;
+  tile_range(stage, rank, &begin, &end);
+  for (size_t tile = begin; tile < end; tile++) {
+    if (stage->cache->tile_flags[tile] & TILE_SHARPENED)
+      continue;
+    size_t x_begin, x_end, y_begin, y_end;
+    tile_bounds(stage->grid, tile, &x_begin, &x_end, &y_begin, &y_end);
+    if (!copy_region_ppm_image(stage->image, PPM_BUFFER_WRITE,
+                               stage->cache->output, 1, x_begin, x_end,
+                               y_begin, y_end))
+      atomic_store(&stage->has_failed, 1);
+  }
+  end_trace_span("reuse tiles", span, (int64_t)rank);
+}
+
+// Runs after the flush, when the read buffer holds the output and the write
+// buffer still holds the input
+static void snapshot_stage(void *void_ptr, size_t rank) {
+  TemporalStage *stage = void_ptr;
+  uint64_t span = begin_trace_span();
+  size_t begin, end;
+  tile_range(stage, rank, &begin, &end);
+  for (size_t tile = begin; tile < end; tile++) {
+    uint8_t flags = stage->cache->tile_flags[tile];
+    size_t x_begin, x_end, y_begin, y_end;
+    tile_bounds(stage->grid, tile, &x_begin, &x_end, &y_begin, &y_end);
+    if ((flags & TILE_CHANGED) &&
+        !copy_region_ppm_image(stage->image, PPM_BUFFER_WRITE,
+                               stage->cache->input, 0, x_begin, x_end,
+                               y_begin, y_end))
+      atomic_store(&stage->has_failed, 1);
+    if ((flags & TILE_SHARPENED) &&
+        !copy_region_ppm_image(stage->image, PPM_BUFFER_READ,
+                               stage->cache->output, 0, x_begin, x_end,
+                               y_begin, y_end))
+      atomic_store(&stage->has_failed, 1);
+  }
+  end_trace_span("snapshot tiles", span, (int64_t)rank);
+}
+
+// Grows the snapshots and tile lists of `cache` to fit `image`, forgetting the
+// previous frame when its shape differs
+static int reserve_temporal_cache(TemporalCache *cache, PpmImage *image,
+                                  TileGrid *grid) {
+  size_t size = buffer_size_ppm_image(image);
+  if (cache->has_frame &&
+      (cache->width != image->width || cache->height != image->height ||
+       cache->max_value != image->max_value ||
+       cache->storage != image->storage))
+    cache->has_frame = 0;
+  if (size > cache->capacity) {
+    free_arena(cache->input);
+    free_arena(cache->output);
+    cache->input = alloc_arena(size);
+    cache->output = alloc_arena(size);
+    cache->capacity = size;
+    cache->has_frame = 0;
+    ASSERT(cache->input != NULL && cache->output != NULL,
+           "Could not allocate the previous frame",
+           reserve_temporal_cache_error);
+  }
+  if (grid->count > cache->tile_capacity) {
+    free_arena(cache->tile_flags);
+    free_arena(cache->changed_bounds);
+    free_arena(cache->tiles);
+    cache->tile_flags = alloc_arena(grid->count);
+    cache->changed_bounds = alloc_arena(grid->count * sizeof(size_t[4]));
+    cache->tiles = alloc_arena(grid->count * sizeof(size_t));
+    cache->tile_capacity = grid->count;
+    ASSERT(cache->tile_flags != NULL && cache->changed_bounds != NULL &&
+               cache->tiles != NULL,
+           "Could not allocate the frame tiles", reserve_temporal_cache_error);
+  }
+  cache->width = image->width;
+  cache->height = image->height;
+  cache->max_value = image->max_value;
+  cache->storage = image->storage;
+  return 1;
+reserve_temporal_cache_error:
+  free_temporal_cache(cache);
+  return 0;
+}
+
+// Flags every tile within `halo` pixels of the changed pixels of a tile to be
+// sharpened, and lists them; returns how many there are
+static size_t list_sharpened_tiles(TemporalCache *cache, TileGrid *grid,
+                                   size_t halo) {
+  uint8_t *flags = cache->tile_flags;
+  for (size_t tile = 0; tile < grid->count; tile++) {
+    if (!(flags[tile] & TILE_CHANGED))
+      continue;
+    size_t *bounds = cache->changed_bounds[tile];
+    size_t x_begin = (bounds[0] < halo) ? 0 : bounds[0] - halo;
+    size_t x_end =
+        (bounds[1] + halo > grid->width) ? grid->width : bounds[1] + halo;
+    size_t y_begin = (bounds[2] < halo) ? 0 : bounds[2] - halo;
+    size_t y_end =
+        (bounds[3] + halo > grid->height) ? grid->height : bounds[3] + halo;
+    size_t column_begin = x_begin / grid->tile_size;
+    size_t column_end = (x_end - 1) / grid->tile_size;
+    size_t row_begin = y_begin / grid->tile_size;
+    size_t row_end = (y_end - 1) / grid->tile_size;
+    for (size_t y = row_begin; y <= row_end; y++)
+      for (size_t x = column_begin; x <= column_end; x++)
+        flags[y * grid->columns + x] |= TILE_SHARPENED;
+  }
+  size_t count = 0;
+  for (size_t tile = 0; tile < grid->count; tile++)
+    if (flags[tile] & TILE_SHARPENED)
+      cache->tiles[count++] = tile;
+  return count;
+}
+
+int filter_temporal_ppm_image(TemporalCache *cache, PpmImage *image,
+                              BatchSettings *settings) {
+  ASSERT(cache != NULL && image != NULL && settings != NULL,
+         "Temporal cache, image or settings is NULL", filter_temporal_error);
+  ASSERT(image->storage != PPM_STORAGE_INTERLEAVED,
+         "Interleaved images can't be filtered incrementally",
+         filter_temporal_error);
+  ASSERT(settings->thread_count >= 1, "Thread count must be positive",
+         filter_temporal_error);
+  size_t tile_size =
+      (settings->tile_size > 0) ? settings->tile_size : TEMPORAL_TILE_SIZE;
+  TileGrid grid = tile_grid(image->width, image->height, tile_size);
+  ASSERT(reserve_temporal_cache(cache, image, &grid),
+         "Error reserving the previous frame", filter_temporal_error);
+  TemporalStage stage = {.cache = cache,
+                         .image = image,
+                         .grid = &grid,
+                         .step = (size_t)settings->thread_count};
+  atomic_init(&stage.has_failed, 0);
+  size_t sharpened_count = grid.count;
+  if (cache->has_frame) {
+    run_thread_pool(stage.step, compare_stage, &stage);
+    // The blur of a pixel reads at most `m` pixels away from it
+    size_t halo = (settings->blur_engine == BLUR_ENGINE_SUMMED_AREA)
+                      ? image->width + image->height
+                      : settings->m;
+    sharpened_count = list_sharpened_tiles(cache, &grid, halo);
+    run_thread_pool(stage.step, reuse_stage, &stage);
+    ASSERT(!atomic_load(&stage.has_failed), "Error reusing the previous frame",
+           filter_temporal_error);
+  } else {
+    for (size_t tile = 0; tile < grid.count; tile++)
+      cache->tile_flags[tile] = TILE_CHANGED | TILE_SHARPENED;
+  }
+  cache->scratch.tiles = cache->tiles;
+  cache->scratch.tile_count = sharpened_count;
+  if (sharpened_count == grid.count)
+    cache->scratch.tiles = NULL;
+  if (sharpened_count > 0)
+    ASSERT(filter_rows_ppm_image(image, settings->threshold,
+                                 settings->sharpen_factor, settings->m,
+                                 settings->thread_count,
+                                 settings->blur_engine, tile_size, 0,
+                                 image->height, &cache->scratch),
+           "Error sharpening the changed tiles", filter_temporal_error);
+  ASSERT(flush_ppm_image(image), "Error flushing the image write buffer",
+         filter_temporal_error);
+  cache->has_frame = 0;
+  run_thread_pool(stage.step, snapshot_stage, &stage);
+  ASSERT(!atomic_load(&stage.has_failed), "Error saving the previous frame",
+         filter_temporal_error);
+  cache->has_frame = 1;
+  cache->tile_count += grid.count;
+  cache->reused_tile_count += grid.count - sharpened_count;
+  return 1;
+filter_temporal_error:
+  if (cache != NULL)
+    cache->has_frame = 0;
+  return 0;
+}
+
+void free_temporal_cache(TemporalCache *cache) {
+  if (cache == NULL)
+    return;
+  free_arena(cache->input);
+  free_arena(cache->output);
+  free_arena(cache->tile_flags);
+  free_arena(cache->changed_bounds);
+  free_arena(cache->tiles);
+  cache->input = NULL;
+  cache->output = NULL;
+  cache->tile_flags = NULL;
+  cache->changed_bounds = NULL;
+  cache->tiles = NULL;
+  cache->capacity = 0;
+  cache->tile_capacity = 0;
+  cache->has_frame = 0;
+  free_filter_scratch(&cache->scratch);
+}
@@ -0,0 +1,48 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef TEMPORAL_HEADER
+#define TEMPORAL_HEADER
+
+#include "batch.h"
+#include "filter.h"
+#include "ppm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Side of the tiles compared between frames when the sharpen isn't tiled
+#define TEMPORAL_TILE_SIZE 64
+
+// The previous frame of a sequence: its input and output, laid out like the
+// image buffers, and the filter memory reused between frames. Must start
+// zeroed.
+typedef struct temporal_cache {
+  uint8_t *input, *output;
+  size_t capacity;
+  size_t width, height;
+  uint16_t max_value;
+  PpmStorage storage;
+  uint8_t has_frame;
+  // Per-tile flags of the current frame, the box of changed pixels of every
+  // changed tile (x and y bounds), and the tiles to sharpen again
+  uint8_t *tile_flags;
+  size_t (*changed_bounds)[4];
+  size_t *tiles;
+  size_t tile_capacity;
+  FilterScratch scratch;
+  // Totals over every frame filtered so far
+  size_t tile_count, reused_tile_count;
+} TemporalCache;
+
+// Same as `filter_ppm_image` with the parameters of `settings`, but only the
+// tiles within `m` pixels of an input pixel that changed since the previous
+// frame are sharpened again; the others get the previous output,
+// which is exactly what a full pass would compute. With the `summed-area`
+// engine, whose sums depend on every pixel above and to the left, any change
+// sharpens the whole frame.
+int filter_temporal_ppm_image(TemporalCache *cache, PpmImage *image,
+                              BatchSettings *settings);
+void free_temporal_cache(TemporalCache *cache);
+
+#endif // TEMPORAL_HEADER
@@ -0,0 +1,290 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#define _GNU_SOURCE
+#include "thread_pool.h"
+#include "numa.h"
+#include "trace.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Polls before sleeping on a condition variable, since back-to-back stages
+// usually dispatch (and finish) again within a few microseconds; a released
+// pool stops polling as soon as another one is owned
+#define THREAD_POOL_SPIN_COUNT 20000
+// Pools that can run at the same time, e.g. one for each stage of the batch
+// pipeline plus the ones their ranks may start
+#define THREAD_POOL_MAX_COUNT 8
+
+typedef struct thread_pool {
+  // Set (under `claim_mutex`) while a caller owns the pool for a whole run
+  atomic_int is_owned;
+  // Guards the sleeps on `wake` and `done`
+  pthread_mutex_t mutex;
+  pthread_cond_t wake, done;
+  pthread_t *workers;
+  size_t worker_count;
+  // Current job, published by bumping `generation`
+  ThreadPoolRoutine routine;
+  void *context;
+  size_t rank_count;
+  _Atomic size_t generation, pending;
+} ThreadPool;
+
+// Where the workers of the first pool run; the others, which only exist
+// while the first one is busy, are left to the scheduler rather than piled
+// onto the same CPUs
+typedef struct thread_pool_placement {
+  size_t spin_count;
+  int is_pinning;
+  // CPUs the process may run on, grouped by node in the NUMA mode so that
+  // consecutive ranks (and the row bands they filter) share a node
+  int cpu_order[CPU_SETSIZE];
+  size_t allowed_cpu_count;
+} ThreadPoolPlacement;
+
+typedef struct worker_start {
+  ThreadPool *pool;
+  size_t rank, generation;
+} WorkerStart;
+
+static ThreadPool pools[THREAD_POOL_MAX_COUNT];
+static ThreadPoolPlacement placement;
+// Guards the `is_owned` flags and their count, signalling `released` when one
+// is cleared
+static pthread_mutex_t claim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t owned_pool_count;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Rank `rank` of the first pool goes to the rank-th CPU of `cpu_order`
+// (wrapping around), so the first one is left to the caller
+static void pin_thread_pool_rank(ThreadPool *pool, pthread_t thread,
+                                 size_t rank) {
+  if (!placement.is_pinning || pool != &pools[0])
+    return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(placement.cpu_order[rank % placement.allowed_cpu_count], &cpus);
+  pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus);
+}
+
+static void init_thread_pool_sync(ThreadPool *pool) {
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+}
+
+// The workers don't survive a `fork`, so the child starts over with none
+static void reset_thread_pools(void) {
+  pthread_mutex_init(&claim_mutex, NULL);
+  pthread_cond_init(&released, NULL);
+  for (size_t idx = 0; idx < THREAD_POOL_MAX_COUNT; idx++) {
+    ThreadPool *pool = &pools[idx];
+    init_thread_pool_sync(pool);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->worker_count = 0;
+    atomic_store(&pool->is_owned, 0);
+    atomic_store(&pool->pending, 0);
+  }
+  atomic_store(&owned_pool_count, 0);
+}
+
+static void init_thread_pool(void) {
+  for (size_t idx = 0; idx < THREAD_POOL_MAX_COUNT; idx++)
+    init_thread_pool_sync(&pools[idx]);
+  pthread_atfork(NULL, NULL, reset_thread_pools);
+  // Spinning only burns the time slice of the thread it waits for
+  placement.spin_count =
+      (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? THREAD_POOL_SPIN_COUNT : 0;
+  const char *pinning = getenv(THREAD_POOL_PINNING_VARIABLE);
+  placement.is_pinning = pinning == NULL || strcmp(pinning, "0") != 0;
+  cpu_set_t allowed_cpus;
+  if (placement.is_pinning &&
+      sched_getaffinity(0, sizeof(cpu_set_t), &allowed_cpus) == 0) {
+    int is_numa = is_numa_enabled();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed_cpus))
+        continue;
+      // Insertion by node, which keeps the CPUs of a node in order
+      size_t idx = placement.allowed_cpu_count++;
+      while (is_numa && idx > 0 &&
+             numa_node_of_cpu(placement.cpu_order[idx - 1]) >
+                 numa_node_of_cpu(cpu)) {
+        placement.cpu_order[idx] = placement.cpu_order[idx - 1];
+        idx--;
+      }
+      placement.cpu_order[idx] = cpu;
+    }
+  }
+  if (placement.allowed_cpu_count == 0)
+    placement.is_pinning = 0;
+  // Rank 0 runs on the caller, which must then stay on the node of its band
+  if (placement.is_pinning && is_numa_enabled())
+    pin_thread_pool_rank(&pools[0], pthread_self(), 0);
+}
+
+// Whether `pool` was released while another one is busy, and is then only
+// taking time from its workers
+static inline int is_thread_pool_idle(ThreadPool *pool) {
+  return !atomic_load_explicit(&pool->is_owned, memory_order_relaxed) &&
+         atomic_load_explicit(&owned_pool_count, memory_order_relaxed) > 0;
+}
+
+static size_t wait_generation(ThreadPool *pool, size_t seen) {
+  size_t generation;
+  for (size_t spin = 0; spin < placement.spin_count; spin++) {
+    generation = atomic_load_explicit(&pool->generation, memory_order_acquire);
+    if (generation != seen)
+      return generation;
+    if (is_thread_pool_idle(pool))
+      break;
+    spin_pause();
+  }
+  pthread_mutex_lock(&pool->mutex);
+  while ((generation = atomic_load_explicit(
+              &pool->generation, memory_order_acquire)) == seen)
+    pthread_cond_wait(&pool->wake, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+  return generation;
+}
+
+// Every worker acknowledges every job, even when its rank is not part of it,
+// so none of them can lag behind and read the fields of the next job
+static void *thread_pool_worker(void *void_ptr) {
+  WorkerStart *start = void_ptr;
+  ThreadPool *pool = start->pool;
+  size_t rank = start->rank, seen = start->generation;
+  free(start);
+  for (;;) {
+    seen = wait_generation(pool, seen);
+    if (rank < pool->rank_count)
+      pool->routine(pool->context, rank);
+    if (atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_acq_rel) ==
+        1) {
+      pthread_mutex_lock(&pool->mutex);
+      pthread_cond_signal(&pool->done);
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+  return NULL;
+}
+
+// Must own `pool`; stops early if a worker can't be created
+static void grow_thread_pool(ThreadPool *pool, size_t worker_count) {
+  if (worker_count <= pool->worker_count)
+    return;
+  pthread_t *workers =
+      realloc(pool->workers, worker_count * sizeof(pthread_t));
+  if (workers == NULL)
+    return;
+  pool->workers = workers;
+  while (pool->worker_count < worker_count) {
+    size_t rank = pool->worker_count + 1;
+    WorkerStart *start = malloc(sizeof(WorkerStart));
+    if (start == NULL)
+      return;
+    *start = (WorkerStart){.pool = pool,
+                           .rank = rank,
+                           .generation = atomic_load(&pool->generation)};
+    pthread_t *worker = &pool->workers[pool->worker_count];
+    if (pthread_create(worker, NULL, thread_pool_worker, start)) {
+      free(start);
+      return;
+    }
+    pthread_detach(*worker);
+    pin_thread_pool_rank(pool, *worker, rank);
+    pool->worker_count++;
+  }
+}
+
+static void wait_thread_pool(ThreadPool *pool) {
+  for (size_t spin = 0; spin < placement.spin_count; spin++) {
+    if (atomic_load_explicit(&pool->pending, memory_order_acquire) == 0)
+      return;
+    spin_pause();
+  }
+  pthread_mutex_lock(&pool->mutex);
+  while (atomic_load_explicit(&pool->pending, memory_order_acquire) != 0)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// The first idle pool, whose workers are the likeliest to be warm; waits for
+// one to be released when every pool is owned
+static ThreadPool *claim_thread_pool(void) {
+  pthread_mutex_lock(&claim_mutex);
+  for (;;) {
+    for (size_t idx = 0; idx < THREAD_POOL_MAX_COUNT; idx++)
+      if (!atomic_load(&pools[idx].is_owned)) {
+        atomic_store(&pools[idx].is_owned, 1);
+        atomic_fetch_add(&owned_pool_count, 1);
+        pthread_mutex_unlock(&claim_mutex);
+        return &pools[idx];
+      }
+    uint64_t span = begin_trace_span();
+    pthread_cond_wait(&released, &claim_mutex);
+    end_trace_span("pool claim", span, TRACE_NO_ARG);
+  }
+}
+
+static void release_thread_pool(ThreadPool *pool) {
+  pthread_mutex_lock(&claim_mutex);
+  atomic_store(&pool->is_owned, 0);
+  atomic_fetch_sub(&owned_pool_count, 1);
+  pthread_cond_signal(&released);
+  pthread_mutex_unlock(&claim_mutex);
+}
+
+int cpu_of_thread_pool_rank(size_t rank) {
+  pthread_once(&pool_once, init_thread_pool);
+  // The caller is only pinned in the NUMA mode
+  if (!placement.is_pinning || (rank == 0 && !is_numa_enabled()))
+    return -1;
+  return placement.cpu_order[rank % placement.allowed_cpu_count];
+}
+
+void run_thread_pool(size_t rank_count, ThreadPoolRoutine routine,
+                     void *context) {
+  if (rank_count <= 1) {
+    if (rank_count == 1)
+      routine(context, 0);
+    return;
+  }
+  pthread_once(&pool_once, init_thread_pool);
+  // Concurrent callers (e.g. the stages of a pipeline) get pools of their
+  // own, so none of them is serialised behind another
+  ThreadPool *pool = claim_thread_pool();
+  grow_thread_pool(pool, rank_count - 1);
+  pool->routine = routine;
+  pool->context = context;
+  pool->rank_count = rank_count;
+  atomic_store_explicit(&pool->pending, pool->worker_count,
+                        memory_order_relaxed);
+  pthread_mutex_lock(&pool->mutex);
+  atomic_fetch_add_explicit(&pool->generation, 1, memory_order_release);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+  routine(context, 0);
+  for (size_t rank = pool->worker_count + 1; rank < rank_count; rank++)
+    routine(context, rank);
+  // Time the caller spends waiting on stragglers
+  uint64_t span = begin_trace_span();
+  wait_thread_pool(pool);
+  end_trace_span("barrier", span, TRACE_NO_ARG);
+  release_thread_pool(pool);
+}
@@ -0,0 +1,33 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef THREAD_POOL_HEADER
+#define THREAD_POOL_HEADER
+
+#include <stddef.h>
+
+// Set to `0` to leave the workers unpinned
+#define THREAD_POOL_PINNING_VARIABLE "PP_EP2_PIN_THREADS"
+
+typedef void (*ThreadPoolRoutine)(void *context, size_t rank);
+
+// Runs `routine(context, rank)` once for every rank in [0, rank_count) and
+// returns after all of them finished. Rank 0 runs on the caller, the others
+// on a process-wide pool of pinned workers that is created on first use and
+// grown on demand, so successive stages and images pay no thread creation.
+// Ranks without a worker (if one could not be created) run on the caller, so
+// routines must not wait on each other. Calls made at the same time, such as
+// the stages of a pipeline or calls from inside a routine, each get a pool of
+// their own, whose workers are left unpinned; only when all of the few pools
+// are owned does a call wait for one. A process forked while the pools are
+// idle starts with no workers.
+void run_thread_pool(size_t rank_count, ThreadPoolRoutine routine,
+                     void *context);
+
+// CPU that `rank` of the first pool is pinned to, or -1 when it isn't (the
+// caller, rank 0, is only pinned in the NUMA mode of `numa.h`, once it first
+// runs the pool)
+int cpu_of_thread_pool_rank(size_t rank);
+
+#endif // THREAD_POOL_HEADER
@@ -0,0 +1,54 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "tiling.h"
+#include "ppm.h"
+#include <stddef.h>
+#include <unistd.h>
+
+#define FALLBACK_L2_SIZE (256 * 1024)
+#define TILE_SIZE_STEP 8
+
+// Largest multiple of 8 whose read window (tile plus an m-pixel halo on every
+// side) and write tile fit together in half of the L2 cache, leaving the
+// other half to the summed-area table rows and the stack
+size_t default_tile_size(size_t m) {
+  long l2_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  size_t budget = (l2_size > 0) ? (size_t)l2_size / 2 : FALLBACK_L2_SIZE / 2;
+  size_t tile_size = TILE_SIZE_STEP;
+  for (;;) {
+    size_t next = tile_size + TILE_SIZE_STEP;
+    size_t window = next + 2 * m;
+    size_t bytes = (window * window + next * next) * sizeof(RgbTriplet);
+    if (bytes > budget)
+      break;
+    tile_size = next;
+  }
+  return tile_size;
+}
+
+TileGrid tile_grid(size_t width, size_t height, size_t tile_size) {
+  if (tile_size == 0)
+    tile_size = 1;
+  size_t columns = (width + tile_size - 1) / tile_size;
+  size_t rows = (height + tile_size - 1) / tile_size;
+  return (TileGrid){.width = width,
+                    .height = height,
+                    .tile_size = tile_size,
+                    .columns = columns,
+                    .rows = rows,
+                    .count = columns * rows};
+}
+
+void tile_bounds(TileGrid *grid, size_t tile, size_t *x_begin, size_t *x_end,
+                 size_t *y_begin, size_t *y_end) {
+  *x_begin = (tile % grid->columns) * grid->tile_size;
+  *y_begin = (tile / grid->columns) * grid->tile_size;
+  *x_end = *x_begin + grid->tile_size;
+  *y_end = *y_begin + grid->tile_size;
+  if (*x_end > grid->width)
+    *x_end = grid->width;
+  if (*y_end > grid->height)
+    *y_end = grid->height;
+}
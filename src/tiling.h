@@ -0,0 +1,23 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef TILING_HEADER
+#define TILING_HEADER
+
+#include <stddef.h>
+
+// Square tiles laid over the image in row-major order; the last column and
+// row of tiles may be narrower
+typedef struct tile_grid {
+  size_t width, height;
+  size_t tile_size;
+  size_t columns, rows, count;
+} TileGrid;
+
+size_t default_tile_size(size_t m);
+TileGrid tile_grid(size_t width, size_t height, size_t tile_size);
+void tile_bounds(TileGrid *grid, size_t tile, size_t *x_begin, size_t *x_end,
+                 size_t *y_begin, size_t *y_end);
+
+#endif // TILING_HEADER
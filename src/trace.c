@@ -0,0 +1,123 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "trace.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct trace_event {
+  const char *name;
+  uint64_t begin, end;
+  int64_t arg;
+} TraceEvent;
+
+// Written only by its own thread. `count` is published with release stores,
+// so the dump sees every event below it complete without any lock.
+typedef struct trace_ring {
+  TraceEvent events[TRACE_RING_SIZE];
+  _Atomic uint64_t count;
+  size_t thread_id;
+  struct trace_ring *next;
+} TraceRing;
+
+int trace_is_enabled = 0;
+static const char *trace_path = NULL;
+static uint64_t trace_origin = 0;
+// Every ring ever created, pushed with a compare-and-swap
+static _Atomic(TraceRing *) trace_rings = NULL;
+static _Atomic size_t trace_thread_count = 0;
+static _Thread_local TraceRing *own_ring = NULL;
+
+uint64_t trace_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static TraceRing *alloc_trace_ring(void) {
+  TraceRing *ring = malloc(sizeof(TraceRing));
+  if (ring == NULL)
+    return NULL;
+  atomic_init(&ring->count, 0);
+  ring->thread_id = atomic_fetch_add(&trace_thread_count, 1);
+  ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&trace_rings, &ring->next,
+                                                ring, memory_order_release,
+                                                memory_order_relaxed))
+    ;
+  return ring;
+}
+
+void record_trace_span(const char *name, uint64_t begin, uint64_t end,
+                       int64_t arg) {
+  TraceRing *ring = own_ring;
+  if (ring == NULL) {
+    ring = own_ring = alloc_trace_ring();
+    // Spans are dropped rather than failing the run
+    if (ring == NULL)
+      return;
+  }
+  uint64_t count = atomic_load_explicit(&ring->count, memory_order_relaxed);
+  ring->events[count % TRACE_RING_SIZE] =
+      (TraceEvent){.name = name, .begin = begin, .end = end, .arg = arg};
+  atomic_store_explicit(&ring->count, count + 1, memory_order_release);
+}
+
+// Complete ("X") events in microseconds since tracing started, plus one
+// name per thread. Rings are left allocated, as detached pool workers may
+// still own them.
+static void dump_trace(void) {
+  FILE *trace_file = fopen(trace_path, "w");
+  if (trace_file == NULL) {
+    fprintf(stderr, "Error opening the trace file `%s`\n", trace_path);
+    return;
+  }
+  int pid = (int)getpid();
+  const char *separator = "";
+  fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  TraceRing *ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+  for (; ring != NULL; ring = ring->next) {
+    fprintf(trace_file,
+            "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"tid\": %lu, \"args\": {\"name\": \"thread %lu\"}}",
+            separator, pid, ring->thread_id, ring->thread_id);
+    separator = ",";
+    uint64_t count = atomic_load_explicit(&ring->count, memory_order_acquire);
+    uint64_t first = (count > TRACE_RING_SIZE) ? count - TRACE_RING_SIZE : 0;
+    for (uint64_t idx = first; idx < count; idx++) {
+      TraceEvent *event = &ring->events[idx % TRACE_RING_SIZE];
+      fprintf(trace_file,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+              "\"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f",
+              event->name, pid, ring->thread_id,
+              (double)(event->begin - trace_origin) * 1e-3,
+              (double)(event->end - event->begin) * 1e-3);
+      if (event->arg != TRACE_NO_ARG)
+        fprintf(trace_file, ", \"args\": {\"index\": %ld}", event->arg);
+      fprintf(trace_file, "}");
+    }
+    if (count > TRACE_RING_SIZE)
+      fprintf(stderr, "Trace of thread %lu lost its %lu oldest spans\n",
+              ring->thread_id, count - TRACE_RING_SIZE);
+  }
+  fprintf(trace_file, "\n]}\n");
+  if (fclose(trace_file) != 0)
+    fprintf(stderr, "Error closing the trace file `%s`\n", trace_path);
+}
+
+// Runs before `main`, so the flag is settled before any thread exists
+__attribute__((constructor)) static void init_trace(void) {
+  trace_path = getenv(TRACE_VARIABLE);
+  if (trace_path == NULL || trace_path[0] == '\0')
+    return;
+  trace_origin = trace_clock();
+  if (atexit(dump_trace) != 0)
+    return;
+  trace_is_enabled = 1;
+}
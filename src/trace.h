@@ -0,0 +1,38 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef TRACE_HEADER
+#define TRACE_HEADER
+
+#include <stdint.h>
+
+// Set to a file path to record spans and dump them there, as Chrome
+// trace-event JSON (chrome://tracing or ui.perfetto.dev), at exit
+#define TRACE_VARIABLE "PP_EP2_TRACE"
+// Spans kept per thread; the oldest are overwritten once it fills up
+#define TRACE_RING_SIZE 65536
+// `arg` of the spans that don't carry one
+#define TRACE_NO_ARG INT64_MIN
+
+// Set once before `main` runs and never changed afterwards
+extern int trace_is_enabled;
+
+uint64_t trace_clock(void);
+// Appends a span to the calling thread's ring; `name` must outlive the
+// process (e.g. a string literal)
+void record_trace_span(const char *name, uint64_t begin, uint64_t end,
+                       int64_t arg);
+
+// Starting a span costs a single predictable branch while tracing is off
+static inline uint64_t begin_trace_span(void) {
+  return __builtin_expect(trace_is_enabled, 0) ? trace_clock() : 0;
+}
+
+static inline void end_trace_span(const char *name, uint64_t begin,
+                                  int64_t arg) {
+  if (__builtin_expect(begin != 0, 0))
+    record_trace_span(name, begin, trace_clock(), arg);
+}
+
+#endif // TRACE_HEADER
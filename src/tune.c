@@ -0,0 +1,392 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "tune.h"
+#include "filter.h"
+#include "ppm.h"
+#include "tiling.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ASSERT(expr, msg, exit_label)                                          \
+  if (!(expr)) {                                                               \
+    puts(msg);                                                                 \
+    goto exit_label;                                                           \
+  }
+
+#define MAX_PATH 4096
+
+static const char *blur_engine_name(BlurEngine blur_engine) {
+  return (blur_engine == BLUR_ENGINE_SUMMED_AREA) ? "summed-area" : "window";
+}
+
+// E.g. `window, 4 threads, 64x64 tiles`
+static void describe_tune_choice(TuneChoice *choice, char *buffer,
+                                 size_t size) {
+  int length = snprintf(buffer, size, "%s, %d threads, ",
+                        blur_engine_name(choice->blur_engine),
+                        choice->thread_count);
+  if (length < 0 || (size_t)length >= size)
+    return;
+  if (choice->tile_size > 0)
+    snprintf(&buffer[length], size - (size_t)length, "%lux%lu tiles",
+             choice->tile_size, choice->tile_size);
+  else
+    snprintf(&buffer[length], size - (size_t)length, "whole rows");
+}
+
+static size_t size_class(size_t pixel_count) {
+  size_t size_class = 0;
+  while (pixel_count > 1) {
+    pixel_count >>= 1;
+    size_class++;
+  }
+  return size_class;
+}
+
+static inline size_t distance(size_t a, size_t b) {
+  return (a > b) ? a - b : b - a;
+}
+
+static char *default_tune_profile_path(void) {
+  char directory[MAX_PATH], host[256];
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache != NULL && cache[0] != '\0') {
+    snprintf(directory, MAX_PATH, "%s", cache);
+  } else if (home != NULL) {
+    snprintf(directory, MAX_PATH, "%s/.cache", home);
+  } else {
+    return NULL;
+  }
+  size_t length = strlen(directory);
+  snprintf(&directory[length], MAX_PATH - length, "/pp-ep2");
+  if (gethostname(host, sizeof(host)) != 0)
+    snprintf(host, sizeof(host), "localhost");
+  host[sizeof(host) - 1] = '\0';
+  size_t size = strlen(directory) + strlen(host) + sizeof("/.profile");
+  char *path = malloc(size);
+  if (path != NULL)
+    snprintf(path, size, "%s/%s.profile", directory, host);
+  return path;
+}
+
+// Creates every missing directory above `path`, like `mkdir -p`
+static int make_parent_directories(const char *path) {
+  char directory[MAX_PATH];
+  snprintf(directory, MAX_PATH, "%s", path);
+  for (char *slash = strchr(&directory[1], '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST)
+      return 0;
+    *slash = '/';
+  }
+  return 1;
+}
+
+static int append_tune_entry(TuneProfile *profile, TuneEntry *entry) {
+  if (profile->entry_count == profile->entry_capacity) {
+    size_t capacity =
+        (profile->entry_capacity > 0) ? profile->entry_capacity * 2 : 16;
+    TuneEntry *grown = realloc(profile->entries, capacity * sizeof(TuneEntry));
+    if (grown == NULL)
+      return 0;
+    profile->entries = grown;
+    profile->entry_capacity = capacity;
+  }
+  profile->entries[profile->entry_count++] = *entry;
+  return 1;
+}
+
+int load_tune_profile(TuneProfile *profile) {
+  int result = 0;
+  FILE *profile_file = NULL;
+  char line[512], engine[32];
+  ASSERT(profile != NULL, "Tune profile is NULL", load_tune_profile_exit);
+  *profile = (TuneProfile){.path = NULL,
+                           .entries = NULL,
+                           .entry_count = 0,
+                           .entry_capacity = 0};
+  const char *path = getenv(TUNE_PROFILE_VARIABLE);
+  profile->path = (path != NULL) ? strdup(path) : default_tune_profile_path();
+  // Without a path there is no profile, which is only an error when saving
+  if (profile->path == NULL) {
+    result = 1;
+    goto load_tune_profile_exit;
+  }
+  profile_file = fopen(profile->path, "r");
+  if (profile_file == NULL) {
+    result = errno == ENOENT;
+    ASSERT(result, "Error opening the tune profile", load_tune_profile_exit);
+    goto load_tune_profile_exit;
+  }
+  // One `<variant> <size class> <m> <engine> <threads> <tile> <seconds>`
+  // entry per line, `#` starting a comment
+  while (fgets(line, sizeof(line), profile_file) != NULL) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    TuneEntry entry;
+    ASSERT(sscanf(line, "%63s %lu %lu %31s %d %lu %lf", entry.variant,
+                  &entry.size_class, &entry.m, engine,
+                  &entry.choice.thread_count, &entry.choice.tile_size,
+                  &entry.choice.seconds) == 7 &&
+               entry.choice.thread_count >= 1,
+           "Error reading a tune profile entry", load_tune_profile_exit);
+    entry.choice.blur_engine = (strcmp(engine, "summed-area") == 0)
+                                   ? BLUR_ENGINE_SUMMED_AREA
+                                   : BLUR_ENGINE_WINDOW;
+    ASSERT(append_tune_entry(profile, &entry),
+           "Could not allocate the tune profile", load_tune_profile_exit);
+  }
+  result = 1;
+load_tune_profile_exit:
+  if (profile_file != NULL)
+    fclose(profile_file);
+  return result;
+}
+
+int find_tune_profile(TuneProfile *profile, const char *variant,
+                      size_t pixel_count, size_t m, TuneChoice *choice) {
+  TuneEntry *best = NULL;
+  size_t target_class = size_class(pixel_count);
+  for (size_t idx = 0; idx < profile->entry_count; idx++) {
+    TuneEntry *entry = &profile->entries[idx];
+    if (strcmp(entry->variant, variant) != 0)
+      continue;
+    size_t class_distance = distance(entry->size_class, target_class);
+    if (best == NULL ||
+        class_distance < distance(best->size_class, target_class) ||
+        (class_distance == distance(best->size_class, target_class) &&
+         distance(entry->m, m) < distance(best->m, m)))
+      best = entry;
+  }
+  if (best == NULL)
+    return 0;
+  *choice = best->choice;
+  return 1;
+}
+
+int save_tune_profile(TuneProfile *profile, const char *variant,
+                      size_t pixel_count, size_t m, TuneChoice *choice) {
+  int result = 0;
+  FILE *profile_file = NULL;
+  char *temporary_path = NULL;
+  ASSERT(profile != NULL && profile->path != NULL,
+         "Tune profile was not loaded", save_tune_profile_exit);
+  TuneEntry entry = {.size_class = size_class(pixel_count),
+                     .m = m,
+                     .choice = *choice};
+  snprintf(entry.variant, sizeof(entry.variant), "%s", variant);
+  size_t idx = 0;
+  while (idx < profile->entry_count &&
+         (strcmp(profile->entries[idx].variant, entry.variant) != 0 ||
+          profile->entries[idx].size_class != entry.size_class ||
+          profile->entries[idx].m != m))
+    idx++;
+  if (idx < profile->entry_count)
+    profile->entries[idx] = entry;
+  else
+    ASSERT(append_tune_entry(profile, &entry),
+           "Could not allocate the tune profile", save_tune_profile_exit);
+  // Written aside and renamed over, so concurrent runs never read half of it
+  size_t size = strlen(profile->path) + sizeof(".tmp");
+  temporary_path = malloc(size);
+  ASSERT(temporary_path != NULL, "Could not allocate the tune profile path",
+         save_tune_profile_exit);
+  snprintf(temporary_path, size, "%s.tmp", profile->path);
+  ASSERT(make_parent_directories(profile->path),
+         "Error creating the tune profile directory", save_tune_profile_exit);
+  profile_file = fopen(temporary_path, "w");
+  ASSERT(profile_file != NULL, "Error opening the tune profile",
+         save_tune_profile_exit);
+  fprintf(profile_file,
+          "# variant size_class m engine threads tile seconds\n");
+  for (idx = 0; idx < profile->entry_count; idx++) {
+    TuneEntry *saved = &profile->entries[idx];
+    fprintf(profile_file, "%s %lu %lu %s %d %lu %.6f\n", saved->variant,
+            saved->size_class, saved->m,
+            blur_engine_name(saved->choice.blur_engine),
+            saved->choice.thread_count, saved->choice.tile_size,
+            saved->choice.seconds);
+  }
+  int is_closed = fclose(profile_file) == 0;
+  profile_file = NULL;
+  ASSERT(is_closed && rename(temporary_path, profile->path) == 0,
+         "Error saving the tune profile", save_tune_profile_exit);
+  result = 1;
+save_tune_profile_exit:
+  if (profile_file != NULL)
+    fclose(profile_file);
+  free(temporary_path);
+  return result;
+}
+
+void free_tune_profile(TuneProfile *profile) {
+  if (profile == NULL)
+    return;
+  free(profile->path);
+  free(profile->entries);
+  profile->path = NULL;
+  profile->entries = NULL;
+  profile->entry_count = 0;
+  profile->entry_capacity = 0;
+}
+
+static double elapsed_seconds(struct timespec *begin) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - begin->tv_sec) +
+         (double)(end.tv_nsec - begin->tv_nsec) * 1e-9;
+}
+
+// Fastest of TUNE_PASS_COUNT passes over the rows [row_begin, row_end);
+// negative on failure
+static double time_tune_pass(PpmImage *image, float threshold,
+                             float sharpen_factor, size_t m,
+                             TuneChoice *choice, size_t row_begin,
+                             size_t row_end, FilterScratch *scratch) {
+  double fastest = -1.0;
+  for (size_t pass = 0; pass < TUNE_PASS_COUNT; pass++) {
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (!filter_rows_ppm_image(image, threshold, sharpen_factor, m,
+                               choice->thread_count, choice->blur_engine,
+                               choice->tile_size, row_begin, row_end,
+                               scratch))
+      return -1.0;
+    double seconds = elapsed_seconds(&begin);
+    if (fastest < 0.0 || seconds < fastest)
+      fastest = seconds;
+  }
+  return fastest;
+}
+
+// Scales the band to the whole image. The summed-area table also covers the
+// `m` rows around the band, so its share is timed apart and scaled by its own
+// rows.
+static int estimate_tune_choice(PpmImage *image, float threshold,
+                                float sharpen_factor, size_t m,
+                                TuneChoice *choice, size_t row_begin,
+                                size_t row_end, FilterScratch *scratch) {
+  double scale = (double)image->height / (double)(row_end - row_begin);
+  scratch->is_table_summed = 0;
+  double seconds = time_tune_pass(image, threshold, sharpen_factor, m, choice,
+                                  row_begin, row_end, scratch);
+  if (seconds < 0.0)
+    return 0;
+  if (choice->blur_engine == BLUR_ENGINE_SUMMED_AREA) {
+    scratch->is_table_summed = 1;
+    double band_seconds =
+        time_tune_pass(image, threshold, sharpen_factor, m, choice, row_begin,
+                       row_end, scratch);
+    scratch->is_table_summed = 0;
+    if (band_seconds < 0.0)
+      return 0;
+    double table_seconds =
+        (seconds > band_seconds) ? seconds - band_seconds : 0.0;
+    size_t table_rows = scratch->table->row_end - scratch->table->row_begin;
+    choice->seconds =
+        table_seconds * (double)image->height / (double)table_rows +
+        band_seconds * scale;
+  } else {
+    choice->seconds = seconds * scale;
+  }
+  return 1;
+}
+
+int autotune_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
+                       size_t m, TuneChoice *best) {
+  int result = 0;
+  FilterScratch scratch = {.table = NULL, .work = NULL, .work_capacity = 0};
+  ASSERT(image != NULL && best != NULL, "PPM image or tune choice is NULL",
+         autotune_exit);
+  ASSERT(image->height > 0, "PPM image is empty", autotune_exit);
+  long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  // Variants that ignore the thread count are only timed with one thread
+  int cpu_count = (online_cpus > 0 && filter_is_threaded()) ? (int)online_cpus
+                                                            : 1;
+  // The band sits in the middle, away from the clamped borders
+  size_t band_rows = image->height / TUNE_BAND_FRACTION;
+  if (band_rows < TUNE_BAND_MIN_ROWS)
+    band_rows = TUNE_BAND_MIN_ROWS;
+  if (band_rows > image->height)
+    band_rows = image->height;
+  size_t row_begin = (image->height - band_rows) / 2;
+  size_t tile_sizes[3] = {0, default_tile_size(m), default_tile_size(m) / 2};
+  BlurEngine blur_engines[2] = {BLUR_ENGINE_WINDOW, BLUR_ENGINE_SUMMED_AREA};
+  char description[128];
+  best->seconds = -1.0;
+  for (size_t engine = 0; engine < 2; engine++) {
+    for (int thread_count = 1;; thread_count *= 2) {
+      if (thread_count > cpu_count)
+        thread_count = cpu_count;
+      for (size_t tile = 0; tile < 3; tile++) {
+        TuneChoice choice = {.blur_engine = blur_engines[engine],
+                             .thread_count = thread_count,
+                             .tile_size = tile_sizes[tile]};
+        ASSERT(estimate_tune_choice(image, threshold, sharpen_factor, m,
+                                    &choice, row_begin, row_begin + band_rows,
+                                    &scratch),
+               "Error running a calibration pass", autotune_exit);
+        describe_tune_choice(&choice, description, sizeof(description));
+        fprintf(stderr, "Tuning: %s: %.6f s\n", description, choice.seconds);
+        if (best->seconds < 0.0 || choice.seconds < best->seconds)
+          *best = choice;
+      }
+      if (thread_count == cpu_count)
+        break;
+    }
+  }
+  describe_tune_choice(best, description, sizeof(description));
+  fprintf(stderr, "Tuned: %s\n", description);
+  result = 1;
+autotune_exit:
+  free_filter_scratch(&scratch);
+  return result;
+}
+
+int choose_tune_settings(PpmImage *image, const char *variant, int is_tuning,
+                         float threshold, float sharpen_factor, size_t m,
+                         TuneChoice *choice, int *is_chosen) {
+  int result = 0;
+  TuneProfile profile;
+  *is_chosen = 0;
+  int is_loaded = load_tune_profile(&profile);
+  size_t pixel_count = image->width * image->height;
+  if (!is_tuning) {
+    *is_chosen = is_loaded &&
+                 find_tune_profile(&profile, variant, pixel_count, m, choice);
+    if (*is_chosen) {
+      char description[128];
+      describe_tune_choice(choice, description, sizeof(description));
+      // Options given explicitly still override it
+      fprintf(stderr, "Tune profile entry: %s\n", description);
+    }
+    result = 1;
+    goto choose_tune_settings_exit;
+  }
+  ASSERT(is_loaded, "Error loading the tune profile",
+         choose_tune_settings_exit);
+  ASSERT(profile.path != NULL,
+         "Could not find a tune profile path (set `" TUNE_PROFILE_VARIABLE
+         "` or `HOME`)",
+         choose_tune_settings_exit);
+  ASSERT(autotune_ppm_image(image, threshold, sharpen_factor, m, choice),
+         "Error running the calibration passes", choose_tune_settings_exit);
+  ASSERT(save_tune_profile(&profile, variant, pixel_count, m, choice),
+         "Error saving the tune profile", choose_tune_settings_exit);
+  *is_chosen = 1;
+  result = 1;
+choose_tune_settings_exit:
+  free_tune_profile(&profile);
+  return result;
+}
@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2025 Guilherme Leoi <leoi.guilherme@aluno.ufabc.edu.br>
+//
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#ifndef TUNE_HEADER
+#define TUNE_HEADER
+
+#include "filter.h"
+#include "ppm.h"
+#include <stddef.h>
+
+// Path of the profile, instead of `<cache>/pp-ep2/<hostname>.profile` (the
+// cache being `$XDG_CACHE_HOME` or `~/.cache`)
+#define TUNE_PROFILE_VARIABLE "PP_EP2_TUNE_PROFILE"
+// Calibration passes sharpen one band of rows, this fraction of the image
+// (but at least TUNE_BAND_MIN_ROWS), and keep the fastest of TUNE_PASS_COUNT
+#define TUNE_BAND_FRACTION 8
+#define TUNE_BAND_MIN_ROWS 64
+#define TUNE_PASS_COUNT 3
+
+typedef struct tune_choice {
+  BlurEngine blur_engine;
+  int thread_count;
+  // 0 sharpens whole rows, as in `filter_ppm_image`
+  size_t tile_size;
+  // Estimated for the whole image
+  double seconds;
+} TuneChoice;
+
+// Best choice of a variant for images of about 2^`size_class` pixels and a
+// given `m`
+typedef struct tune_entry {
+  char variant[64];
+  size_t size_class, m;
+  TuneChoice choice;
+} TuneEntry;
+
+// Entries of the profile file of this host; a missing file is just empty, and
+// so is a missing path (NULL), which can't be saved to
+typedef struct tune_profile {
+  char *path;
+  TuneEntry *entries;
+  size_t entry_count, entry_capacity;
+} TuneProfile;
+
+int load_tune_profile(TuneProfile *profile);
+// Looks up the entry of `variant` closest to the image size (then to `m`);
+// returns 0 when the variant has none
+int find_tune_profile(TuneProfile *profile, const char *variant,
+                      size_t pixel_count, size_t m, TuneChoice *choice);
+// Adds (or replaces) the entry of `variant` for the image size and `m`, and
+// rewrites the profile file
+int save_tune_profile(TuneProfile *profile, const char *variant,
+                      size_t pixel_count, size_t m, TuneChoice *choice);
+void free_tune_profile(TuneProfile *profile);
+
+// Runs `autotune_ppm_image` and saves its choice to the profile when
+// `is_tuning`, or else looks the profile up, setting `*is_chosen` to whether
+// there was an entry for `variant`. Only fails when tuning.
+int choose_tune_settings(PpmImage *image, const char *variant, int is_tuning,
+                         float threshold, float sharpen_factor, size_t m,
+                         TuneChoice *choice, int *is_chosen);
+// Times every blur engine, thread count (powers of two up to the online
+// CPUs, or just one when `filter_is_threaded` is false) and tiling (whole
+// rows, `default_tile_size(m)` and half of it) on a band of `image`, printing
+// the estimate of each to stderr. Only the write buffer of `image` is
+// touched, and left stale.
+int autotune_ppm_image(PpmImage *image, float threshold, float sharpen_factor,
+                       size_t m, TuneChoice *best);
+
+#endif // TUNE_HEADER
@@ -19,17 +19,36 @@ PTHREADS_VARIANT="$CC,pthreads,"
 LOOP_PARAMETERS="$SEQ_VARIANT;$OMP_VARIANT;$PTHREADS_VARIANT;"
 while IFS=',' read -d';' -r CC VARIANT EXTRA_ARGS; do
     echo "Compiling $VARIANT variant with $CC..."
-    $CC -xc src/main.c "src/ppm.c" "src/$VARIANT.c" -lm -O3 \
+    $CC -xc src/main.c "src/arena.c" "src/batch.c" "src/numa.c" \
+        "src/ppm.c" "src/shard.c" "src/sharpen.c" "src/summed_area.c" \
+        "src/simd.c" "src/stream.c" "src/sweep.c" "src/temporal.c" \
+        "src/thread_pool.c" "src/tiling.c" "src/trace.c" "src/tune.c" \
+        "src/$VARIANT.c" -lm -O3 \
         -Wall -Wextra -Wdouble-promotion -Wconversion \
         -Wno-sign-conversion $EXTRA_ARGS \
         -flto -o target/release/$VARIANT
+    echo "Compiling $VARIANT benchmark with $CC..."
+    $CC -xc src/benchmark.c "src/arena.c" "src/ppm.c" "src/summed_area.c" \
+        "src/sharpen.c" "src/simd.c" "src/numa.c" "src/thread_pool.c" \
+        "src/tiling.c" "src/trace.c" "src/$VARIANT.c" -lm -O3 \
+        -Wall -Wextra -Wdouble-promotion -Wconversion \
+        -Wno-sign-conversion $EXTRA_ARGS "-DFILTER_VARIANT=\"$VARIANT\"" \
+        -flto -o target/release/benchmark-$VARIANT
+    echo "Compiling $VARIANT library with $CC..."
+    $CC -xc src/session.c "src/arena.c" "src/ppm.c" "src/summed_area.c" \
+        "src/sharpen.c" "src/simd.c" "src/numa.c" "src/thread_pool.c" \
+        "src/tiling.c" "src/trace.c" "src/$VARIANT.c" -lm -O3 \
+        -Wall -Wextra -Wdouble-promotion -Wconversion \
+        -Wno-sign-conversion $EXTRA_ARGS -shared -fPIC \
+        -fvisibility=hidden -flto -o target/release/libfilter-$VARIANT.so
 done <<< "$LOOP_PARAMETERS"
 echo "All CPU variants were compiled!"
 
 CC=$OLD_CC
 
 echo "Compiling checker with $CC..."
-$CC -xc src/checker.c src/ppm.c -lm -O3 \
+$CC -xc src/checker.c src/arena.c src/numa.c src/ppm.c src/simd.c \
+    src/thread_pool.c src/trace.c -lm -O3 \
     -Wall -Wextra -Wdouble-promotion -Wconversion \
     -Wno-sign-conversion \
     -flto -o target/release/checker